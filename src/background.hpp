@@ -0,0 +1,99 @@
+#ifndef BACKGROUND
+#define BACKGROUND
+#include "data.hpp"
+#include "profile.hpp"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// a custom universe of symbols for the single set tests (the expressed
+// genes, the genotyped snps), in place of the whole dataset. the in
+// universe size of every annotation is counted once and kept, so a query
+// only counts its own test set restricted to the universe. the sizes are
+// counted again when a query restricts its set after the dataset changed,
+// so anno_size reads them as they were at the last query.
+// it mirrors the dataset calls the tests make (total_syms, anno_size,
+// count_set), so a background scores like a dataset would. dataset must
+// outlive it
+template <typename D> class Background {
+public:
+  typedef SymSet<typename D::sym_type, typename D::anno_type> set_type;
+
+private:
+  const D *source;
+  std::vector<unsigned> idxs;
+  // one bit per symbol of dataset, set for the members
+  std::vector<uint64_t> member;
+  unsigned build_threads;
+  // the sizes and the dataset version they were counted on
+  mutable std::vector<unsigned> counts;
+  mutable std::atomic<uint64_t> counted;
+  mutable std::mutex lock;
+
+  void _build(const set_type &universe) {
+    ENRICHED_PHASE(phase_set);
+    idxs = universe.get_idxs();
+    member.assign((source->total_syms() + 63) / 64, 0);
+    for (const unsigned &s : idxs) {
+      member[s >> 6] |= uint64_t(1) << (s & 63);
+    }
+    counts = source->count_set(universe, build_threads).counts;
+    counted.store(source->version());
+  };
+  void _refresh() const {
+    const uint64_t version = source->version();
+    if (counted.load(std::memory_order_acquire) == version)
+      return;
+    std::lock_guard<std::mutex> guard(lock);
+    if (counted.load(std::memory_order_relaxed) == version)
+      return;
+    counts = source->count_set(set_type::from_idxs(idxs, *source),
+                               build_threads)
+                 .counts;
+    counted.store(version, std::memory_order_release);
+  };
+
+public:
+  Background(const set_type &universe, const D &dataset,
+             const unsigned &threads = 1)
+      : source(&dataset), build_threads(threads) {
+    _build(universe);
+  };
+  // symbols not in dataset are left out
+  Background(const std::vector<std::string> &universe, const D &dataset,
+             const unsigned &threads = 1)
+      : source(&dataset), build_threads(threads) {
+    _build(set_type(universe, dataset));
+  };
+  const D &dataset() const { return *source; };
+  const std::vector<unsigned> &get_idxs() const { return idxs; };
+  bool contains(const unsigned &idx) const {
+    return (idx >> 6) < member.size() && member[idx >> 6] >> (idx & 63) & 1;
+  };
+  // size of the universe
+  unsigned total_syms() const { return idxs.size(); };
+  unsigned total_annos() const { return counts.size(); };
+  // symbols of an annotation in the universe
+  unsigned anno_size(const unsigned &idx) const { return counts[idx]; };
+  // the members of a set that are in the universe; a query starts here, so
+  // this is where the sizes catch up with the dataset
+  template <typename S> set_type restrict(const S &set) const {
+    _refresh();
+    std::vector<unsigned> out;
+    out.reserve(set.size());
+    for (const unsigned &s : set.get_idxs()) {
+      if (contains(s))
+        out.push_back(s);
+    }
+    return set_type::from_idxs(std::move(out), *source);
+  };
+  // counts of the set restricted to the universe, by the cheapest path of
+  // dataset
+  template <typename S>
+  anno_counts count_set(const S &set, const unsigned &threads = 1) const {
+    return source->count_set(restrict(set), threads);
+  };
+};
+#endif
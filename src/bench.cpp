@@ -0,0 +1,321 @@
+#include "pch.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+
+// stage benchmarks over synthetic datasets. every dataset is generated from
+// a fixed seed, written as the same TSV files the loaders read and then
+// timed stage by stage: parsing, gen_mappings, SymSet construction, the
+// tests, ResultDataset::print and the result writers
+//
+//   bench [--scale 1k|20k|200k|all] [--reps n] [--dir path]
+//         [--out results.ndjson] [--baseline results.ndjson]
+//         [--tolerance 0.1]
+//
+// results are written one JSON object per stage and line; with a baseline
+// every stage whose median got slower by more than the tolerance is
+// reported and the exit code is 1. there is no build manifest, from src/:
+//
+//   g++ -std=c++17 -O2 -pthread bench.cpp -o bench
+//   ./bench --dir /tmp --baseline ../data/bench.1k.ndjson
+//
+// data/bench.1k.ndjson is the 1k scale at the default 20 reps and the
+// fixed seeds below; timings are per machine, so regenerate it with
+// --out before comparing on another one
+
+// allocations are counted by replacing the global operator new
+static std::atomic<size_t> alloc_count{0}, alloc_bytes{0};
+
+void *operator new(size_t n) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+  if (void *p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+// out of line, or gcc sees free() called on memory from operator new once
+// it is inlined (-Wmismatched-new-delete). sized deletes go through it too
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+void operator delete(void *p, std::size_t) noexcept { ::operator delete(p); }
+
+// symbol masks must cover 200k symbols, annotation masks 50k annotations
+typedef Dataset<symbol16, annotation18> BenchDataset;
+typedef SymSet<symbol16, annotation18> BenchSet;
+
+struct scale {
+  std::string name;
+  unsigned syms, annos, max_term;
+  bool masks;
+};
+
+const std::vector<scale> scales = {
+    {"1k", 1000, 2000, 300, true},
+    {"20k", 20000, 20000, 2000, false},
+    {"200k", 200000, 50000, 10000, false},
+};
+
+struct stage_result {
+  std::string scale, stage;
+  std::vector<double> ms;
+  double items = 0;
+  size_t allocs = 0, bytes = 0;
+  double percentile(const double &q) const {
+    std::vector<double> v = ms;
+    std::sort(v.begin(), v.end());
+    const size_t rank = static_cast<size_t>(std::ceil(q * v.size()));
+    return v[std::max<size_t>(rank, 1) - 1];
+  };
+  double mean() const {
+    double sum = 0;
+    for (const double &m : ms) {
+      sum += m;
+    }
+    return sum / ms.size();
+  };
+};
+
+// runs fn reps times, timing each run; items is the amount of work one run
+// does, for the throughput column
+template <typename F>
+stage_result run_stage(const std::string &scale, const std::string &stage,
+                       const unsigned &reps, const double &items, F &&fn) {
+  stage_result out;
+  out.scale = scale;
+  out.stage = stage;
+  out.items = items;
+  const size_t count = alloc_count, bytes = alloc_bytes;
+  for (unsigned r = 0; r < reps; ++r) {
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const auto stop = std::chrono::steady_clock::now();
+    out.ms.push_back(
+        std::chrono::duration<double, std::milli>(stop - start).count());
+  }
+  out.allocs = (alloc_count - count) / reps;
+  out.bytes = (alloc_bytes - bytes) / reps;
+  return out;
+}
+
+// power law term sizes: term t holds about max_term / (t + 1)^0.8 random
+// symbols, at least 3. names are long enough to live on the heap, as real
+// GO term names do
+void generate(const scale &sc, const std::string &anno_file,
+              const std::string &sym_file) {
+  counter_rng rng(42, sc.syms);
+  std::vector<std::vector<unsigned>> sym_terms(sc.syms);
+  std::ofstream annos(anno_file);
+  for (unsigned t = 0; t < sc.annos; ++t) {
+    annos << "T" << t << "\tsynthetic term " << t
+          << " of the benchmark catalogue\tgenerated\n";
+    const unsigned size = std::max(
+        3u, static_cast<unsigned>(sc.max_term / std::pow(t + 1.0, 0.8)));
+    for (unsigned k = 0; k < size; ++k) {
+      sym_terms[rng.below(sc.syms)].push_back(t);
+    }
+  }
+  std::ofstream syms(sym_file);
+  for (unsigned s = 0; s < sc.syms; ++s) {
+    syms << "S" << s << "\t";
+    for (unsigned k = 0; k < sym_terms[s].size(); ++k) {
+      syms << (k ? "," : "") << "T" << sym_terms[s][k];
+    }
+    syms << "\n";
+  }
+}
+
+size_t file_size(const std::string &fname) {
+  std::ifstream in(fname, std::ios::binary | std::ios::ate);
+  return static_cast<size_t>(in.tellg());
+}
+
+std::vector<stage_result> bench_scale(const scale &sc, const unsigned &reps,
+                                      const std::string &dir) {
+  const std::string anno_file = dir + "/bench." + sc.name + ".anno.tsv",
+                    sym_file = dir + "/bench." + sc.name + ".sym.tsv",
+                    result_file = dir + "/bench." + sc.name + ".results";
+  generate(sc, anno_file, sym_file);
+  const double bytes = file_size(anno_file) + file_size(sym_file);
+  const unsigned heavy = std::max(1u, reps / 4);
+  std::vector<stage_result> out;
+
+  auto data = std::make_unique<BenchDataset>();
+  out.push_back(run_stage(sc.name, "load", heavy, bytes, [&]() {
+    data = std::make_unique<BenchDataset>();
+    load_annotations_plain(*data, anno_file);
+    load_syms_with_mappings(*data, sym_file);
+  }));
+  out.push_back(run_stage(sc.name, "gen_mappings", heavy, 0, [&]() {
+    data->gen_mappings(sc.masks);
+  }));
+  double edges = 0;
+  for (unsigned s = 0; s < data->total_syms(); ++s) {
+    edges += data->sym_size(s);
+  }
+  out.back().items = edges;
+
+  // a small and a large test set, as in a gene list and a GWAS hit list
+  std::vector<std::vector<std::string>> lists(2);
+  counter_rng rng(7, sc.syms);
+  for (unsigned k = 0; k < 200; ++k) {
+    lists[0].push_back("S" + std::to_string(rng.below(sc.syms)));
+  }
+  for (unsigned k = 0; k < sc.syms / 10; ++k) {
+    lists[1].push_back("S" + std::to_string(rng.below(sc.syms)));
+  }
+  const char *sizes[] = {"small", "large"};
+  for (unsigned l = 0; l < lists.size(); ++l) {
+    const std::string tag = std::string("/") + sizes[l];
+    std::unique_ptr<BenchSet> set;
+    out.push_back(run_stage(sc.name, "SymSet" + tag, reps,
+                            lists[l].size(), [&]() {
+                              set = std::make_unique<BenchSet>(lists[l],
+                                                               *data);
+                            }));
+    ResultDataset res;
+    out.push_back(run_stage(sc.name, "fisher_test" + tag, reps,
+                            data->total_annos(), [&]() {
+                              ResultDataset rd;
+                              fisher_test(*set, *data, rd);
+                              res = rd;
+                            }));
+    out.push_back(run_stage(sc.name, "fold_change_test" + tag, reps,
+                            data->total_annos(), [&]() {
+                              ResultDataset rd;
+                              fold_change_test(*set, *data, rd);
+                            }));
+    out.push_back(run_stage(
+        sc.name, "ab_test_full" + tag, reps, data->total_annos(), [&]() {
+          ResultDataset rd;
+          ab_test_full<BenchSet, BenchDataset, fisher_p, stat_sig_05,
+                       ascending>(*set, *data, rd);
+        }));
+    std::stringstream sink;
+    out.push_back(run_stage(sc.name, "print" + tag, reps, 0, [&]() {
+      auto *old = std::cout.rdbuf(sink.rdbuf());
+      res.print();
+      std::cout.rdbuf(old);
+      sink.str(std::string());
+    }));
+    out.push_back(
+        run_stage(sc.name, "write_tsv" + tag, reps, res.size(), [&]() {
+          fd_sink file(result_file);
+          tsv_writer writer(file);
+          res.write(writer);
+        }));
+    out.push_back(
+        run_stage(sc.name, "write_jsonl" + tag, reps, res.size(), [&]() {
+          fd_sink file(result_file);
+          json_lines_writer writer(file);
+          res.write(writer);
+        }));
+    out.push_back(
+        run_stage(sc.name, "write_bin" + tag, reps, res.size(), [&]() {
+          fd_sink file(result_file);
+          binary_writer writer(file);
+          res.write(writer);
+        }));
+  }
+  std::remove(result_file.c_str());
+  std::remove(anno_file.c_str());
+  std::remove(sym_file.c_str());
+  return out;
+}
+
+std::string to_json(const stage_result &r) {
+  std::ostringstream ss;
+  const double p50 = r.percentile(0.5);
+  ss << "{\"scale\":\"" << r.scale << "\",\"stage\":\"" << r.stage
+     << "\",\"reps\":" << r.ms.size() << ",\"p50_ms\":" << p50
+     << ",\"p90_ms\":" << r.percentile(0.9)
+     << ",\"p99_ms\":" << r.percentile(0.99) << ",\"mean_ms\":" << r.mean()
+     << ",\"items_per_s\":" << (p50 > 0 ? r.items / p50 * 1000 : 0)
+     << ",\"allocs\":" << r.allocs << ",\"alloc_bytes\":" << r.bytes << "}";
+  return ss.str();
+}
+
+// the value of a field in one of our own result lines
+std::string json_field(const std::string &line, const std::string &key) {
+  const std::string tag = "\"" + key + "\":";
+  size_t pos = line.find(tag);
+  if (pos == std::string::npos)
+    return "";
+  pos += tag.size();
+  if (line[pos] == '"')
+    return line.substr(pos + 1, line.find('"', pos + 1) - pos - 1);
+  return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+int main(int argc, char **argv) {
+  std::string which = "1k", dir = ".", out_file, baseline;
+  unsigned reps = 20;
+  double tolerance = 0.1;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i];
+    if (arg == "--scale")
+      which = argv[i + 1];
+    else if (arg == "--reps")
+      reps = std::max(1, std::atoi(argv[i + 1]));
+    else if (arg == "--dir")
+      dir = argv[i + 1];
+    else if (arg == "--out")
+      out_file = argv[i + 1];
+    else if (arg == "--baseline")
+      baseline = argv[i + 1];
+    else if (arg == "--tolerance")
+      tolerance = std::atof(argv[i + 1]);
+  }
+  std::vector<stage_result> results;
+  for (const auto &sc : scales) {
+    if (which != "all" && which != sc.name)
+      continue;
+    auto res = bench_scale(sc, reps, dir);
+    results.insert(results.end(), res.begin(), res.end());
+  }
+  std::printf("%-6s %-24s %10s %10s %10s %14s %10s\n", "scale", "stage",
+              "p50 ms", "p90 ms", "p99 ms", "items/s", "allocs");
+  for (const auto &r : results) {
+    const double p50 = r.percentile(0.5);
+    std::printf("%-6s %-24s %10.3f %10.3f %10.3f %14.0f %10zu\n",
+                r.scale.c_str(), r.stage.c_str(), p50, r.percentile(0.9),
+                r.percentile(0.99), p50 > 0 ? r.items / p50 * 1000 : 0,
+                r.allocs);
+  }
+  if (!out_file.empty()) {
+    std::ofstream out(out_file);
+    for (const auto &r : results) {
+      out << to_json(r) << "\n";
+    }
+  }
+  int status = 0;
+  if (!baseline.empty()) {
+    std::unordered_map<std::string, double> base;
+    for_each_line(baseline, [&](std::string_view line) {
+      const std::string l(line);
+      base[json_field(l, "scale") + " " + json_field(l, "stage")] =
+          std::atof(json_field(l, "p50_ms").c_str());
+    });
+    for (const auto &r : results) {
+      const auto it = base.find(r.scale + " " + r.stage);
+      if (it == base.end() || it->second <= 0)
+        continue;
+      const double change = r.percentile(0.5) / it->second - 1;
+      if (change > tolerance) {
+        std::printf("REGRESSION %s %s: %.3f ms -> %.3f ms (+%.0f%%)\n",
+                    r.scale.c_str(), r.stage.c_str(), it->second,
+                    r.percentile(0.5), change * 100);
+        status = 1;
+      }
+    }
+  }
+  return status;
+}
@@ -0,0 +1,165 @@
+#ifndef COMPOSE
+#define COMPOSE
+#include "data.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+// boolean sparse product of two incidence matrices, row by row
+// (Gustavson): row i of the result is the union of the rows of B picked by
+// row i of A, sorted. A is given as CSR arrays, B by a row accessor. rows
+// are computed in blocks of consecutive rows over `threads` workers, each
+// block into its own buffers with a marker array to drop repeats, and the
+// blocks are concatenated in order. consecutive rows of A tend to share
+// their picks (variants of one gene), so the rows of B a block reads stay
+// in cache. returns the CSR arrays of the result
+template <typename RB>
+std::pair<std::vector<unsigned>, std::vector<unsigned>>
+sparse_compose(const std::vector<unsigned> &a_offsets,
+               const std::vector<unsigned> &a_edges, const unsigned &cols,
+               RB &&row_b, const unsigned &threads = 1) {
+  const unsigned rows = a_offsets.size() - 1;
+  const unsigned block = block_size(rows, threads, 256);
+  std::vector<std::vector<unsigned>> sizes((rows + block - 1) / block),
+      edges(sizes.size());
+  parallel_blocks(
+      rows, block, threads,
+      [&](const unsigned &b, const unsigned &begin, const unsigned &end) {
+        std::vector<unsigned> mark(cols, id_table::npos);
+        auto &out = edges[b];
+        sizes[b].reserve(end - begin);
+        for (unsigned i = begin; i < end; ++i) {
+          const size_t first = out.size();
+          for (unsigned e = a_offsets[i]; e < a_offsets[i + 1]; ++e) {
+            for (const unsigned &c : row_b(a_edges[e])) {
+              if (mark[c] != i) {
+                mark[c] = i;
+                out.push_back(c);
+              }
+            }
+          }
+          std::sort(out.begin() + first, out.end());
+          sizes[b].push_back(out.size() - first);
+        }
+      });
+  std::vector<unsigned> offsets(1, 0), all;
+  offsets.reserve(rows + 1);
+  size_t total = 0;
+  for (const auto &e : edges) {
+    total += e.size();
+  }
+  all.reserve(total);
+  for (size_t b = 0; b < edges.size(); ++b) {
+    for (const unsigned &n : sizes[b]) {
+      offsets.push_back(offsets.back() + n);
+    }
+    all.insert(all.end(), edges[b].begin(), edges[b].end());
+    std::vector<unsigned>().swap(edges[b]);
+  }
+  return {std::move(offsets), std::move(all)};
+}
+
+// two linked datasets: variants mapped to genes (V, genes are its
+// annotations) and genes mapped to terms (G, genes are its symbols),
+// joined on the gene ids. the composition maps every variant straight to
+// the terms of its genes and is built once, as a dataset of type C whose
+// symbols are the variants of V (same indices) and whose annotations are
+// the terms of G (same indices). a query then counts either per variant,
+// on variant_level(), or per distinct gene, on gene_level() with
+// gene_set(), without rebuilding anything. V and G must outlive it, and a
+// change to either needs a new composition
+template <typename V, typename G,
+          typename C = Dataset<typename V::sym_type, typename G::anno_type>>
+class composed_dataset {
+public:
+  typedef SymSet<typename C::sym_type, typename C::anno_type> variant_set_type;
+  typedef SymSet<typename G::sym_type, typename G::anno_type> gene_set_type;
+
+private:
+  const V *variants;
+  const G *genes;
+  // gene annotation of V -> gene symbol of G, npos where G lacks the gene
+  std::vector<unsigned> link;
+  unsigned linked = 0;
+  C composed;
+
+public:
+  // masks takes the mask_kind bits for the composed dataset
+  composed_dataset(const V &variants, const G &genes,
+                   const unsigned &masks = dense_masks,
+                   const unsigned &threads = 1)
+      : variants(&variants), genes(&genes) {
+    if (!variants.has_index() || !genes.has_index()) {
+      throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+    }
+    link.resize(variants.total_annos());
+    for (unsigned a = 0; a < variants.total_annos(); ++a) {
+      link[a] = genes.find_sym(variants.anno_id(a));
+      linked += link[a] != id_table::npos;
+    }
+    // the variant -> gene incidence, in the gene indices of G
+    std::vector<unsigned> offsets(1, 0), edges;
+    offsets.reserve(variants.total_syms() + 1);
+    for (unsigned v = 0; v < variants.total_syms(); ++v) {
+      for (const unsigned &a : variants.sym_row(v)) {
+        if (link[a] != id_table::npos)
+          edges.push_back(link[a]);
+      }
+      offsets.push_back(edges.size());
+    }
+    const auto product = sparse_compose(
+        offsets, edges, genes.total_annos(),
+        [&genes](const unsigned &g) { return genes.sym_row(g); }, threads);
+    for (unsigned t = 0; t < genes.total_annos(); ++t) {
+      composed.add_anno(genes.anno_id(t), genes.anno_name(t),
+                        genes.anno_description(t));
+    }
+    for (unsigned v = 0; v < variants.total_syms(); ++v) {
+      composed.add_sym(variants.sym_id(v), variants.sym_name(v));
+    }
+    std::vector<std::pair<unsigned, unsigned>> pairs;
+    pairs.reserve(product.second.size());
+    for (unsigned v = 0; v < variants.total_syms(); ++v) {
+      for (unsigned e = product.first[v]; e < product.first[v + 1]; ++e) {
+        pairs.emplace_back(v, product.second[e]);
+      }
+    }
+    composed.add_edges(pairs);
+    composed.gen_mappings(masks);
+  };
+  composed_dataset(const composed_dataset &) = delete;
+  composed_dataset &operator=(const composed_dataset &) = delete;
+  // variants to terms, for counting every variant
+  const C &variant_level() const { return composed; };
+  // genes to terms, for counting every distinct gene once
+  const G &gene_level() const { return *genes; };
+  // genes of V found in G
+  unsigned linked_genes() const { return linked; };
+  // the distinct genes of some variants, as ascending symbol indices of G
+  std::vector<unsigned> genes_of(const std::vector<unsigned> &idxs) const {
+    std::vector<unsigned> out;
+    for (const unsigned &v : idxs) {
+      for (const unsigned &a : variants->sym_row(v)) {
+        if (link[a] != id_table::npos)
+          out.push_back(link[a]);
+      }
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+  };
+  variant_set_type variant_set(const std::vector<std::string> &ids) const {
+    return variant_set_type(ids, composed);
+  };
+  // the genes hit by some variants, each once
+  gene_set_type gene_set(const variant_set_type &set) const {
+    return gene_set_type::from_idxs(genes_of(set.get_idxs()), *genes);
+  };
+  gene_set_type gene_set(const std::vector<std::string> &ids) const {
+    return gene_set(variant_set(ids));
+  };
+};
+#endif
@@ -1,33 +1,56 @@
 #ifndef DATA
 #define DATA
+#include "hypergeom.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+#include "roaring.hpp"
+#include "snapshot.hpp"
+#include "storage.hpp"
+#include <algorithm>
 #include <bitset>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 namespace enriched {};
 using namespace enriched;
 
+// the CSR row of a datum, a range of indices into the other side
+struct idx_span {
+  const unsigned *first = nullptr, *last = nullptr;
+  const unsigned *begin() const { return first; };
+  const unsigned *end() const { return last; };
+  size_t size() const { return last - first; };
+  bool empty() const { return first == last; };
+  const unsigned &operator[](const size_t &i) const { return first[i]; };
+};
+
 struct _annotation {
-  const std::string id, name, description; //$1 use of const
+  const std::string_view id, name, description; //$1 use of const
 };
 
 struct _symbol {
-  const std::string sym, name;
+  const std::string_view sym, name;
 };
 
+// a datum is a lightweight view into the storage of its Dataset: the strings
+// point into the string pool and mapped into the CSR index, so it is only
+// valid until the dataset is changed
 template <typename dtype, size_t BITSIZE> struct _datum { //$3 use of template
   const dtype data;
-  std::vector<unsigned> mapped; //$4 use of STL
-  typedef std::bitset<BITSIZE> mappings;
-  _datum(const dtype &d, const std::vector<unsigned> &m) : data(d), mapped(m){};
-  _datum(dtype &&d, std::vector<unsigned> &&m)
-      : data(std::move(d)), mapped(std::move(m)){};
-  constexpr std::unique_ptr<mappings> get_mask() const {
-    auto out = std::make_unique<mappings>();
+  const idx_span mapped;
+  typedef std::bitset<BITSIZE> mappings; //$4 use of STL
+  static constexpr size_t bitsize = BITSIZE;
+  std::unique_ptr<mappings> get_mask() const { //$14 unique ptr
+    ENRICHED_COUNT(prof_bitsets, 1);
+    auto out = std::make_unique<mappings>(); //$18 make_unique
     for (const unsigned &idx : mapped)
       out->set(idx);
     return out;
@@ -49,64 +72,354 @@ typedef _datum<_symbol, 2 << 20> symbol20;
 typedef _datum<_symbol, 2 << 24> symbol24;
 typedef _datum<_symbol, 2 << 28> symbol28;
 
+// the masks gen_mappings builds: dense bitsets sized by the tier, runtime
+// sized compressed ones (roaring_mask), both or none. true and false keep
+// meaning dense and none
+enum mask_kind : unsigned {
+  no_masks = 0,
+  dense_masks = 1,
+  compressed_masks = 2,
+  all_masks = 3
+};
+
+// per annotation hit counts of a set of symbols, as produced by
+// Dataset::count_annos; hot lists the annotations with a non zero count
+struct anno_counts {
+  std::vector<unsigned> hot;
+  std::vector<unsigned> counts;
+  unsigned total = 0;
+};
+
 // dataset class is a total annotated dataset consisting of
 // symbols and their associated annotations
 // it provides simple method such as decoding symbols, finding associations etc
 template <typename stype, typename atype> class Dataset {
 private:
-  std::vector<std::unique_ptr<stype>> syms; //$14 unique ptr
-  std::vector<std::unique_ptr<atype>> annos;
-  std::unordered_map<std::string, unsigned> _seen_annos, _seen_syms;
+  // struct of arrays storage. the ids, names and descriptions of each side
+  // are interned back to back in one string pool and addressed by offsets,
+  // two strings per symbol and three per annotation; the mapping lists only
+  // exist as the CSR index below. get_sym and get_anno hand out views
+  column<char> _sym_pool, _anno_pool;
+  column<uint64_t> _sym_strs{std::vector<uint64_t>{0}},
+      _anno_strs{std::vector<uint64_t>{0}};
+  // (symbol, annotation) mappings added since the index was last built
+  std::vector<std::pair<unsigned, unsigned>> _new_edges;
+  // compressed (CSR) incidence index built by gen_mappings: row i of a side
+  // is edges[offsets[i]..offsets[i+1]), sorted and without duplicates
+  column<unsigned> _sym_offsets, _sym_edges, _anno_offsets, _anno_edges;
+  // persistent dense masks, one per annotation (over symbols) and one per
+  // symbol (over annotations), built once from the index by gen_mappings
+  column<typename atype::mappings> _anno_masks;
+  column<typename stype::mappings> _sym_masks;
+  bool _with_masks = false;
+  // compressed masks, one per annotation over symbols, built on request.
+  // they are immutable and shared between copies, edits patch them below.
+  // _sets_cost is their size in 64 bit words, what a pass over them reads
+  std::shared_ptr<const std::vector<roaring_mask>> _anno_sets;
+  bool _with_sets = false;
+  size_t _sets_cost = 0;
+  // rows and masks changed since the index was built. a patch replaces the
+  // CSR row or the mask of its index as a whole; edits copy it unless this
+  // dataset is its only user, so copies of a dataset never see each other's
+  // edits. _changes counts the edits, the index is rebuilt once they reach
+  // an eighth of the edges
+  template <typename T>
+  using patches = std::unordered_map<unsigned, std::shared_ptr<T>>;
+  patches<std::vector<unsigned>> _sym_rows, _anno_rows;
+  patches<typename atype::mappings> _anno_mask_rows;
+  patches<typename stype::mappings> _sym_mask_rows;
+  patches<roaring_mask> _anno_set_rows;
+  size_t _changes = 0;
+  // bumped by every change to the data or its index, see version
+  uint64_t _version = 0;
+  // id -> index tables over the string pools
+  id_table _sym_index, _anno_index;
+  // set when the dataset was loaded from a snapshot; the columns above
+  // borrow the mapped sections until they are first changed
+  std::shared_ptr<const snapshot_image> _image;
+
+  static std::string_view _string(const column<char> &pool,
+                                  const column<uint64_t> &strs,
+                                  const size_t &i) {
+    return {pool.data() + strs[i], strs[i + 1] - strs[i]};
+  };
+  static void _intern(column<char> &pool, column<uint64_t> &strs,
+                      const std::string_view &str) {
+    pool.append(str.data(), str.size());
+    strs.push_back(pool.size());
+  };
+  static idx_span _row(const column<unsigned> &offsets,
+                       const column<unsigned> &edges, const unsigned &idx) {
+    if (idx + 1 >= offsets.size())
+      return {};
+    return {edges.data() + offsets[idx], edges.data() + offsets[idx + 1]};
+  };
+  template <typename T, typename U>
+  static const T *_patch(const patches<T> &rows, const U &idx) {
+    if (rows.empty())
+      return nullptr;
+    const auto it = rows.find(idx);
+    return it == rows.end() ? nullptr : it->second.get();
+  };
+  // inserts v into or erases it from the sorted row of idx, as a patch
+  static bool _edit_row(patches<std::vector<unsigned>> &rows,
+                        const idx_span &row, const unsigned &idx,
+                        const unsigned &v, const bool &add) {
+    const unsigned *pos = std::lower_bound(row.begin(), row.end(), v);
+    const bool found = pos != row.end() && *pos == v;
+    if (found == add) {
+      return false;
+    }
+    auto &patch = rows[idx];
+    if (patch && patch.use_count() == 1) {
+      auto it = patch->begin() + (pos - row.begin());
+      if (add)
+        patch->insert(it, v);
+      else
+        patch->erase(it);
+      return true;
+    }
+    auto out = std::make_shared<std::vector<unsigned>>();
+    out->reserve(row.size() + 1);
+    out->insert(out->end(), row.begin(), pos);
+    if (add)
+      out->push_back(v);
+    out->insert(out->end(), pos + found, row.end());
+    patch = std::move(out);
+    return true;
+  };
+  template <typename M>
+  static void _edit_mask(patches<M> &masks, const M &mask, const unsigned &idx,
+                         const unsigned &bit, const bool &add) {
+    auto &patch = masks[idx];
+    if (!patch || patch.use_count() > 1) {
+      ENRICHED_COUNT(prof_bitsets, 1);
+      patch = std::make_shared<M>(mask);
+    }
+    patch->set(bit, add);
+  };
+  // adds or removes one edge of the index in place: both rows, both masks
+  // and with them the term sizes. the cost is the length of the two rows
+  // plus the two masks, not the size of the dataset
+  bool _link(const unsigned &s, const unsigned &a, const bool &add) {
+    if (!_edit_row(_sym_rows, sym_row(s), s, a, add)) {
+      return false;
+    }
+    _edit_row(_anno_rows, anno_row(a), a, s, add);
+    if (_with_masks) {
+      _edit_mask(_sym_mask_rows, sym_mask(s), s, a, add);
+      _edit_mask(_anno_mask_rows, anno_mask(a), a, s, add);
+    }
+    if (_with_sets) {
+      const idx_span row = anno_row(a);
+      auto set = std::make_shared<roaring_mask>(row.begin(), row.end());
+      _sets_cost -= anno_set(a).bytes() / 8;
+      _sets_cost += set->bytes() / 8;
+      _anno_set_rows[a] = std::move(set);
+    }
+    ENRICHED_COUNT(prof_edges_inserted, add);
+    ++_version;
+    if (++_changes > _sym_edges.size() / 8 + 1024) {
+      _gen_index();
+      _gen_masks(_mask_kinds());
+    }
+    return true;
+  };
+  // whether the CSR arrays and masks alone hold the whole dataset, with no
+  // staged edges, patches or data added after they were built
+  bool _compacted() const {
+    return _changes == 0 && _new_edges.empty() &&
+           _sym_offsets.size() == total_syms() + 1 &&
+           _anno_offsets.size() == total_annos() + 1 &&
+           (!_with_masks || (_anno_masks.size() == total_annos() &&
+                             _sym_masks.size() == total_syms())) &&
+           (!_with_sets || _anno_sets->size() == total_annos());
+  };
+  unsigned _mask_kinds() const {
+    return (_with_masks ? dense_masks : no_masks) |
+           (_with_sets ? compressed_masks : no_masks);
+  };
+  // links or stages an edge, depending on whether the index exists yet
+  void _map(const unsigned &s, const unsigned &a) {
+    if (has_index()) {
+      _link(s, a, true);
+    } else {
+      _new_edges.emplace_back(s, a);
+      ++_version;
+      ENRICHED_COUNT(prof_edges_inserted, 1);
+    }
+  };
+  template <typename L>
+  void _add_sym(const std::string_view &sym, const std::string_view &name,
+                const L &mapped) {
+    ENRICHED_PHASE(phase_add);
+    if (find_sym(sym) != id_table::npos) {
+      return;
+    }
+    const unsigned idx = total_syms();
+    ++_version;
+    _intern(_sym_pool, _sym_strs, sym);
+    _intern(_sym_pool, _sym_strs, name);
+    _sym_index.insert(idx, [this](const unsigned &i) { return sym_id(i); });
+    for (const auto &anno : mapped) { //$9 auto $11 range fors
+      const unsigned a = find_anno(anno);
+      if (a != id_table::npos)
+        _map(idx, a);
+    }
+  };
+  template <typename L>
+  void _add_anno(const std::string_view &id, const std::string_view &name,
+                 const std::string_view &desc, const L &mapped) {
+    ENRICHED_PHASE(phase_add);
+    if (find_anno(id) != id_table::npos) {
+      return;
+    }
+    const unsigned idx = total_annos();
+    ++_version;
+    _intern(_anno_pool, _anno_strs, id);
+    _intern(_anno_pool, _anno_strs, name);
+    _intern(_anno_pool, _anno_strs, desc);
+    _anno_index.insert(idx,
+                       [this](const unsigned &i) { return anno_id(i); });
+    for (const auto &sym : mapped) {
+      const unsigned s = find_sym(sym);
+      if (s != id_table::npos)
+        _map(s, idx);
+    }
+  };
+  // a raw list of symbol indices as every counting path takes it:
+  // ascending, distinct and in range. a list that already is one is
+  // passed through, any other is sorted into scratch
+  const std::vector<unsigned> &
+  _sym_list(const std::vector<unsigned> &idxs,
+            std::vector<unsigned> &scratch) const {
+    const std::vector<unsigned> *out = &idxs;
+    if (std::adjacent_find(idxs.begin(), idxs.end(),
+                           std::greater_equal<unsigned>()) != idxs.end()) {
+      scratch = idxs;
+      std::sort(scratch.begin(), scratch.end());
+      scratch.erase(std::unique(scratch.begin(), scratch.end()),
+                    scratch.end());
+      out = &scratch;
+    }
+    if (!out->empty() && out->back() >= total_syms()) {
+      throw(std::out_of_range("symbol index out of range"));
+    }
+    return *out;
+  };
+  // counts from a list _sym_list has already checked
+  anno_counts _walk(const std::vector<unsigned> &sym_idxs) const {
+    if (!has_index()) {
+      throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+    }
+    ENRICHED_PHASE(phase_count);
+    anno_counts out;
+    out.counts.assign(total_annos(), 0);
+    out.total = sym_idxs.size();
+    for (const unsigned &s : sym_idxs) {
+      for (const unsigned &a : sym_row(s)) {
+        if (out.counts[a]++ == 0)
+          out.hot.push_back(a);
+      }
+    }
+    std::sort(out.hot.begin(), out.hot.end());
+    return out;
+  };
 
 public:
-  constexpr const unsigned total_syms() const { return syms.size(); };
-  constexpr const unsigned total_annos() const { return annos.size(); };
-  constexpr const unsigned anno_idx(const std::string &anno) const {
-    return _seen_annos.at(anno);
+  typedef stype sym_type;
+  typedef atype anno_type;
+  constexpr const unsigned total_syms() const {
+    return (_sym_strs.size() - 1) / 2;
+  };
+  constexpr const unsigned total_annos() const {
+    return (_anno_strs.size() - 1) / 3;
+  };
+  // index of an id, or id_table::npos if it is unknown. any string type
+  // that converts to std::string_view is looked up without a copy
+  unsigned find_anno(const std::string_view &anno) const {
+    return _anno_index.find(anno,
+                            [this](const unsigned &i) { return anno_id(i); });
+  };
+  unsigned find_sym(const std::string_view &sym) const {
+    return _sym_index.find(sym,
+                           [this](const unsigned &i) { return sym_id(i); });
+  };
+  constexpr const unsigned anno_idx(const std::string_view &anno) const {
+    const unsigned idx = find_anno(anno);
+    if (idx == id_table::npos)
+      throw(std::out_of_range("unknown annotation: " + std::string(anno)));
+    return idx;
   };
   constexpr const unsigned
-  sym_idx(const std::string &sym) const { //$8 constexpr
-    return _seen_syms.at(sym);
+  sym_idx(const std::string_view &sym) const { //$8 constexpr
+    const unsigned idx = find_sym(sym);
+    if (idx == id_table::npos)
+      throw(std::out_of_range("unknown symbol: " + std::string(sym)));
+    return idx;
+  };
+  // ids and names by index, straight from the string pools
+  std::string_view sym_id(const unsigned &idx) const {
+    return _string(_sym_pool, _sym_strs, 2 * idx);
   };
-  constexpr const atype *get_anno(const unsigned &idx) const {
-    if (annos.size() > idx) {
-      return annos[idx].get();
+  std::string_view sym_name(const unsigned &idx) const {
+    return _string(_sym_pool, _sym_strs, 2 * idx + 1);
+  };
+  std::string_view anno_id(const unsigned &idx) const {
+    return _string(_anno_pool, _anno_strs, 3 * idx);
+  };
+  std::string_view anno_name(const unsigned &idx) const {
+    return _string(_anno_pool, _anno_strs, 3 * idx + 1);
+  };
+  std::string_view anno_description(const unsigned &idx) const {
+    return _string(_anno_pool, _anno_strs, 3 * idx + 2);
+  };
+  // views of a datum; mapped is its row of the index built by the last
+  // gen_mappings, empty before that
+  const atype get_anno(const unsigned &idx) const {
+    if (total_annos() > idx) {
+      return atype{{anno_id(idx), anno_name(idx), anno_description(idx)},
+                   anno_row(idx)};
     } else {
       throw(new std::invalid_argument("invalid index"));
     }
   };
-  constexpr const stype *get_sym(const unsigned &idx) const {
-    if (syms.size() > idx) {
-      return syms[idx].get();
+  const stype get_sym(const unsigned &idx) const {
+    if (total_syms() > idx) {
+      return stype{{sym_id(idx), sym_name(idx)}, //$6 use of list initialization
+                   sym_row(idx)};
     } else {
       throw(new std::invalid_argument("invalid index"));
     }
   };
-  constexpr const atype *get_anno(const std::string &anno) const {
-    if (_seen_annos.count(anno)) {
-      return annos[_seen_annos.at(anno)].get();
+  const atype get_anno(const std::string_view &anno) const {
+    const unsigned idx = find_anno(anno);
+    if (idx != id_table::npos) {
+      return get_anno(idx);
     } else {
-      throw(
-          new std::invalid_argument("cannot get invalid annotation: " + anno));
+      throw(new std::invalid_argument("cannot get invalid annotation: " +
+                                      std::string(anno)));
     }
   };
-  constexpr const stype *get_sym(const std::string &sym) const {
-    if (_seen_syms.count(sym)) {
-      return syms[_seen_syms.at(sym)].get();
+  const stype get_sym(const std::string_view &sym) const {
+    const unsigned idx = find_sym(sym);
+    if (idx != id_table::npos) {
+      return get_sym(idx);
     } else {
-      throw(new std::invalid_argument("cannot get invalid symbol: " + sym));
+      throw(new std::invalid_argument("cannot get invalid symbol: " +
+                                      std::string(sym)));
     }
   };
-  constexpr const bool has_anno(const std::string &anno) const {
-    return _seen_annos.count(anno);
+  constexpr const bool has_anno(const std::string_view &anno) const {
+    return find_anno(anno) != id_table::npos;
   };
-  constexpr const bool has_sym(const std::string &sym) const {
-    return _seen_syms.count(sym);
+  constexpr const bool has_sym(const std::string_view &sym) const {
+    return find_sym(sym) != id_table::npos;
   };
-  const std::vector<const atype *>
+  const std::vector<atype>
   decode_annos(const typename stype::mappings &encoding) const {
-    std::vector<const atype *> out;
-    out.reserve(encoding.size());
+    std::vector<atype> out;
+    out.reserve(encoding.count());
     for (unsigned i = 0; i < encoding.size(); ++i) {
       if (encoding.test(i)) {
         out.push_back(get_anno(i));
@@ -114,10 +427,10 @@ public:
     }
     return out;
   };
-  const std::vector<const stype *>
+  const std::vector<stype>
   decode_syms(const typename atype::mappings &encoding) const {
-    std::vector<const stype *> out;
-    out.reserve(encoding.size());
+    std::vector<stype> out;
+    out.reserve(encoding.count());
     for (unsigned i = 0; i < encoding.size(); ++i) {
       if (encoding.test(i)) {
         out.push_back(get_sym(i));
@@ -127,123 +440,587 @@ public:
   };
   void add_sym(const std::string &sym, const std::string &name,
                const std::vector<std::string> &mapped = {}) {
-    if (has_sym(sym)) {
-      return;
-    } else {
-      _seen_syms[sym] = syms.size();
+    _add_sym(sym, name, mapped);
+  };
+  void add_anno(const std::string &id, const std::string &name,
+                const std::string &desc,
+                const std::vector<std::string> &mapped = {}) {
+    _add_anno(id, name, desc, mapped);
+  };
+  // std::string_view entry points for the zero copy loaders. these are
+  // templates only so that string literals keep resolving to the
+  // std::string overloads above
+  template <typename V, typename = std::enable_if_t<
+                            std::is_same<V, std::string_view>::value>>
+  void add_sym(const V &sym, const V &name, const std::vector<V> &mapped = {}) {
+    _add_sym(sym, name, mapped);
+  };
+  template <typename V, typename = std::enable_if_t<
+                            std::is_same<V, std::string_view>::value>>
+  void add_anno(const V &id, const V &name, const V &desc,
+                const std::vector<V> &mapped = {}) {
+    _add_anno(id, name, desc, mapped);
+  };
+  // adds or removes the mapping between a known symbol and annotation and
+  // reports whether anything changed. once the index is built both of its
+  // directions, the masks and the term sizes are updated in place; before
+  // that added edges are staged for gen_mappings
+  bool add_edge(const std::string_view &sym, const std::string_view &anno) {
+    const unsigned s = find_sym(sym), a = find_anno(anno);
+    if (s == id_table::npos || a == id_table::npos) {
+      return false;
     }
-    std::vector<unsigned> mappings;
-    if (mapped.size() > 0) {
-      for (auto anno : mapped) { //$9 auto $11 range fors
-        if (has_anno(anno))
-          mappings.push_back(anno_idx(anno));
+    if (!has_index()) {
+      _new_edges.emplace_back(s, a);
+      ++_version;
+      return true;
+    }
+    return _link(s, a, true);
+  };
+  bool remove_edge(const std::string_view &sym, const std::string_view &anno) {
+    if (!has_index()) {
+      throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+    }
+    const unsigned s = find_sym(sym), a = find_anno(anno);
+    if (s == id_table::npos || a == id_table::npos) {
+      return false;
+    }
+    return _link(s, a, false);
+  };
+  // stages (symbol, annotation) index pairs for the next gen_mappings, the
+  // cheap way to add many edges at once. the index is out of date, and
+  // has_index false, until then
+  void add_edges(const std::vector<std::pair<unsigned, unsigned>> &edges) {
+    for (const auto &edge : edges) {
+      if (edge.first >= total_syms() || edge.second >= total_annos()) {
+        throw(std::out_of_range("edge index out of range"));
       }
     }
-    _symbol data = {sym, name};
-    syms.push_back(std::make_unique<stype>(data, mappings)); //$18 make_unique
-    return;
+    _new_edges.insert(_new_edges.end(), edges.begin(), edges.end());
+    _version += !edges.empty();
+    ENRICHED_COUNT(prof_edges_inserted, edges.size());
   };
-  void
-  add_sym(std::string &&sym, std::string &&name,
-          std::vector<std::string> &&mapped = {}) { //$12 rvalue refs and move
-    if (has_sym(sym)) {
+  // builds the index, and the masks of the mask_kind bits in masks,
+  // folding in every change since the last build. a snapshot is left as it
+  // was loaded until changed; masks it was saved without, and compressed
+  // masks which are never saved, are built from its index when asked for
+  void gen_mappings(const unsigned &masks = dense_masks) {
+    log_factorials::instance().reserve(total_syms());
+    if (_image && _compacted()) {
+      if ((masks & dense_masks) && !_with_masks)
+        _gen_dense();
+      if ((masks & compressed_masks) && !_with_sets)
+        _gen_sets();
       return;
-    } else {
-      _seen_syms[sym] = syms.size();
     }
-    std::vector<unsigned> mappings;
-    if (mapped.size() > 0) {
-      for (auto anno : mapped) {
-        if (has_anno(anno))
-          mappings.push_back(anno_idx(anno));
+    ENRICHED_PHASE(phase_gen_mappings);
+    _gen_index();
+    _gen_masks(masks);
+    ++_version;
+    return;
+  };
+  // folds the mappings added since the last call into the CSR index: the
+  // symbol side is rebuilt by a counting pass over the current rows and the
+  // new edges, the annotation side is its transpose
+  void _gen_index() {
+    const unsigned ns = total_syms(), na = total_annos();
+    std::vector<unsigned> sym_offsets(ns + 1, 0);
+    for (unsigned s = 0; s < ns; ++s) {
+      sym_offsets[s + 1] = sym_row(s).size();
+    }
+    for (const auto &edge : _new_edges) {
+      ++sym_offsets[edge.first + 1];
+    }
+    for (unsigned s = 0; s < ns; ++s) {
+      sym_offsets[s + 1] += sym_offsets[s];
+    }
+    std::vector<unsigned> fill(sym_offsets.begin(), sym_offsets.end() - 1);
+    std::vector<unsigned> sym_edges(sym_offsets[ns]);
+    for (unsigned s = 0; s < ns; ++s) {
+      for (const unsigned &a : sym_row(s)) {
+        sym_edges[fill[s]++] = a;
       }
     }
-    _symbol data = {std::move(sym),
-                    std::move(name)}; //$6 use of list initialization
-    syms.push_back(
-        std::make_unique<stype>(std::move(data), std::move(mappings)));
-    return;
+    for (const auto &edge : _new_edges) {
+      sym_edges[fill[edge.first]++] = edge.second;
+    }
+    // sort and dedupe every row, compacting the edges in place
+    std::vector<unsigned> degree(na + 1, 0);
+    unsigned out = 0;
+    for (unsigned s = 0; s < ns; ++s) {
+      auto first = sym_edges.begin() + sym_offsets[s],
+           last = sym_edges.begin() + sym_offsets[s + 1];
+      std::sort(first, last);
+      last = std::unique(first, last);
+      sym_offsets[s] = out;
+      for (auto it = first; it != last; ++it) {
+        ++degree[*it + 1];
+        sym_edges[out++] = *it;
+      }
+    }
+    sym_offsets[ns] = out;
+    sym_edges.resize(out);
+    sym_edges.shrink_to_fit();
+    for (unsigned a = 0; a < na; ++a) {
+      degree[a + 1] += degree[a];
+    }
+    std::vector<unsigned> anno_offsets = degree, anno_edges(sym_edges.size());
+    for (unsigned s = 0; s < ns; ++s) {
+      for (unsigned e = sym_offsets[s]; e < sym_offsets[s + 1]; ++e) {
+        anno_edges[degree[sym_edges[e]]++] = s;
+      }
+    }
+    _sym_offsets = std::move(sym_offsets);
+    _sym_edges = std::move(sym_edges); //$12 rvalue refs and move
+    _anno_offsets = std::move(anno_offsets);
+    _anno_edges = std::move(anno_edges);
+    _new_edges = {};
+    _sym_rows.clear();
+    _anno_rows.clear();
+    _changes = 0;
   };
-  void add_anno(const std::string &id, const std::string &name,
-                const std::string &desc,
-                const std::vector<std::string> &mapped = {}) {
-    if (has_anno(id)) {
+  void _gen_masks(const unsigned &masks) {
+    _anno_masks.clear();
+    _sym_masks.clear();
+    _anno_mask_rows.clear();
+    _sym_mask_rows.clear();
+    _anno_sets.reset();
+    _anno_set_rows.clear();
+    _with_sets = false;
+    _sets_cost = 0;
+    if (masks & compressed_masks)
+      _gen_sets();
+    _with_masks = false;
+    if (masks & dense_masks)
+      _gen_dense();
+  };
+  // the dense masks of both sides, straight from the CSR rows
+  void _gen_dense() {
+    if (total_annos() == 0) {
       return;
-    } else {
-      _seen_annos[id] = annos.size();
     }
-    std::vector<unsigned> mappings;
-    if (mapped.size() > 0) {
-      for (auto sym : mapped) {
-        if (has_sym(sym))
-          mappings.push_back(sym_idx(sym));
+    ENRICHED_PHASE(phase_masks);
+    ENRICHED_COUNT(prof_bitsets, total_annos() + total_syms());
+    std::vector<typename atype::mappings> anno_masks(total_annos());
+    std::vector<typename stype::mappings> sym_masks(total_syms());
+    for (unsigned s = 0; s < total_syms(); ++s) {
+      for (unsigned e = _sym_offsets[s]; e < _sym_offsets[s + 1]; ++e) {
+        sym_masks[s].set(_sym_edges[e]);
+        anno_masks[_sym_edges[e]].set(s);
       }
     }
-    _annotation data = {id, name, desc};
-    annos.push_back(std::make_unique<atype>(data, mappings));
-    return;
+    _anno_masks = std::move(anno_masks);
+    _sym_masks = std::move(sym_masks);
+    _with_masks = true;
   };
-  void add_anno(std::string &&id, std::string &&name, std::string &&desc,
-                std::vector<std::string> &&mapped = {}) {
-    if (has_anno(id)) {
-      return;
-    } else {
-      _seen_annos[id] = annos.size();
+  // one compressed mask per annotation, straight from its CSR row
+  void _gen_sets() {
+    ENRICHED_PHASE(phase_masks);
+    auto sets = std::make_shared<std::vector<roaring_mask>>();
+    sets->reserve(total_annos());
+    size_t cost = 0;
+    for (unsigned a = 0; a < total_annos(); ++a) {
+      const idx_span row = anno_row(a);
+      sets->emplace_back(row.begin(), row.end());
+      cost += sets->back().bytes() / 8;
+    }
+    _anno_sets = std::move(sets);
+    _anno_set_rows.clear();
+    _sets_cost = cost;
+    _with_sets = true;
+  };
+  constexpr bool has_masks() const { return _with_masks; };
+  // a number that changes whenever the symbols, annotations, mappings or
+  // index of this dataset do, for caches of anything derived from them.
+  // copies start from the version of their source
+  uint64_t version() const { return _version; };
+  bool has_compressed_masks() const { return _with_sets; };
+  // the size of the compressed masks in 64 bit words, edits included
+  size_t compressed_words() const { return _sets_cost; };
+  // the compressed mask of an annotation, empty for one added after the
+  // masks were built and never mapped since
+  const roaring_mask &anno_set(const unsigned &idx) const {
+    static const roaring_mask none;
+    if (const auto *patch = _patch(_anno_set_rows, idx))
+      return *patch;
+    return _anno_sets && idx < _anno_sets->size() ? (*_anno_sets)[idx]
+                                                  : none;
+  };
+  // the mask of a datum, empty for one added after the masks were built
+  // and never mapped since
+  const typename atype::mappings &anno_mask(const unsigned &idx) const {
+    static const typename atype::mappings none;
+    if (const auto *patch = _patch(_anno_mask_rows, idx))
+      return *patch;
+    return idx < _anno_masks.size() ? _anno_masks[idx] : none;
+  };
+  const typename stype::mappings &sym_mask(const unsigned &idx) const {
+    static const typename stype::mappings none;
+    if (const auto *patch = _patch(_sym_mask_rows, idx))
+      return *patch;
+    return idx < _sym_masks.size() ? _sym_masks[idx] : none;
+  };
+  // CSR rows: the annotations of a symbol and the symbols of an annotation
+  idx_span sym_row(const unsigned &idx) const {
+    if (const auto *patch = _patch(_sym_rows, idx))
+      return {patch->data(), patch->data() + patch->size()};
+    return _row(_sym_offsets, _sym_edges, idx);
+  };
+  idx_span anno_row(const unsigned &idx) const {
+    if (const auto *patch = _patch(_anno_rows, idx))
+      return {patch->data(), patch->data() + patch->size()};
+    return _row(_anno_offsets, _anno_edges, idx);
+  };
+  // whether the index covers every mapping. data added after the index was
+  // built is linked in place, so it stays valid until the dataset is reset
+  constexpr bool has_index() const {
+    return !_sym_offsets.empty() && _new_edges.empty();
+  };
+  // number of distinct symbols mapped to an annotation, from the CSR index
+  unsigned anno_size(const unsigned &idx) const {
+    return anno_row(idx).size();
+  };
+  unsigned sym_size(const unsigned &idx) const {
+    return sym_row(idx).size();
+  };
+  // counts, for every annotation, how many of the given symbols map to it.
+  // only the symbols' own CSR rows are walked so the cost is the number of
+  // edges in the set, not the number of annotations times the mask size.
+  // repeated symbols count once, out of range ones throw
+  anno_counts count_annos(const std::vector<unsigned> &sym_idxs) const {
+    std::vector<unsigned> scratch;
+    return _walk(_sym_list(sym_idxs, scratch));
+  };
+  // same counts from a dense symbol mask, one fused AND+popcount against
+  // each cached annotation mask and no temporaries
+  anno_counts count_annos(const typename atype::mappings &mask,
+                          const unsigned &threads = 1) const {
+    if (!has_masks()) {
+      throw(std::logic_error("dataset has no masks, call gen_mappings"));
+    }
+    ENRICHED_PHASE(phase_count);
+    ENRICHED_COUNT(prof_bytes_popcounted,
+                   2 * sizeof(mask) * static_cast<uint64_t>(total_annos()));
+    anno_counts out;
+    out.counts.resize(total_annos());
+    out.total = mask.count();
+    parallel_blocks(total_annos(), block_size(total_annos(), threads), threads,
+                    [&](const unsigned &, const unsigned &begin,
+                        const unsigned &end) {
+                      for (unsigned a = begin; a < end; ++a) {
+                        out.counts[a] = intersect_count(mask, anno_mask(a));
+                      }
+                    });
+    for (unsigned a = 0; a < total_annos(); ++a) {
+      if (out.counts[a] > 0)
+        out.hot.push_back(a);
+    }
+    return out;
+  };
+  // same counts from a compressed symbol mask, one container wise
+  // intersect-count against each annotation's compressed mask
+  anno_counts count_annos(const roaring_mask &mask,
+                          const unsigned &threads = 1) const {
+    if (!has_compressed_masks()) {
+      throw(std::logic_error(
+          "dataset has no compressed masks, call gen_mappings"));
+    }
+    ENRICHED_PHASE(phase_count);
+    anno_counts out;
+    out.counts.resize(total_annos());
+    out.total = mask.count();
+    parallel_blocks(total_annos(), block_size(total_annos(), threads), threads,
+                    [&](const unsigned &, const unsigned &begin,
+                        const unsigned &end) {
+                      for (unsigned a = begin; a < end; ++a) {
+                        out.counts[a] = intersect_count(mask, anno_set(a));
+                      }
+                    });
+    for (unsigned a = 0; a < total_annos(); ++a) {
+      if (out.counts[a] > 0)
+        out.hot.push_back(a);
     }
-    std::vector<unsigned> mappings;
-    if (mapped.size() > 0) {
-      for (auto sym : mapped) {
-        if (has_sym(sym))
-          mappings.push_back(sym_idx(sym));
+    return out;
+  };
+  // counts for many sets at once. each set takes the cheaper path as in
+  // count_set; the dense ones share one pass over the annotation masks,
+  // walked in word chunks so that a chunk of every set mask stays in cache
+  // while each annotation mask is read only once for the whole batch. the
+  // sets are raw lists as for count_annos
+  std::vector<anno_counts>
+  count_batch(const std::vector<std::vector<unsigned>> &raw,
+              const unsigned &threads = 1) const {
+    ENRICHED_PHASE(phase_count);
+    const size_t words = bitset_words<atype::bitsize>();
+    std::vector<std::vector<unsigned>> scratch(raw.size());
+    std::vector<const std::vector<unsigned> *> lists(raw.size());
+    for (unsigned i = 0; i < raw.size(); ++i) {
+      lists[i] = &_sym_list(raw[i], scratch[i]);
+    }
+    auto set = [&](const unsigned &i) -> const std::vector<unsigned> & {
+      return *lists[i];
+    };
+    const size_t n = raw.size();
+    std::vector<anno_counts> out(n);
+    std::vector<unsigned> dense;
+    std::vector<bool> is_dense(n, false), is_compressed(n, false);
+    for (unsigned i = 0; i < n; ++i) {
+      size_t edges = 0;
+      for (const unsigned &s : set(i)) {
+        edges += sym_size(s);
+      }
+      if (has_masks() && edges > total_annos() * words) {
+        dense.push_back(i);
+        is_dense[i] = true;
+      } else if (has_compressed_masks() && edges > _sets_cost) {
+        is_compressed[i] = true;
       }
     }
-    _annotation data = {std::move(id), std::move(name), std::move(desc)};
-    annos.push_back(
-        std::make_unique<atype>(std::move(data), std::move(mappings)));
-    return;
+    parallel_blocks(n, block_size(n, threads, 1), threads,
+                    [&](const unsigned &, const unsigned &begin,
+                        const unsigned &end) {
+                      for (unsigned i = begin; i < end; ++i) {
+                        if (is_compressed[i]) {
+                          out[i] = count_annos(roaring_mask(set(i)));
+                        } else if (!is_dense[i]) {
+                          out[i] = _walk(set(i));
+                        }
+                      }
+                    });
+    if (dense.empty()) {
+      return out;
+    }
+    std::vector<typename atype::mappings> masks(dense.size());
+    ENRICHED_COUNT(prof_bitsets, dense.size());
+    ENRICHED_COUNT(prof_bytes_popcounted, 2 * words * 8 * dense.size() *
+                                              static_cast<uint64_t>(
+                                                  total_annos()));
+    for (unsigned k = 0; k < dense.size(); ++k) {
+      for (const unsigned &s : set(dense[k])) {
+        masks[k].set(s);
+      }
+      out[dense[k]].total = masks[k].count();
+      out[dense[k]].counts.assign(total_annos(), 0);
+    }
+    const size_t chunk = std::max<size_t>(
+        8, std::min<size_t>(words, (256 << 10) / (8 * dense.size())));
+    parallel_blocks(
+        total_annos(), block_size(total_annos(), threads), threads,
+        [&](const unsigned &, const unsigned &begin, const unsigned &end) {
+          for (size_t w = 0; w < words; w += chunk) {
+            const size_t len = std::min(chunk, words - w);
+            for (unsigned a = begin; a < end; ++a) {
+              const uint64_t *am = bitset_data(anno_mask(a)) + w;
+              for (unsigned k = 0; k < dense.size(); ++k) {
+                out[dense[k]].counts[a] +=
+                    popcount_and(bitset_data(masks[k]) + w, am, len);
+              }
+            }
+          }
+        });
+    for (const unsigned &i : dense) {
+      for (unsigned a = 0; a < total_annos(); ++a) {
+        if (out[i].counts[a] > 0)
+          out[i].hot.push_back(a);
+      }
+    }
+    return out;
   };
-  void gen_mappings() {
-    if (syms.size() == 0 || annos.size() == 0) {
+  // picks the cheapest counting path for a set: the CSR walk unless the set
+  // has more edges than a dense or a compressed scan has words to read
+  template <typename S>
+  anno_counts count_set(const S &set, const unsigned &threads = 1) const {
+    const auto &idxs = set.get_idxs();
+    size_t edges = 0;
+    for (const unsigned &s : idxs) {
+      edges += sym_size(s);
+    }
+    if (has_masks() &&
+        edges > total_annos() * bitset_words<atype::bitsize>()) {
+      return count_annos(set.get_mask_ref(), threads);
+    }
+    if (has_compressed_masks() && edges > _sets_cost) {
+      return count_annos(set.get_compressed_ref(), threads);
+    }
+    return _walk(idxs);
+  };
+  // writes the dataset as a versioned binary snapshot: string pools, the id
+  // tables, the CSR index in both directions and, if built and asked for,
+  // the masks. edits since the last build are folded into a copy first
+  void save(const std::string &fname, const bool &masks = true) const {
+    static_assert(sizeof(typename atype::mappings) ==
+                          bitset_words<atype::bitsize>() * 8 &&
+                      sizeof(typename stype::mappings) ==
+                          bitset_words<stype::bitsize>() * 8,
+                  "masks are saved as bare word arrays");
+    if (!has_index()) {
+      throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+    }
+    if (!_compacted()) {
+      Dataset copy(*this);
+      copy._gen_index();
+      copy._gen_masks(_mask_kinds());
+      copy.save(fname, masks);
       return;
     }
-    unsigned sym_count = 0;
-    for (const auto &sym : syms) {
-      sym_count += sym->mapped.size();
+    const unsigned ns = total_syms(), na = total_annos();
+    snapshot_header header;
+    header.sym_bits = stype::bitsize;
+    header.anno_bits = atype::bitsize;
+    header.n_syms = ns;
+    header.n_annos = na;
+    header.n_edges = _sym_edges.size();
+    snapshot_writer out(fname, header);
+    out.section(snap_sym_pool, _sym_pool);
+    out.section(snap_sym_strs, _sym_strs);
+    out.section(snap_anno_pool, _anno_pool);
+    out.section(snap_anno_strs, _anno_strs);
+    out.section(snap_sym_index, _sym_index.data());
+    out.section(snap_anno_index, _anno_index.data());
+    out.section(snap_sym_offsets, _sym_offsets);
+    out.section(snap_sym_edges, _sym_edges);
+    out.section(snap_anno_offsets, _anno_offsets);
+    out.section(snap_anno_edges, _anno_edges);
+    if (masks && has_masks()) {
+      out.section(snap_anno_masks, _anno_masks);
+      out.section(snap_sym_masks, _sym_masks);
     }
-    unsigned anno_count = 0;
-    for (const auto &anno : annos) {
-      anno_count += anno->mapped.size();
+    out.finish();
+  };
+  // replaces the dataset with a snapshot written by save. the file is
+  // mapped and queried in place, nothing is parsed, hashed or rebuilt; the
+  // only pass over it checks that offsets and edges stay in bounds and
+  // that each id table holds every index once and has a free slot to end
+  // a probe on. the strings and masks are taken as saved
+  void load(const std::string &fname) {
+    std::shared_ptr<const snapshot_image> image =
+        std::make_shared<const snapshot_image>(fname, stype::bitsize,
+                                               atype::bitsize);
+    const auto &h = image->header;
+    const uint64_t ns = h.n_syms, na = h.n_annos, ne = h.n_edges;
+    if (ns >= id_table::npos || na >= id_table::npos ||
+        ne >= id_table::npos) {
+      throw(std::runtime_error("Snapshot too large:" + fname));
     }
-    if (sym_count == 0) {
-      for (const auto &anno : annos) {
-        for (const unsigned &sidx : anno->mapped) {
-          syms[sidx]->mapped.push_back(anno_idx(anno->data.id));
-        }
+    auto sym_pool = image->section<char>(snap_sym_pool,
+                                         image->count<char>(snap_sym_pool));
+    auto anno_pool = image->section<char>(snap_anno_pool,
+                                          image->count<char>(snap_anno_pool));
+    auto sym_strs = image->section<uint64_t>(snap_sym_strs, 2 * ns + 1);
+    auto anno_strs =
+        image->section<uint64_t>(snap_anno_strs, 3 * na + 1);
+    auto sym_index = image->section<uint64_t>(
+        snap_sym_index, image->count<uint64_t>(snap_sym_index));
+    auto anno_index = image->section<uint64_t>(
+        snap_anno_index, image->count<uint64_t>(snap_anno_index));
+    auto sym_offsets = image->section<unsigned>(snap_sym_offsets, ns + 1);
+    auto sym_edges = image->section<unsigned>(snap_sym_edges, ne);
+    auto anno_offsets =
+        image->section<unsigned>(snap_anno_offsets, na + 1);
+    auto anno_edges = image->section<unsigned>(snap_anno_edges, ne);
+    auto ascending = [](const auto &col, const uint64_t &last) {
+      for (size_t i = 1; i < col.size(); ++i) {
+        if (col[i] < col[i - 1])
+          return false;
+      }
+      return col[0] == 0 && col[col.size() - 1] == last;
+    };
+    auto below = [](const column<unsigned> &col, const uint64_t &bound) {
+      for (const unsigned &v : col) {
+        if (v >= bound)
+          return false;
       }
-    } else if (anno_count == 0) {
-      for (const auto &sym : syms) {
-        for (const unsigned &aidx : sym->mapped) {
-          annos[aidx]->mapped.push_back(sym_idx(sym->data.sym));
-        }
+      return true;
+    };
+    auto table = [](const column<uint64_t> &col, const uint64_t &n) {
+      if (col.size() < 8 || (col.size() & (col.size() - 1)) ||
+          col.size() <= n)
+        return false;
+      std::vector<bool> seen(n, false);
+      for (const uint64_t &slot : col) {
+        if (slot == 0)
+          continue;
+        const uint64_t idx = slot & 0xffffffffu;
+        if (idx == 0 || idx > n || seen[idx - 1])
+          return false;
+        seen[idx - 1] = true;
       }
+      return std::find(seen.begin(), seen.end(), false) == seen.end();
+    };
+    if (!ascending(sym_strs, sym_pool.size()) ||
+        !ascending(anno_strs, anno_pool.size()) ||
+        !ascending(sym_offsets, ne) || !ascending(anno_offsets, ne) ||
+        !below(sym_edges, na) || !below(anno_edges, ns) ||
+        !table(sym_index, ns) || !table(anno_index, na)) {
+      throw(std::runtime_error("Corrupt snapshot:" + fname));
     }
-    return;
+    _new_edges = {};
+    _sym_pool = std::move(sym_pool);
+    _anno_pool = std::move(anno_pool);
+    _sym_strs = std::move(sym_strs);
+    _anno_strs = std::move(anno_strs);
+    _sym_index = id_table(std::move(sym_index));
+    _anno_index = id_table(std::move(anno_index));
+    _sym_offsets = std::move(sym_offsets);
+    _sym_edges = std::move(sym_edges);
+    _anno_offsets = std::move(anno_offsets);
+    _anno_edges = std::move(anno_edges);
+    _anno_masks.clear();
+    _sym_masks.clear();
+    _sym_rows.clear();
+    _anno_rows.clear();
+    _anno_mask_rows.clear();
+    _sym_mask_rows.clear();
+    _anno_sets.reset();
+    _anno_set_rows.clear();
+    _with_sets = false;
+    _sets_cost = 0;
+    _changes = 0;
+    _with_masks = image->count<uint64_t>(snap_anno_masks) > 0;
+    if (_with_masks) {
+      _anno_masks =
+          image->section<typename atype::mappings>(snap_anno_masks, na);
+      _sym_masks =
+          image->section<typename stype::mappings>(snap_sym_masks, ns);
+    }
+    _image = std::move(image);
+    ++_version;
+    log_factorials::instance().reserve(ns);
+  };
+  // distinct indices of the known symbols in a list, in list order
+  std::vector<unsigned> sym_idxs(const std::vector<std::string> &mapped) const {
+    std::vector<unsigned> out;
+    out.reserve(mapped.size());
+    std::vector<bool> seen(total_syms(), false);
+    for (const auto &sym : mapped) {
+      const unsigned idx = find_sym(sym);
+      if (idx != id_table::npos) {
+        if (!seen[idx])
+          out.push_back(idx);
+        seen[idx] = true;
+      }
+    }
+    return out;
   };
   std::unique_ptr<typename atype::mappings>
   encode_syms(const std::vector<std::string> &mapped) const {
+    ENRICHED_COUNT(prof_bitsets, 1);
     auto out = std::make_unique<typename atype::mappings>();
     for (const auto &sym : mapped) {
-      if (has_sym(sym))
-        out->set(sym_idx(sym));
+      const unsigned idx = find_sym(sym);
+      if (idx != id_table::npos)
+        out->set(idx);
     }
     return out;
   };
   std::unique_ptr<typename stype::mappings>
   encode_annos(const std::vector<std::string> &mapped) const {
+    ENRICHED_COUNT(prof_bitsets, 1);
     auto out = std::make_unique<typename stype::mappings>();
     for (const auto &anno : mapped) {
-      if (has_anno(anno))
-        out->set(anno_idx(anno));
+      const unsigned idx = find_anno(anno);
+      if (idx != id_table::npos)
+        out->set(idx);
     }
     return out;
   };
@@ -251,49 +1028,120 @@ public:
 
 // a Set is a collection of either symbols or annotations that contains a subset
 // of those data contains simple methods such as getting all items in the set,
-// getting all mappings (union)
+// getting all mappings (union). a set is a view: it keeps the sorted indices
+// of its members and a pointer to its dataset, which must outlive it. dense
+// masks are built only when a kernel asks for one
 template <typename dtype, typename dsettype> class Set {
 protected:
   std::vector<unsigned> idxs;
-  dsettype *source;
-  typename dtype::mappings mapped_mask;
+  const dsettype *source;
+
+  Set(const dsettype &src) : source(&src){};
+  Set(const Set &) = default;
+  Set(Set &&) = default;
+  // sorted, distinct members out of any list of indices below total
+  void _assign(std::vector<unsigned> from, const unsigned &total) {
+    for (const unsigned &idx : from) {
+      if (idx >= total) {
+        throw(std::out_of_range("set member index out of range"));
+      }
+    }
+    std::sort(from.begin(), from.end());
+    from.erase(std::unique(from.begin(), from.end()), from.end());
+    idxs = std::move(from);
+  };
+  // a mask of the members, built on first use and shared with copies made
+  // after that. concurrent first callers may each build one, only one is
+  // kept
+  template <typename M>
+  const M &_lazy_mask(std::shared_ptr<const M> &slot) const {
+    std::shared_ptr<const M> cur = std::atomic_load(&slot);
+    if (!cur) {
+      ENRICHED_COUNT(prof_bitsets, 1);
+      cur = _build_mask<M>();
+      std::shared_ptr<const M> none;
+      if (!std::atomic_compare_exchange_strong(&slot, &none, cur))
+        cur = none;
+    }
+    return *cur;
+  };
+  template <typename M> std::shared_ptr<const M> _build_mask() const {
+    if constexpr (std::is_same<M, roaring_mask>::value) {
+      return std::make_shared<const roaring_mask>(idxs);
+    } else {
+      auto out = std::make_shared<M>();
+      for (const unsigned &idx : idxs) {
+        out->set(idx);
+      }
+      return out;
+    }
+  };
 
 public:
-  Set(const std::vector<std::string> &data, dsettype &src) {
-    idxs.reserve(data.size());
-    source = &src;
+  virtual ~Set(){};
+  // a set is never assigned to, so the references its masks were handed
+  // out as live as long as the set
+  Set &operator=(const Set &) = delete;
+  virtual const std::vector<dtype> get() const = 0;
+  // indices of the distinct members, ascending
+  const std::vector<unsigned> &get_idxs() const { return idxs; };
+  size_t size() const { return idxs.size(); };
+  bool contains(const unsigned &idx) const {
+    return std::binary_search(idxs.begin(), idxs.end(), idx);
   };
-  virtual const std::vector<const dtype *> get() const = 0;
+  // the union of the members' mappings
   std::unique_ptr<typename dtype::mappings> get_mapped_mask() const {
-    return std::make_unique<typename dtype::mappings>(mapped_mask);
-  };
-  void _get_mapped_mask() {
+    ENRICHED_COUNT(prof_bitsets, 1);
+    auto out = std::make_unique<typename dtype::mappings>();
     for (const auto &dt : get()) {
-      for (const unsigned &idx : dt->mapped) {
-        mapped_mask.set(idx);
+      for (const unsigned &idx : dt.mapped) {
+        out->set(idx);
       }
     }
+    return out;
   };
 };
 
 template <typename stype, typename atype>
 class SymSet : public Set<stype, Dataset<stype, atype>> {
 private:
-  typename atype::mappings mask;
+  mutable std::shared_ptr<const typename atype::mappings> mask;
+  mutable std::shared_ptr<const roaring_mask> compressed;
+
+  explicit SymSet(const Dataset<stype, atype> &src)
+      : Set<stype, Dataset<stype, atype>>(src){};
 
 public:
-  SymSet(const std::vector<std::string> &data, Dataset<stype, atype> &src)
-      : Set<stype, Dataset<stype, atype>>(data, src) {
+  // copies share the masks already built; the slots are read atomically,
+  // another thread may be filling them
+  SymSet(const SymSet &other)
+      : Set<stype, Dataset<stype, atype>>(other),
+        mask(std::atomic_load(&other.mask)),
+        compressed(std::atomic_load(&other.compressed)){};
+  SymSet(SymSet &&) = default;
+  SymSet(const std::vector<std::string> &data,
+         const Dataset<stype, atype> &src)
+      : Set<stype, Dataset<stype, atype>>(src) {
+    ENRICHED_PHASE(phase_set);
+    std::vector<unsigned> found;
+    found.reserve(data.size());
     for (const auto &sym : data) {
-      if (this->source->has_sym(sym)) {
-        this->idxs.push_back(this->source->sym_idx(sym));
-      }
+      const unsigned idx = src.find_sym(sym);
+      if (idx != id_table::npos)
+        found.push_back(idx);
     }
-    _get_mask();
-    this->_get_mapped_mask();
+    this->_assign(std::move(found), src.total_syms());
   };
-  const std::vector<const stype *> get() const {
-    std::vector<const stype *> out;
+  // from symbol indices already resolved against src, no lookups
+  static SymSet from_idxs(std::vector<unsigned> idxs,
+                          const Dataset<stype, atype> &src) {
+    ENRICHED_PHASE(phase_set);
+    SymSet out(src);
+    out._assign(std::move(idxs), src.total_syms());
+    return out;
+  };
+  const std::vector<stype> get() const {
+    std::vector<stype> out;
     out.reserve(this->idxs.size());
     for (unsigned idx : this->idxs) {
       out.push_back(this->source->get_sym(idx));
@@ -301,102 +1149,72 @@ public:
     return out;
   };
   std::unique_ptr<typename atype::mappings> get_mask() const {
-    return std::make_unique<typename atype::mappings>(mask);
+    ENRICHED_COUNT(prof_bitsets, 1);
+    return std::make_unique<typename atype::mappings>(get_mask_ref());
   };
-  void _get_mask() {
-    for (auto &idx : this->idxs) {
-      mask.set(idx);
-    }
+  const typename atype::mappings &get_mask_ref() const {
+    return this->_lazy_mask(mask);
+  };
+  const roaring_mask &get_compressed_ref() const {
+    return this->_lazy_mask(compressed);
   };
 };
 
 template <typename stype, typename atype>
 class AnnoSet : public Set<atype, Dataset<stype, atype>> {
 private:
-  typename stype::mappings mask;
+  mutable std::shared_ptr<const typename stype::mappings> mask;
+  mutable std::shared_ptr<const roaring_mask> compressed;
+
+  explicit AnnoSet(const Dataset<stype, atype> &src)
+      : Set<atype, Dataset<stype, atype>>(src){};
 
 public:
+  // copies share the masks already built; the slots are read atomically,
+  // another thread may be filling them
+  AnnoSet(const AnnoSet &other)
+      : Set<atype, Dataset<stype, atype>>(other),
+        mask(std::atomic_load(&other.mask)),
+        compressed(std::atomic_load(&other.compressed)){};
+  AnnoSet(AnnoSet &&) = default;
   AnnoSet(const std::vector<std::string> &data,
           const Dataset<stype, atype> &src)
-      : Set<atype, Dataset<stype, atype>>(data, src) {
-    for (const auto &sym : data) {
-      if (this->source->has_anno(sym)) {
-        this->idxs.push_back(this->source->anno_idx(sym));
-      }
+      : Set<atype, Dataset<stype, atype>>(src) {
+    ENRICHED_PHASE(phase_set);
+    std::vector<unsigned> found;
+    found.reserve(data.size());
+    for (const auto &anno : data) {
+      const unsigned idx = src.find_anno(anno);
+      if (idx != id_table::npos)
+        found.push_back(idx);
     }
-    _get_mask();
-    this->_get_mapped_mask();
+    this->_assign(std::move(found), src.total_annos());
+  };
+  // from annotation indices already resolved against src, no lookups
+  static AnnoSet from_idxs(std::vector<unsigned> idxs,
+                          const Dataset<stype, atype> &src) {
+    ENRICHED_PHASE(phase_set);
+    AnnoSet out(src);
+    out._assign(std::move(idxs), src.total_annos());
+    return out;
   };
-  const std::vector<const atype *> get() const {
-    std::vector<const atype *> out;
+  const std::vector<atype> get() const {
+    std::vector<atype> out;
+    out.reserve(this->idxs.size());
     for (const auto &idx : this->idxs) {
       out.push_back(this->source->get_anno(idx));
     }
     return out;
   };
   std::unique_ptr<typename stype::mappings> get_mask() const {
-    return std::make_unique<typename stype::mappings>(mask);
+    ENRICHED_COUNT(prof_bitsets, 1);
+    return std::make_unique<typename stype::mappings>(get_mask_ref());
   };
-  void _get_mask() {
-    for (auto &idx : this->idxs) {
-      mask.set(idx);
-    }
+  const typename stype::mappings &get_mask_ref() const {
+    return this->_lazy_mask(mask);
   };
-};
-
-struct test_result {
-  std::string name;
-  double stat = -1000;
-  bool enriched = false;
-};
-
-struct idxrange {
-  std::string name;
-  unsigned begin, end;
-};
-
-class ResultDataset {
-private:
-  std::unordered_map<std::string, std::vector<unsigned>> idxs;
-  std::vector<idxrange> tests;
-  std::vector<test_result> data;
-
-public:
-  ResultDataset() {};
-  ResultDataset(const std::string &name, const std::vector<test_result> &res) {
-    add(name, res);
-  };
-  void add(const std::string &name, const std::vector<test_result> &res) {
-    unsigned start = data.size();
-    for (const auto &r : res) {
-      unsigned idx = data.size();
-      if (idxs.count(r.name)) {
-        idxs[r.name].push_back(idx);
-      } else {
-        idxs[r.name] = {idx};
-      }
-      data.push_back(r);
-    }
-    tests.push_back({name, start, (unsigned)data.size()});
-  };
-  void print() {
-    std::cout << " ========== TEST RESULT ==========" << std::endl;
-    for (auto &t : tests) {
-      std::cout << "\t" << t.name;
-    }
-    std::cout << std::endl;
-    for (auto &idx : idxs) {
-      std::cout << idx.first;
-      for (auto &i : idx.second) {
-        std::cout << "\t" << data[i].stat;
-        if (data[i].enriched) {
-          std::cout << "+";
-        } else {
-          std::cout << "-";
-        }
-      }
-      std::cout << std::endl;
-    }
+  const roaring_mask &get_compressed_ref() const {
+    return this->_lazy_mask(compressed);
   };
 };
 
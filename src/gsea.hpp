@@ -0,0 +1,311 @@
+#ifndef GSEA
+#define GSEA
+#include "data.hpp"
+#include "io.hpp"
+#include "parallel.hpp"
+#include "permutation.hpp"
+#include "results.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// named score columns over the symbols of the dataset they were loaded
+// for, column[c][symbol index]. NaN marks a symbol without a score
+class symbol_scores {
+private:
+  std::vector<std::string> names;
+  std::vector<std::vector<double>> cols;
+
+public:
+  symbol_scores(){};
+  symbol_scores(const unsigned &syms, std::vector<std::string> names)
+      : names(std::move(names)),
+        cols(this->names.size(),
+             std::vector<double>(syms,
+                                 std::numeric_limits<double>::quiet_NaN())){};
+  size_t size() const { return names.size(); };
+  const std::vector<std::string> &columns() const { return names; };
+  const std::vector<double> &operator[](const size_t &c) const {
+    return cols[c];
+  };
+  const std::vector<double> &column(const std::string_view &name) const {
+    for (size_t c = 0; c < names.size(); ++c) {
+      if (names[c] == name)
+        return cols[c];
+    }
+    throw(std::out_of_range("no score column " + std::string(name)));
+  };
+  void set(const size_t &c, const unsigned &sym, const double &v) {
+    cols[c][sym] = v;
+  };
+};
+
+// reads per symbol scores: a symbol then one score per column on each
+// line. the first line names the columns if its symbol is not in dataset
+// and none of its scores is a number, otherwise they are named score,
+// score2, ... and it is read as data. lines starting with # are comments.
+// symbols not in dataset are skipped, the first line of a repeated symbol
+// wins and an empty or non numeric score is left missing
+template <typename D>
+symbol_scores load_scores(const D &dataset, const std::string &fname) {
+  symbol_scores out;
+  bool first = true;
+  std::vector<std::string_view> fields;
+  for_each_line(fname, [&](std::string_view line) {
+    if (line[0] == '#')
+      return;
+    const std::string_view sym = next_token(line, '\t');
+    fields.clear();
+    while (!line.empty()) {
+      fields.push_back(next_token(line, '\t'));
+    }
+    double v;
+    if (first) {
+      first = false;
+      bool header =
+          !fields.empty() && dataset.find_sym(sym) == id_table::npos;
+      for (const auto &f : fields) {
+        header &= !parse_double(f, v);
+      }
+      std::vector<std::string> names;
+      for (size_t c = 0; c < fields.size(); ++c) {
+        names.emplace_back(header ? std::string(fields[c])
+                           : c == 0 ? std::string("score")
+                                    : "score" + std::to_string(c + 1));
+      }
+      out = symbol_scores(dataset.total_syms(), std::move(names));
+      if (header)
+        return;
+    }
+    const unsigned s = dataset.find_sym(sym);
+    if (s == id_table::npos)
+      return;
+    for (size_t c = 0; c < fields.size() && c < out.size(); ++c) {
+      if (std::isnan(out[c][s]) && parse_double(fields[c], v))
+        out.set(c, s, v);
+    }
+  });
+  return out;
+}
+
+// a ranked list: the scored symbols by decreasing score (ties by symbol
+// index), the rank of every symbol (npos if unscored) and the GSEA weight
+// |score|^p of every rank, laid out in rank order for the sweeps
+struct ranked_list {
+  static constexpr unsigned npos = std::numeric_limits<unsigned>::max();
+  std::vector<unsigned> syms, rank_of;
+  std::vector<double> weights;
+
+  ranked_list(const std::vector<double> &scores, const unsigned &total_syms,
+              const double &p = 1) {
+    rank_of.assign(total_syms, npos);
+    for (unsigned s = 0; s < total_syms && s < scores.size(); ++s) {
+      if (!std::isnan(scores[s]))
+        syms.push_back(s);
+    }
+    std::sort(syms.begin(), syms.end(),
+              [&](const unsigned &a, const unsigned &b) {
+                return scores[a] > scores[b] ||
+                       (scores[a] == scores[b] && a < b);
+              });
+    weights.resize(syms.size());
+    for (unsigned r = 0; r < syms.size(); ++r) {
+      rank_of[syms[r]] = r;
+      const double w = std::fabs(scores[syms[r]]);
+      weights[r] = p == 1 ? w : std::pow(w, p);
+    }
+  };
+  unsigned size() const { return syms.size(); };
+};
+
+// the weighted Kolmogorov-Smirnov running sum of one set, given its
+// sorted ranks. the sum only rises at hits and falls linearly in between,
+// so its maximum is right after a hit and its minimum right before one:
+// one pass over the hits is enough, never over the whole list. returns
+// the signed deviation of largest magnitude. with all hit weights zero
+// every hit counts the same, as in the unweighted statistic
+inline double running_sum_es(const unsigned *ranks, const unsigned &k,
+                             const double *weights, const unsigned &n) {
+  if (k == 0 || k >= n)
+    return 0;
+  double total = 0;
+  for (unsigned j = 0; j < k; ++j) {
+    total += weights[ranks[j]];
+  }
+  const bool flat = total == 0;
+  const double inv_hit = flat ? 1.0 / k : 1.0 / total,
+               inv_miss = 1.0 / (n - k);
+  double sum = 0, hi = 0, lo = 0;
+  for (unsigned j = 0; j < k; ++j) {
+    // misses before rank ranks[j]
+    const double miss = (ranks[j] - j) * inv_miss;
+    lo = std::min(lo, sum - miss);
+    sum += (flat ? 1.0 : weights[ranks[j]]) * inv_hit;
+    hi = std::max(hi, sum - miss);
+  }
+  return hi >= -lo ? hi : lo;
+}
+
+// the rank based test of every annotation with between min_size and
+// max_size scored symbols: the enrichment score, its normalized form and
+// a p-value from random sets of the same size (gene set permutation).
+// nes divides es by the mean of the null scores of the same sign, p is
+// (null scores of that sign at least as extreme + 1) / (those + 1)
+struct gsea_result {
+  std::vector<unsigned> annos, sizes;
+  std::vector<double> es, nes, p;
+  unsigned perms = 0;
+};
+
+// scores is one value per symbol (a symbol_scores column), weight the
+// exponent p of the GSEA weighting, 0 for the classic unweighted KS. the
+// ranked list is sorted once and every annotation's hits are its CSR row
+// mapped to ranks. the null distributions are built once per distinct
+// size, perms each, in blocks over `threads` workers with a counter based
+// stream per (size, permutation), so the result only depends on seed
+template <typename D>
+gsea_result gsea(const std::vector<double> &scores, const D &dataset,
+                 const unsigned &perms = 1000, const uint64_t &seed = 1,
+                 const unsigned &threads = 1, const double &weight = 1,
+                 const unsigned &min_size = 15,
+                 const unsigned &max_size = 500) {
+  if (!dataset.has_index()) {
+    throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+  }
+  ENRICHED_PHASE(phase_stats);
+  const ranked_list list(scores, dataset.total_syms(), weight);
+  const unsigned n = list.size(), na = dataset.total_annos();
+  gsea_result out;
+  out.perms = perms;
+  // 1, observed scores from the ranks of every annotation's hits
+  std::vector<double> es(na, 0);
+  std::vector<unsigned> size_of(na, ranked_list::npos);
+  parallel_blocks(
+      na, block_size(na, threads), threads,
+      [&](const unsigned &, const unsigned &begin, const unsigned &end) {
+        std::vector<unsigned> ranks;
+        for (unsigned a = begin; a < end; ++a) {
+          ranks.clear();
+          for (const unsigned &s : dataset.anno_row(a)) {
+            if (list.rank_of[s] != ranked_list::npos)
+              ranks.push_back(list.rank_of[s]);
+          }
+          if (ranks.size() < min_size || ranks.size() > max_size ||
+              ranks.size() >= n)
+            continue;
+          std::sort(ranks.begin(), ranks.end());
+          es[a] = running_sum_es(ranks.data(), ranks.size(),
+                                 list.weights.data(), n);
+          size_of[a] = ranks.size();
+        }
+      });
+  std::vector<unsigned> size_slot(std::min(max_size, n) + 1, ranked_list::npos),
+      sizes;
+  for (unsigned a = 0; a < na; ++a) {
+    const unsigned k = size_of[a];
+    if (k == ranked_list::npos)
+      continue;
+    out.annos.push_back(a);
+    out.sizes.push_back(k);
+    out.es.push_back(es[a]);
+    if (size_slot[k] == ranked_list::npos) {
+      size_slot[k] = sizes.size();
+      sizes.push_back(k);
+    }
+  }
+  // 2, null scores, perms per distinct size
+  std::vector<double> null(static_cast<size_t>(sizes.size()) * perms);
+  const unsigned jobs = sizes.size() * perms;
+  parallel_blocks(
+      jobs, block_size(jobs, threads, 64), threads,
+      [&](const unsigned &, const unsigned &begin, const unsigned &end) {
+        std::vector<unsigned> drawn;
+        std::vector<uint64_t> mask((n + 63) / 64, 0);
+        for (unsigned job = begin; job < end; ++job) {
+          const unsigned k = sizes[job / perms], p = job % perms;
+          // Floyd's sampling of k distinct ranks
+          counter_rng rng(seed, (static_cast<uint64_t>(k) << 32) | p);
+          drawn.clear();
+          for (unsigned j = n - k; j < n; ++j) {
+            unsigned t = rng.below(j + 1);
+            if (mask[t >> 6] >> (t & 63) & 1)
+              t = j;
+            mask[t >> 6] |= uint64_t(1) << (t & 63);
+            drawn.push_back(t);
+          }
+          for (const unsigned &t : drawn) {
+            mask[t >> 6] = 0;
+          }
+          std::sort(drawn.begin(), drawn.end());
+          null[job] = running_sum_es(drawn.data(), k, list.weights.data(), n);
+        }
+      });
+  // 3, per size: the null scores of each sign sorted, and their means
+  std::vector<std::vector<double>> pos(sizes.size()), neg(sizes.size());
+  std::vector<double> pos_mean(sizes.size()), neg_mean(sizes.size());
+  for (unsigned i = 0; i < sizes.size(); ++i) {
+    double sp = 0, sn = 0;
+    for (unsigned p = 0; p < perms; ++p) {
+      const double v = null[static_cast<size_t>(i) * perms + p];
+      if (v >= 0) {
+        pos[i].push_back(v);
+        sp += v;
+      } else {
+        neg[i].push_back(-v);
+        sn -= v;
+      }
+    }
+    std::sort(pos[i].begin(), pos[i].end());
+    std::sort(neg[i].begin(), neg[i].end());
+    pos_mean[i] = pos[i].empty() ? 0 : sp / pos[i].size();
+    neg_mean[i] = neg[i].empty() ? 0 : sn / neg[i].size();
+  }
+  out.nes.resize(out.annos.size());
+  out.p.resize(out.annos.size());
+  for (unsigned j = 0; j < out.annos.size(); ++j) {
+    const unsigned i = size_slot[out.sizes[j]];
+    const bool up = out.es[j] >= 0;
+    const std::vector<double> &side = up ? pos[i] : neg[i];
+    const double mean = up ? pos_mean[i] : neg_mean[i],
+                 v = std::fabs(out.es[j]);
+    const unsigned extreme =
+        side.end() - std::lower_bound(side.begin(), side.end(), v);
+    out.p[j] = (extreme + 1.0) / (side.size() + 1.0);
+    out.nes[j] = mean > 0 ? out.es[j] / mean
+                          : std::numeric_limits<double>::quiet_NaN();
+  }
+  return out;
+}
+
+constexpr bool abs_descending(const test_result &a, const test_result &b) {
+  return (a.stat < 0 ? -a.stat : a.stat) > (b.stat < 0 ? -b.stat : b.stat);
+}
+
+// adds the permutation p-values and the normalized enrichment scores of a
+// ranked list as two sections, each with its best k annotations; enriched
+// means the annotation gathers at the top of the list
+template <typename D>
+void gsea_test(const std::vector<double> &scores, const D &dataset,
+               ResultDataset &rout, const unsigned &perms = 1000,
+               const uint64_t &seed = 1, std::string test_name = "GSEA",
+               const unsigned &threads = 1,
+               const unsigned &k = default_top_k) {
+  const auto res = gsea(scores, dataset, perms, seed, threads);
+  top_k<ascending> p(k);
+  top_k<abs_descending> nes(k);
+  for (unsigned j = 0; j < res.annos.size(); ++j) {
+    const bool enriched = res.es[j] > 0;
+    p.push({res.annos[j], res.p[j], enriched});
+    if (!std::isnan(res.nes[j]))
+      nes.push({res.annos[j], res.nes[j], enriched});
+  }
+  rout.add(test_name + " (P)", p.take(), dataset);
+  rout.add(test_name + " (NES)", nes.take(), dataset);
+}
+#endif
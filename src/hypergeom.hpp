@@ -0,0 +1,142 @@
+#ifndef HYPERGEOM
+#define HYPERGEOM
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// log(n!) lookup shared by every dataset. the table only ever grows: a
+// larger copy is published atomically and older copies are kept alive, so
+// readers never lock and never see a table being resized under them.
+// entries come from lgamma so a lookup past the end agrees with the table
+class log_factorials {
+private:
+  std::atomic<const std::vector<double> *> current{nullptr};
+  std::vector<std::unique_ptr<const std::vector<double>>> tables;
+  std::mutex grow;
+
+public:
+  static log_factorials &instance() {
+    static log_factorials table;
+    return table;
+  };
+  void reserve(const unsigned &n) {
+    std::lock_guard<std::mutex> lock(grow);
+    const auto *cur = current.load(std::memory_order_acquire);
+    if (cur && cur->size() > n) {
+      return;
+    }
+    auto next = std::make_unique<std::vector<double>>(n + 1);
+    for (unsigned i = 0; i <= n; ++i) {
+      (*next)[i] = std::lgamma(static_cast<double>(i) + 1.0);
+    }
+    current.store(next.get(), std::memory_order_release);
+    tables.push_back(std::move(next));
+  };
+  double operator()(const unsigned &n) const {
+    const auto *cur = current.load(std::memory_order_acquire);
+    if (cur && n < cur->size()) {
+      return (*cur)[n];
+    }
+    return std::lgamma(static_cast<double>(n) + 1.0);
+  };
+};
+
+inline double log_factorial(const unsigned &n) {
+  return log_factorials::instance()(n);
+}
+
+// a 2x2 table  a b | c d  with fixed margins: X is the top left cell
+// (a, x for short), r1 = a + b, c1 = a + c, n = a + b + c + d
+struct hypergeom {
+  unsigned r1, r2, c1, n, lo, hi;
+  double base;
+  hypergeom(const unsigned &a, const unsigned &b, const unsigned &c,
+            const unsigned &d)
+      : r1(a + b), r2(c + d), c1(a + c), n(a + b + c + d) {
+    lo = c1 > r2 ? c1 - r2 : 0;
+    hi = std::min(r1, c1);
+    base = log_factorial(r1) + log_factorial(r2) + log_factorial(c1) +
+           log_factorial(n - c1) - log_factorial(n);
+  };
+  double log_pmf(const unsigned &x) const {
+    return base - log_factorial(x) - log_factorial(r1 - x) -
+           log_factorial(c1 - x) - log_factorial(r2 - c1 + x);
+  };
+  // P(x + 1) / P(x) and P(x - 1) / P(x)
+  double up(const unsigned &x) const {
+    return (static_cast<double>(r1 - x) * (c1 - x)) /
+           (static_cast<double>(x + 1) * (r2 - c1 + x + 1));
+  };
+  double down(const unsigned &x) const {
+    return (static_cast<double>(x) * (r2 - c1 + x)) /
+           (static_cast<double>(r1 - x + 1) * (c1 - x + 1));
+  };
+  unsigned mode() const {
+    const double m = (static_cast<double>(r1) + 1) * (c1 + 1) / (n + 2);
+    return std::min(hi, std::max(lo, static_cast<unsigned>(m)));
+  };
+  // log of sum P(y) for y from x walking away from the mode, relative terms
+  // shrink monotonically so the walk stops once they stop mattering
+  double log_tail(const unsigned &x, const bool &upper) const {
+    double sum = 1.0, term = 1.0;
+    if (upper) {
+      for (unsigned y = x; y < hi && term > sum * 1e-17; ++y) {
+        term *= up(y);
+        sum += term;
+      }
+    } else {
+      for (unsigned y = x; y > lo && term > sum * 1e-17; --y) {
+        term *= down(y);
+        sum += term;
+      }
+    }
+    return log_pmf(x) + std::log(sum);
+  };
+  // log P(X >= x), summing whichever side of x does not contain the mode
+  double log_greater(const unsigned &x) const {
+    if (x <= lo) {
+      return 0.0;
+    }
+    if (x > mode()) {
+      return log_tail(x, true);
+    }
+    return std::log1p(-std::exp(log_tail(x - 1, false)));
+  };
+  double log_less(const unsigned &x) const {
+    if (x >= hi) {
+      return 0.0;
+    }
+    if (x < mode()) {
+      return log_tail(x, false);
+    }
+    return std::log1p(-std::exp(log_tail(x + 1, true)));
+  };
+  // log of the two sided p-value: the mass of every table at most as likely
+  // as the observed one (with the usual 1e-7 relative tolerance). the far
+  // tail is walked in from its end only as long as it stays below P(x)
+  double log_two_sided(const unsigned &x) const {
+    const unsigned m = mode();
+    const double lp = log_pmf(x), cut = lp + std::log1p(1e-7);
+    double far = 0.0;
+    if (x >= m) {
+      double logp = log_pmf(lo);
+      for (unsigned y = lo; y < m && logp <= cut; ++y) {
+        far += std::exp(logp - lp);
+        logp += std::log(up(y));
+      }
+      const double near = std::exp(log_tail(x, true) - lp);
+      return std::min(0.0, lp + std::log(near + far));
+    }
+    double logp = log_pmf(hi);
+    for (unsigned y = hi; y > m && logp <= cut; --y) {
+      far += std::exp(logp - lp);
+      logp += std::log(down(y));
+    }
+    const double near = std::exp(log_tail(x, false) - lp);
+    return std::min(0.0, lp + std::log(near + far));
+  };
+};
+#endif
@@ -1,69 +1,323 @@
 #ifndef IO
 #define IO
+#include "profile.hpp"
+#include "storage.hpp"
+#include <charconv>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#ifdef ENRICHED_ZLIB
+#include <zlib.h>
+#endif
 
-template <typename D>
-void load_annotations_plain(D &dataset, std::string fname) {
-  std::ifstream ifs(fname);
-  if (!ifs.is_open()) {
-    throw(std::runtime_error("Wrong filename provided:" + fname));
+// splits off the text up to the next delim (or the end) and advances rest
+// past it; memchr does the scanning
+inline std::string_view next_token(std::string_view &rest, const char &delim) {
+  const void *hit = std::memchr(rest.data(), delim, rest.size());
+  const size_t n = hit ? static_cast<const char *>(hit) - rest.data()
+                       : rest.size();
+  std::string_view out = rest.substr(0, n);
+  rest.remove_prefix(hit ? n + 1 : n);
+  return out;
+}
+
+// parses the whole of s as a double, false if it is not one
+inline bool parse_double(const std::string_view &s, double &out) {
+  if (s.empty())
+    return false;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  const char *first = s.data() + (s[0] == '+');
+  const auto res = std::from_chars(first, s.data() + s.size(), out);
+  return res.ec == std::errc() && res.ptr == s.data() + s.size();
+#else
+  const std::string tmp(s);
+  char *end = nullptr;
+  out = std::strtod(tmp.c_str(), &end);
+  return end == tmp.c_str() + tmp.size();
+#endif
+}
+
+// true if data starts with the gzip magic bytes
+inline bool is_gzip(const std::string_view &data) {
+  return data.size() >= 2 && static_cast<unsigned char>(data[0]) == 0x1f &&
+         static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+// inflates a gzip file held in memory a block at a time and hands each
+// block to fn, so only one block of the decompressed text is ever held.
+// concatenated gzip members are read one after another
+template <typename F>
+void for_each_gzip_block(const std::string_view &in, const std::string &fname,
+                         F &&fn, const size_t &block = 1 << 18) {
+#ifdef ENRICHED_ZLIB
+  z_stream zs{};
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+    throw(std::runtime_error("Cannot start inflating:" + fname));
   }
-  std::string line, ids, name, desc;
-  while (std::getline(ifs, line)) {
+  std::vector<char> out(block);
+  size_t fed = 0;
+  bool done = false;
+  while (!done) {
+    if (zs.avail_in == 0 && fed < in.size()) {
+      // avail_in is 32 bit, feed the input in pieces of at most 1GB
+      const size_t n = std::min<size_t>(in.size() - fed, 1u << 30);
+      zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()) +
+                                             fed);
+      zs.avail_in = static_cast<uInt>(n);
+      fed += n;
+    }
+    zs.next_out = reinterpret_cast<Bytef *>(out.data());
+    zs.avail_out = static_cast<uInt>(out.size());
+    const int ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      done = zs.avail_in == 0 && fed == in.size();
+      if (!done)
+        inflateReset(&zs);
+    } else if (ret != Z_OK &&
+               !(ret == Z_BUF_ERROR && zs.avail_in == 0 && fed < in.size())) {
+      inflateEnd(&zs);
+      throw(std::runtime_error("Corrupt or truncated gzip file:" + fname));
+    }
+    const size_t n = out.size() - zs.avail_out;
+    if (n) {
+      try {
+        fn(std::string_view(out.data(), n));
+      } catch (...) {
+        inflateEnd(&zs);
+        throw;
+      }
+    }
+  }
+  inflateEnd(&zs);
+#else
+  (void)in;
+  (void)fn;
+  (void)block;
+  throw(std::runtime_error(
+      "Gzip input needs a build with ENRICHED_ZLIB defined:" + fname));
+#endif
+}
+
+// calls fn on every non empty line of a file, with any \r stripped. gzip
+// files are recognised by their magic bytes and inflated as they are read;
+// a line split across two blocks is the only text copied
+template <typename F> void for_each_line(const std::string &fname, F &&fn) {
+  ENRICHED_PHASE(phase_parse);
+  mapped_file file(fname);
+  std::string_view rest = file.view();
+  uint64_t lines = 0;
+  auto emit = [&](std::string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
     if (line.size() == 0) {
-      continue;
+      return;
+    }
+    ++lines;
+    fn(line);
+  };
+  if (is_gzip(rest)) {
+    std::string carry;
+    for_each_gzip_block(rest, fname, [&](std::string_view block) {
+      if (!carry.empty()) {
+        const void *hit = std::memchr(block.data(), '\n', block.size());
+        if (!hit) {
+          carry.append(block.data(), block.size());
+          return;
+        }
+        const size_t n = static_cast<const char *>(hit) - block.data();
+        carry.append(block.data(), n);
+        block.remove_prefix(n + 1);
+        emit(carry);
+        carry.clear();
+      }
+      while (!block.empty()) {
+        const void *hit = std::memchr(block.data(), '\n', block.size());
+        if (!hit) {
+          carry.assign(block.data(), block.size());
+          return;
+        }
+        emit(next_token(block, '\n'));
+      }
+    });
+    emit(carry);
+  } else {
+    while (!rest.empty()) {
+      emit(next_token(rest, '\n'));
     }
-    std::stringstream ss(line);
-    std::getline(ss, ids, '\t');
-    std::getline(ss, name, '\t');
-    std::getline(ss, desc, '\t');
-    dataset.add_anno(ids, name, desc);
   }
+  ENRICHED_COUNT(prof_lines_parsed, lines);
+}
+
+template <typename D>
+void load_annotations_plain(D &dataset, std::string fname) {
+  for_each_line(fname, [&](std::string_view line) {
+    std::string_view ids = next_token(line, '\t');
+    std::string_view name = next_token(line, '\t');
+    std::string_view desc = next_token(line, '\t');
+    dataset.add_anno(ids, name, desc);
+  });
 }
 
 template <typename D>
 void load_syms_with_mappings(D &dataset, std::string fname) {
-  std::ifstream ifs(fname);
-  if (!ifs.is_open()) {
-    throw(std::runtime_error("Wrong filename provided:" + fname));
-  }
-  std::string line, sym, tmp, to;
-  std::vector<std::string> mappings;
-  while (std::getline(ifs, line)) {
-    if (line.size() == 0) {
-      continue;
-    }
-    std::stringstream ss(line);
-    std::getline(ss, sym, '\t');
-    std::getline(ss, tmp, '\t');
+  std::vector<std::string_view> mappings;
+  for_each_line(fname, [&](std::string_view line) {
+    std::string_view sym = next_token(line, '\t');
+    std::string_view tmp = next_token(line, '\t');
     mappings.clear();
-    std::stringstream ss2(tmp);
-    while (std::getline(ss2, to, ',')) {
-      mappings.push_back(std::move(to));
+    while (!tmp.empty()) {
+      std::string_view to = next_token(tmp, ',');
+      if (!to.empty())
+        mappings.push_back(to);
     }
     dataset.add_sym(sym, sym, mappings);
-  }
+  });
 }
 
 inline std::vector<std::string> load_syms_from_file (std::string fname) {
   std::vector<std::string> out;
-  std::ifstream ifs(fname);
-  if (!ifs.is_open()) {
-    throw(std::runtime_error("Wrong filename provided:" + fname));
+  for_each_line(fname,
+                [&](std::string_view line) { out.emplace_back(line); });
+  return out;
+}
+// splits a line into at most n tab separated fields, returns how many
+// were found. an empty field after the last tab counts as one
+template <size_t N>
+size_t split_tabs(std::string_view line, std::string_view (&fields)[N]) {
+  size_t n = 0;
+  bool more = true;
+  while (n < N && more) {
+    more = line.find('\t') != std::string_view::npos;
+    fields[n++] = next_token(line, '\t');
   }
-  std::string line;
-  while (std::getline(ifs, line)) {
-    if (line.size() == 0) {
-      continue;
+  return n;
+}
+
+// reads a GAF 2.x annotation file (plain or gzip) straight into dataset:
+// column 3 is the symbol, 5 the GO term and 10 the symbol's full name.
+// a symbol is added the first time it is seen and every later line only
+// adds its edge, repeats are merged by gen_mappings. terms that are not in
+// dataset are skipped, so load the ontology first. lines qualified NOT
+// and, if given, lines with an excluded evidence code (column 7) are
+// skipped as well
+template <typename D>
+void load_gaf(D &dataset, const std::string &fname, const bool &skip_not = true,
+              const std::vector<std::string> &exclude_evidence = {}) {
+  std::unordered_set<std::string_view> excluded(exclude_evidence.begin(),
+                                                exclude_evidence.end());
+  std::string_view col[10];
+  for_each_line(fname, [&](std::string_view line) {
+    if (line[0] == '!')
+      return;
+    if (split_tabs(line, col) < 10) {
+      throw(std::runtime_error("Malformed GAF line in " + fname + ": " +
+                               std::string(line)));
     }
-    out.push_back(std::move(line));
-  }
+    if (skip_not) {
+      std::string_view quals = col[3];
+      while (!quals.empty()) {
+        if (next_token(quals, '|') == "NOT")
+          return;
+      }
+    }
+    if (!excluded.empty() && excluded.count(col[6]))
+      return;
+    if (!dataset.has_anno(col[4]))
+      return;
+    dataset.add_sym(col[2], col[9]);
+    dataset.add_edge(col[2], col[4]);
+  });
+}
+
+// rs number (without the rs prefix) to genotype, from a 23andMe style
+// genotype file: rsid, chromosome, position and genotype per line
+inline std::unordered_map<std::string, std::string>
+load_genotypes(const std::string &fname) {
+  std::unordered_map<std::string, std::string> out;
+  for_each_line(fname, [&](std::string_view line) {
+    if (line[0] == '#')
+      return;
+    std::string_view rs, gt;
+    while (!line.empty()) {
+      std::string_view tok = next_token(line, '\t');
+      if (tok.empty())
+        continue;
+      if (rs.empty())
+        rs = tok;
+      gt = tok;
+    }
+    if (rs.size() > 2 && rs.substr(0, 2) == "rs")
+      out.emplace(rs.substr(2), gt);
+  });
   return out;
 }
-#endif
\ No newline at end of file
+
+// reads a ClinVar VCF (plain or gzip) straight into dataset. every gene
+// in GENEINFO becomes an annotation named by the CLNDN and described by
+// the CLNDISDB of its first variant; every RS becomes a symbol mapped to
+// the genes of its first record. records without an RS are skipped.
+// with genotypes only the rs numbers in it are added, and the ones whose
+// genotype carries the record's ALT allele are returned
+template <typename D>
+std::vector<std::string> load_clinvar_vcf(
+    D &dataset, const std::string &fname,
+    const std::unordered_map<std::string, std::string> *genotypes = nullptr) {
+  std::vector<std::string> carriers;
+  std::vector<std::string_view> genes;
+  std::string_view col[8];
+  for_each_line(fname, [&](std::string_view line) {
+    if (line[0] == '#')
+      return;
+    if (split_tabs(line, col) < 8) {
+      throw(std::runtime_error("Malformed VCF line in " + fname + ": " +
+                               std::string(line)));
+    }
+    std::string_view info = col[7], rs, name, desc, geneinfo;
+    while (!info.empty()) {
+      std::string_view field = next_token(info, ';');
+      std::string_view key = next_token(field, '=');
+      if (key == "RS")
+        rs = field;
+      else if (key == "CLNDN")
+        name = field;
+      else if (key == "CLNDISDB")
+        desc = field;
+      else if (key == "GENEINFO")
+        geneinfo = field;
+    }
+    // GENEINFO is symbol:gene id, | separated when a variant spans genes
+    genes.clear();
+    while (!geneinfo.empty()) {
+      std::string_view gene = next_token(geneinfo, '|');
+      if (!gene.empty()) {
+        genes.push_back(gene);
+        dataset.add_anno(gene, name, desc);
+      }
+    }
+    if (rs.empty() || dataset.has_sym(rs))
+      return;
+    const std::string *gt = nullptr;
+    if (genotypes) {
+      const auto it = genotypes->find(std::string(rs));
+      if (it == genotypes->end())
+        return;
+      gt = &it->second;
+    }
+    dataset.add_sym(rs, rs, genes);
+    if (gt && !col[4].empty() && gt->find(col[4]) != std::string::npos)
+      carriers.emplace_back(rs);
+  });
+  return carriers;
+}
+#endif
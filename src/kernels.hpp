@@ -0,0 +1,254 @@
+#ifndef KERNELS
+#define KERNELS
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+// x86-64 builds with gcc or clang carry AVX2 and AVX-512 kernels compiled
+// per function, so the binary still runs on any x86-64 and picks the widest
+// kernel the cpu supports at runtime. define ENRICHED_NO_SIMD to keep only
+// the portable scalar kernels
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) &&        \
+    !defined(ENRICHED_NO_SIMD)
+#define ENRICHED_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// word level kernels over the mapping bitsets. std::bitset keeps its bits in
+// a plain word array on every standard library we build with, so the masks
+// can be read as 64 bit words without copying them first
+
+inline unsigned popcount64(const uint64_t &x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  return static_cast<unsigned>(__popcnt64(x));
+#else
+  uint64_t v = x - ((x >> 1) & 0x5555555555555555ULL);
+  v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+  v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return static_cast<unsigned>((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+template <size_t N> constexpr size_t bitset_words() { return (N + 63) / 64; }
+
+template <size_t N> const uint64_t *bitset_data(const std::bitset<N> &bits) {
+  static_assert(sizeof(std::bitset<N>) == bitset_words<N>() * 8,
+                "std::bitset is expected to be a bare word array");
+  return reinterpret_cast<const uint64_t *>(&bits);
+}
+
+// |A & B| and |A & B & C| over raw word arrays, without materializing the
+// intersection. these are the reference kernels the vector ones must match
+inline unsigned popcount_and_scalar(const uint64_t *a, const uint64_t *b,
+                                    const size_t &words) {
+  unsigned out = 0;
+  for (size_t i = 0; i < words; ++i) {
+    out += popcount64(a[i] & b[i]);
+  }
+  return out;
+}
+
+inline unsigned popcount_and3_scalar(const uint64_t *a, const uint64_t *b,
+                                     const uint64_t *c, const size_t &words) {
+  unsigned out = 0;
+  for (size_t i = 0; i < words; ++i) {
+    out += popcount64(a[i] & b[i] & c[i]);
+  }
+  return out;
+}
+
+#ifdef ENRICHED_X86_KERNELS
+#define ENRICHED_AVX2 __attribute__((target("avx2,popcnt")))
+#define ENRICHED_AVX512                                                        \
+  __attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+
+// byte wise popcount by nibble lookup, summed into the four 64 bit lanes
+ENRICHED_AVX2 inline __m256i _popcount256(const __m256i &v) {
+  const __m256i lookup =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1,
+                       2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  const __m256i lo = _mm256_and_si256(v, low);
+  const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+  const __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                      _mm256_shuffle_epi8(lookup, hi));
+  return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+// carry save adder: h:l = a + b + c, bit sliced
+ENRICHED_AVX2 inline void _csa256(__m256i &h, __m256i &l, const __m256i &a,
+                                  const __m256i &b, const __m256i &c) {
+  const __m256i u = _mm256_xor_si256(a, b);
+  h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+  l = _mm256_xor_si256(u, c);
+}
+
+template <bool THREE>
+ENRICHED_AVX2 inline __m256i _load_and256(const uint64_t *a, const uint64_t *b,
+                                          const uint64_t *c, const size_t &i) {
+  __m256i v = _mm256_and_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+  if (THREE)
+    v = _mm256_and_si256(
+        v, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(c + i)));
+  return v;
+}
+
+// Harley-Seal: sixteen vectors are folded through a tree of carry save
+// adders so only one in sixteen needs a real popcount
+template <bool THREE>
+ENRICHED_AVX2 unsigned _popcount_and_avx2(const uint64_t *a, const uint64_t *b,
+                                          const uint64_t *c,
+                                          const size_t &words) {
+  __m256i total = _mm256_setzero_si256(), ones = _mm256_setzero_si256(),
+          twos = _mm256_setzero_si256(), fours = _mm256_setzero_si256(),
+          eights = _mm256_setzero_si256(), sixteens, twos_a, twos_b, fours_a,
+          fours_b, eights_a, eights_b;
+  size_t i = 0;
+  for (; i + 64 <= words; i += 64) {
+    _csa256(twos_a, ones, ones, _load_and256<THREE>(a, b, c, i),
+            _load_and256<THREE>(a, b, c, i + 4));
+    _csa256(twos_b, ones, ones, _load_and256<THREE>(a, b, c, i + 8),
+            _load_and256<THREE>(a, b, c, i + 12));
+    _csa256(fours_a, twos, twos, twos_a, twos_b);
+    _csa256(twos_a, ones, ones, _load_and256<THREE>(a, b, c, i + 16),
+            _load_and256<THREE>(a, b, c, i + 20));
+    _csa256(twos_b, ones, ones, _load_and256<THREE>(a, b, c, i + 24),
+            _load_and256<THREE>(a, b, c, i + 28));
+    _csa256(fours_b, twos, twos, twos_a, twos_b);
+    _csa256(eights_a, fours, fours, fours_a, fours_b);
+    _csa256(twos_a, ones, ones, _load_and256<THREE>(a, b, c, i + 32),
+            _load_and256<THREE>(a, b, c, i + 36));
+    _csa256(twos_b, ones, ones, _load_and256<THREE>(a, b, c, i + 40),
+            _load_and256<THREE>(a, b, c, i + 44));
+    _csa256(fours_a, twos, twos, twos_a, twos_b);
+    _csa256(twos_a, ones, ones, _load_and256<THREE>(a, b, c, i + 48),
+            _load_and256<THREE>(a, b, c, i + 52));
+    _csa256(twos_b, ones, ones, _load_and256<THREE>(a, b, c, i + 56),
+            _load_and256<THREE>(a, b, c, i + 60));
+    _csa256(fours_b, twos, twos, twos_a, twos_b);
+    _csa256(eights_b, fours, fours, fours_a, fours_b);
+    _csa256(sixteens, eights, eights, eights_a, eights_b);
+    total = _mm256_add_epi64(total, _popcount256(sixteens));
+  }
+  total = _mm256_slli_epi64(total, 4);
+  total = _mm256_add_epi64(total,
+                           _mm256_slli_epi64(_popcount256(eights), 3));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(_popcount256(fours), 2));
+  total = _mm256_add_epi64(total, _mm256_slli_epi64(_popcount256(twos), 1));
+  total = _mm256_add_epi64(total, _popcount256(ones));
+  for (; i + 4 <= words; i += 4) {
+    total = _mm256_add_epi64(total,
+                             _popcount256(_load_and256<THREE>(a, b, c, i)));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), total);
+  uint64_t out = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  for (; i < words; ++i) {
+    out += popcount64(THREE ? a[i] & b[i] & c[i] : a[i] & b[i]);
+  }
+  return static_cast<unsigned>(out);
+}
+
+// AVX-512 with VPOPCNTDQ has a native per lane 64 bit popcount
+template <bool THREE>
+ENRICHED_AVX512 unsigned _popcount_and_avx512(const uint64_t *a,
+                                              const uint64_t *b,
+                                              const uint64_t *c,
+                                              const size_t &words) {
+  __m512i total = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 8 <= words; i += 8) {
+    __m512i v = _mm512_and_si512(_mm512_loadu_si512(a + i),
+                                 _mm512_loadu_si512(b + i));
+    if (THREE)
+      v = _mm512_and_si512(v, _mm512_loadu_si512(c + i));
+    total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v));
+  }
+  uint64_t lanes[8];
+  _mm512_storeu_si512(lanes, total);
+  uint64_t out = 0;
+  for (const uint64_t &lane : lanes) {
+    out += lane;
+  }
+  for (; i < words; ++i) {
+    out += popcount64(THREE ? a[i] & b[i] & c[i] : a[i] & b[i]);
+  }
+  return static_cast<unsigned>(out);
+}
+#endif
+
+// the kernels picked for this cpu, chosen once on first use
+struct popcount_kernels {
+  unsigned (*and2)(const uint64_t *, const uint64_t *, const size_t &);
+  unsigned (*and3)(const uint64_t *, const uint64_t *, const uint64_t *,
+                   const size_t &);
+  const char *name;
+  static const popcount_kernels &scalar() {
+    static const popcount_kernels k = {popcount_and_scalar,
+                                       popcount_and3_scalar, "scalar"};
+    return k;
+  };
+  static const popcount_kernels &best() {
+    static const popcount_kernels k = select();
+    return k;
+  };
+  // every kernel set this cpu can run, from the narrowest to the widest
+  static std::vector<popcount_kernels> available() {
+    std::vector<popcount_kernels> out{scalar()};
+#ifdef ENRICHED_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      out.push_back({[](const uint64_t *a, const uint64_t *b,
+                        const size_t &n) {
+                       return _popcount_and_avx2<false>(a, b, nullptr, n);
+                     },
+                     _popcount_and_avx2<true>, "avx2"});
+    }
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+      out.push_back({[](const uint64_t *a, const uint64_t *b,
+                        const size_t &n) {
+                       return _popcount_and_avx512<false>(a, b, nullptr, n);
+                     },
+                     _popcount_and_avx512<true>, "avx512vpopcntdq"});
+    }
+#endif
+    return out;
+  };
+  static popcount_kernels select() { return available().back(); };
+};
+
+// short runs stay on the inlined scalar loop, the call is not worth it
+inline unsigned popcount_and(const uint64_t *a, const uint64_t *b,
+                             const size_t &words) {
+  if (words < 16)
+    return popcount_and_scalar(a, b, words);
+  return popcount_kernels::best().and2(a, b, words);
+}
+
+inline unsigned popcount_and3(const uint64_t *a, const uint64_t *b,
+                              const uint64_t *c, const size_t &words) {
+  if (words < 16)
+    return popcount_and3_scalar(a, b, c, words);
+  return popcount_kernels::best().and3(a, b, c, words);
+}
+
+// fused intersect-count of two (or three) masks of the same size
+template <size_t N>
+unsigned intersect_count(const std::bitset<N> &a, const std::bitset<N> &b) {
+  return popcount_and(bitset_data(a), bitset_data(b), bitset_words<N>());
+}
+
+template <size_t N>
+unsigned intersect_count(const std::bitset<N> &a, const std::bitset<N> &b,
+                         const std::bitset<N> &c) {
+  return popcount_and3(bitset_data(a), bitset_data(b), bitset_data(c),
+                       bitset_words<N>());
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef LIVE
+#define LIVE
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// a dataset that is updated while it is being queried. readers take a
+// snapshot, an immutable version that stays valid and unchanged for as
+// long as they hold it; writers are serialized, apply their changes to a
+// private copy and publish it as the next version in one atomic swap. the
+// copy is cheap since a Dataset shares its columns with its copies, and a
+// version is freed once its last reader lets go of it
+template <typename D> class live_dataset {
+private:
+  std::shared_ptr<const D> current;
+  std::mutex writer;
+  uint64_t epoch = 0;
+
+public:
+  explicit live_dataset(D &&dataset)
+      : current(std::make_shared<const D>(std::move(dataset))){};
+  std::shared_ptr<const D> snapshot() const {
+    return std::atomic_load(&current);
+  };
+  // runs fn on a copy of the current version, publishes it and returns the
+  // number of the new version. if fn throws nothing is published
+  template <typename F> uint64_t update(F &&fn) {
+    std::lock_guard<std::mutex> lock(writer);
+    auto next = std::make_shared<D>(*std::atomic_load(&current));
+    fn(*next);
+    std::atomic_store(&current, std::shared_ptr<const D>(std::move(next)));
+    return ++epoch;
+  };
+};
+#endif
@@ -64,6 +64,7 @@ int main(int argc, char **argv) {
                                                                      start)
                    .count()
             << " ms" << std::endl;
-  auto fptr = fisher_test<SymSet<symbol15, Dataset<symbol15, annotation15>>, Dataset<symbol15, annotation15>>;
+  auto fptr = fisher_test<SymSet<symbol15, annotation15>,
+                          Dataset<symbol15, annotation15>>;
   return 0;
 }
\ No newline at end of file
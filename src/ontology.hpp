@@ -0,0 +1,400 @@
+#ifndef ONTOLOGY
+#define ONTOLOGY
+#include "data.hpp"
+#include "io.hpp"
+#include "parallel.hpp"
+#include "results.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// a term DAG over the annotations of a dataset: term t is annotation t.
+// parents, children and the transitive closure both ways are kept as CSR
+// rows, built once; annotations past size() are terms without relations
+class ontology {
+private:
+  struct _csr {
+    std::vector<unsigned> offsets{0}, edges;
+    idx_span row(const unsigned &i) const {
+      if (i + 1 >= offsets.size())
+        return {};
+      return {edges.data() + offsets[i], edges.data() + offsets[i + 1]};
+    };
+    // rows of n nodes from (node, value) pairs, sorted and deduplicated
+    static _csr from(const unsigned &n,
+                     const std::vector<std::pair<unsigned, unsigned>> &pairs) {
+      _csr out;
+      out.offsets.assign(n + 1, 0);
+      for (const auto &p : pairs) {
+        ++out.offsets[p.first + 1];
+      }
+      for (unsigned i = 0; i < n; ++i) {
+        out.offsets[i + 1] += out.offsets[i];
+      }
+      std::vector<unsigned> fill(out.offsets.begin(), out.offsets.end() - 1);
+      out.edges.resize(pairs.size());
+      for (const auto &p : pairs) {
+        out.edges[fill[p.first]++] = p.second;
+      }
+      unsigned kept = 0;
+      for (unsigned i = 0; i < n; ++i) {
+        auto first = out.edges.begin() + out.offsets[i],
+             last = out.edges.begin() + out.offsets[i + 1];
+        std::sort(first, last);
+        last = std::unique(first, last);
+        out.offsets[i] = kept;
+        for (auto it = first; it != last; ++it) {
+          out.edges[kept++] = *it;
+        }
+      }
+      out.offsets[n] = kept;
+      out.edges.resize(kept);
+      return out;
+    };
+  };
+  _csr _parents, _children, _ancestors, _descendants;
+  std::vector<unsigned> _order;
+
+public:
+  ontology() = default;
+  // n terms and their (child, parent) relations. throws if they have a
+  // cycle
+  ontology(const unsigned &n,
+           const std::vector<std::pair<unsigned, unsigned>> &relations) {
+    std::vector<std::pair<unsigned, unsigned>> down;
+    down.reserve(relations.size());
+    for (const auto &r : relations) {
+      if (r.first >= n || r.second >= n) {
+        throw(std::out_of_range("ontology relation out of range"));
+      }
+      down.emplace_back(r.second, r.first);
+    }
+    _parents = _csr::from(n, relations);
+    _children = _csr::from(n, down);
+    // 1, Kahn's topological order, parents before children
+    std::vector<unsigned> pending(n);
+    for (unsigned t = 0; t < n; ++t) {
+      pending[t] = _parents.row(t).size();
+      if (pending[t] == 0)
+        _order.push_back(t);
+    }
+    for (unsigned i = 0; i < _order.size(); ++i) {
+      for (const unsigned &c : _children.row(_order[i])) {
+        if (--pending[c] == 0)
+          _order.push_back(c);
+      }
+    }
+    if (_order.size() != n) {
+      throw(std::runtime_error("ontology has a cycle"));
+    }
+    // 2, ancestors in the same order: a term's are its parents' and theirs
+    std::vector<unsigned> start(n), len(n), flat, merged;
+    std::vector<unsigned> seen(n, ~0u);
+    for (const unsigned &t : _order) {
+      merged.clear();
+      for (const unsigned &p : _parents.row(t)) {
+        if (seen[p] != t) {
+          seen[p] = t;
+          merged.push_back(p);
+        }
+        for (unsigned e = start[p]; e < start[p] + len[p]; ++e) {
+          if (seen[flat[e]] != t) {
+            seen[flat[e]] = t;
+            merged.push_back(flat[e]);
+          }
+        }
+      }
+      std::sort(merged.begin(), merged.end());
+      start[t] = flat.size();
+      len[t] = merged.size();
+      flat.insert(flat.end(), merged.begin(), merged.end());
+    }
+    std::vector<std::pair<unsigned, unsigned>> up, below;
+    up.reserve(flat.size());
+    below.reserve(flat.size());
+    for (unsigned t = 0; t < n; ++t) {
+      for (unsigned e = start[t]; e < start[t] + len[t]; ++e) {
+        up.emplace_back(t, flat[e]);
+        below.emplace_back(flat[e], t);
+      }
+    }
+    _ancestors = _csr::from(n, up);
+    _descendants = _csr::from(n, below);
+  };
+  unsigned size() const { return _order.size(); };
+  idx_span parents(const unsigned &t) const { return _parents.row(t); };
+  idx_span children(const unsigned &t) const { return _children.row(t); };
+  // the transitive closure, without the term itself
+  idx_span ancestors(const unsigned &t) const { return _ancestors.row(t); };
+  idx_span descendants(const unsigned &t) const {
+    return _descendants.row(t);
+  };
+  // every term, parents before children
+  const std::vector<unsigned> &order() const { return _order; };
+};
+
+// reads the [Term] stanzas of an OBO file into the dataset, as
+// annotations with their id, name and definition text, and returns their
+// DAG over is_a and, unless part_of is false, part_of relations. terms
+// marked is_obsolete are left out, and relations to terms the file does
+// not define, or only as obsolete, are dropped
+template <typename D>
+ontology load_obo(D &dataset, const std::string &fname,
+                  const bool &part_of = true) {
+  std::vector<std::pair<unsigned, std::string>> relations;
+  // the stanza being read; copied, as the last one is added after the
+  // file is closed
+  bool in_term = false, obsolete = false;
+  std::string id, name, def;
+  std::vector<std::string> parents;
+  auto flush = [&]() {
+    if (in_term && !id.empty() && !obsolete) {
+      dataset.add_anno(id, name, def);
+      const unsigned t = dataset.find_anno(id);
+      for (auto &p : parents) {
+        relations.emplace_back(t, std::move(p));
+      }
+    }
+    in_term = obsolete = false;
+    id.clear();
+    name.clear();
+    def.clear();
+    parents.clear();
+  };
+  // the first word of a value, before any space or ! comment
+  auto word = [](std::string_view v) {
+    return next_token(v, ' ');
+  };
+  for_each_line(fname, [&](std::string_view line) {
+    if (line[0] == '[') {
+      flush();
+      in_term = line == "[Term]";
+      return;
+    }
+    if (!in_term)
+      return;
+    std::string_view tag = next_token(line, ':');
+    while (!line.empty() && line[0] == ' ')
+      line.remove_prefix(1);
+    if (tag == "id") {
+      id = word(line);
+    } else if (tag == "name") {
+      name = line;
+    } else if (tag == "def") {
+      // the quoted text, unescaped, without the dbxref list after it
+      if (line.empty() || line[0] != '"') {
+        def = line;
+        return;
+      }
+      for (size_t i = 1; i < line.size() && line[i] != '"'; ++i) {
+        if (line[i] == '\\' && i + 1 < line.size())
+          ++i;
+        def += line[i];
+      }
+    } else if (tag == "is_obsolete") {
+      obsolete = word(line) == "true";
+    } else if (tag == "is_a") {
+      parents.emplace_back(word(line));
+    } else if (tag == "relationship" && part_of) {
+      if (next_token(line, ' ') == "part_of")
+        parents.emplace_back(word(line));
+    }
+  });
+  flush();
+  std::vector<std::pair<unsigned, unsigned>> edges;
+  edges.reserve(relations.size());
+  for (const auto &r : relations) {
+    const unsigned p = dataset.find_anno(r.second);
+    if (p != id_table::npos)
+      edges.emplace_back(r.first, p);
+  }
+  return ontology(dataset.total_annos(), edges);
+}
+
+// the true path rule: maps every symbol to all ancestors of its terms as
+// well, so an annotation holds the symbols of its whole subtree. the new
+// edges are found per symbol in parallel from the precomputed closure and
+// folded into the index, and the masks of the mask_kind bits in masks as
+// gen_mappings builds them, in one rebuild. returns the number of edges
+// added
+template <typename D>
+size_t propagate(D &dataset, const ontology &dag,
+                 const unsigned &masks = dense_masks,
+                 const unsigned &threads = 1) {
+  if (!dataset.has_index()) {
+    throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+  }
+  const unsigned ns = dataset.total_syms(), na = dataset.total_annos();
+  const unsigned block = block_size(ns, threads, 256);
+  std::vector<std::vector<std::pair<unsigned, unsigned>>> found(
+      (ns + block - 1) / block);
+  parallel_blocks(
+      ns, block, threads,
+      [&](const unsigned &b, const unsigned &begin, const unsigned &end) {
+        std::vector<unsigned> seen(na, ~0u);
+        for (unsigned s = begin; s < end; ++s) {
+          const idx_span row = dataset.sym_row(s);
+          for (const unsigned &a : row) {
+            seen[a] = s;
+          }
+          for (const unsigned &a : row) {
+            for (const unsigned &up : dag.ancestors(a)) {
+              if (seen[up] != s) {
+                seen[up] = s;
+                found[b].emplace_back(s, up);
+              }
+            }
+          }
+        }
+      });
+  std::vector<std::pair<unsigned, unsigned>> edges;
+  for (const auto &f : found) {
+    edges.insert(edges.end(), f.begin(), f.end());
+  }
+  dataset.add_edges(edges);
+  dataset.gen_mappings(masks);
+  return edges.size();
+}
+
+// parent-child test (union variant, Grossmann et al. 2007): each term is
+// tested against the symbols of its parents instead of the whole dataset,
+// so a term only scores if it is enriched beyond what its parents explain.
+// the term counts come from one counting pass; a single parent's
+// population is its own count, only terms with several parents merge rows.
+// the best k terms at or below threshold are kept. the dataset must be
+// propagated over dag
+template <typename S, typename D>
+void parent_child_test(const S &test_set, const D &dataset,
+                       const ontology &dag, ResultDataset &rout,
+                       std::string test_name =
+                           "Parent-Child Fisher's Exact Test (P <= 0.05)",
+                       const unsigned &k = default_top_k,
+                       const double &threshold = 0.05) {
+  const auto test = dataset.count_set(test_set);
+  const unsigned ns = dataset.total_syms();
+  std::vector<char> in_test(ns, 0);
+  for (const unsigned &s : test_set.get_idxs()) {
+    in_test[s] = 1;
+  }
+  std::vector<unsigned> seen(ns, ~0u);
+  top_k<ascending> keep(k, threshold);
+  ENRICHED_PHASE(phase_stats);
+  for (const unsigned &t : test.hot) {
+    const idx_span parents = dag.parents(t);
+    unsigned pop = ns, pop_test = test.total;
+    if (parents.size() == 1) {
+      pop = dataset.anno_size(parents[0]);
+      pop_test = test.counts[parents[0]];
+    } else if (parents.size() > 1) {
+      pop = pop_test = 0;
+      for (const unsigned &p : parents) {
+        for (const unsigned &s : dataset.anno_row(p)) {
+          if (seen[s] != t) {
+            seen[s] = t;
+            ++pop;
+            pop_test += in_test[s];
+          }
+        }
+      }
+    }
+    const unsigned a = test.counts[t], size = dataset.anno_size(t);
+    if (size > pop || a > pop_test) {
+      throw(std::logic_error("dataset is not propagated over the ontology"));
+    }
+    const bool enriched = (static_cast<double>(a)) / (pop_test + 1.0) >
+                          (static_cast<double>(size)) / (pop + 1.0);
+    keep.push({t,
+               fisher_p_greater(a, size - a, pop_test - a,
+                                pop - size - pop_test + a),
+               enriched});
+  }
+  rout.add(test_name, keep.take(), dataset);
+}
+
+// elim test (Alexa et al. 2006): terms are scored from the leaves up, and
+// the symbols of every term found significant at cutoff are removed from
+// all of its ancestors before those are scored, so a parent does not
+// inherit the signal of its significant children. the removed symbols are
+// carried up the DAG in the same single pass, each term merging what its
+// children hand on, so no term looks past its children; counts are only
+// redone for terms that were handed something. the best k terms at or
+// below threshold are kept. the dataset must be propagated over dag
+template <typename S, typename D>
+void elim_test(const S &test_set, const D &dataset, const ontology &dag,
+               ResultDataset &rout, const double &cutoff = 0.01,
+               std::string test_name = "elim Fisher's Exact Test (P <= 0.05)",
+               const unsigned &k = default_top_k,
+               const double &threshold = 0.05) {
+  const auto test = dataset.count_set(test_set);
+  const unsigned ns = dataset.total_syms(), na = dataset.total_annos();
+  std::vector<char> in_test(ns, 0), significant(na, 0);
+  for (const unsigned &s : test_set.get_idxs()) {
+    in_test[s] = 1;
+  }
+  // the symbols removed from each scored term, sorted. a significant term
+  // hands its parents its own row as well; a list is dropped once every
+  // parent has taken it
+  std::vector<std::vector<unsigned>> removed(na);
+  std::vector<unsigned> waiting(na, 0);
+  for (unsigned t = 0; t < dag.size(); ++t) {
+    waiting[t] = dag.parents(t).size();
+  }
+  top_k<ascending> keep(k, threshold);
+  ENRICHED_PHASE(phase_stats);
+  auto score = [&](const unsigned &t) {
+    std::vector<unsigned> &out = removed[t];
+    unsigned sources = 0;
+    for (const unsigned &c : dag.children(t)) {
+      if (significant[c]) {
+        const idx_span row = dataset.anno_row(c);
+        out.insert(out.end(), row.begin(), row.end());
+        ++sources;
+      }
+      if (!removed[c].empty()) {
+        out.insert(out.end(), removed[c].begin(), removed[c].end());
+        ++sources;
+      }
+      if (--waiting[c] == 0)
+        std::vector<unsigned>().swap(removed[c]);
+    }
+    if (sources > 1) {
+      std::sort(out.begin(), out.end());
+      out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+    if (test.counts[t] == 0)
+      return;
+    unsigned a = test.counts[t], size = dataset.anno_size(t);
+    if (!out.empty()) {
+      // removed symbols that are in the term, by one merge of the two
+      const idx_span row = dataset.anno_row(t);
+      auto r = out.begin();
+      for (const unsigned &s : row) {
+        while (r != out.end() && *r < s)
+          ++r;
+        if (r != out.end() && *r == s) {
+          --size;
+          a -= in_test[s];
+        }
+      }
+    }
+    const double p = fisher_p_greater(a, size - a, test.total - a,
+                                      ns - size - test.total + a);
+    significant[t] = p < cutoff;
+    const bool enriched = (static_cast<double>(a)) / (test.total + 1.0) >
+                          (static_cast<double>(size)) / (ns + 1.0);
+    keep.push({t, p, enriched});
+  };
+  // terms outside the DAG have no descendants, then the DAG leaves first
+  for (unsigned t = dag.size(); t < na; ++t) {
+    score(t);
+  }
+  for (auto it = dag.order().rbegin(); it != dag.order().rend(); ++it) {
+    score(*it);
+  }
+  rout.add(test_name, keep.take(), dataset);
+}
+#endif
@@ -0,0 +1,125 @@
+#ifndef PARALLEL
+#define PARALLEL
+#include "profile.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// number of workers to use for a requested thread count, 0 means one per
+// hardware thread
+inline unsigned resolve_threads(const unsigned &threads) {
+  if (threads > 0)
+    return threads;
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// a run of block ids [lo, hi) packed in one word. the owning worker takes
+// blocks from the front, idle workers steal single blocks from the back,
+// both with one compare-and-swap
+struct alignas(64) _block_deque {
+  std::atomic<uint64_t> span{0};
+  void reset(const uint32_t &lo, const uint32_t &hi) {
+    span.store((static_cast<uint64_t>(lo) << 32) | hi);
+  };
+  bool pop(uint32_t &block) {
+    uint64_t cur = span.load();
+    while (true) {
+      const uint32_t lo = cur >> 32, hi = cur & 0xffffffffu;
+      if (lo >= hi)
+        return false;
+      if (span.compare_exchange_weak(
+              cur, (static_cast<uint64_t>(lo + 1) << 32) | hi)) {
+        block = lo;
+        return true;
+      }
+    }
+  };
+  bool steal(uint32_t &block) {
+    uint64_t cur = span.load();
+    while (true) {
+      const uint32_t lo = cur >> 32, hi = cur & 0xffffffffu;
+      if (lo >= hi)
+        return false;
+      if (span.compare_exchange_weak(
+              cur, (static_cast<uint64_t>(lo) << 32) | (hi - 1))) {
+        block = hi - 1;
+        return true;
+      }
+    }
+  };
+};
+
+// calls fn(block, begin, end) for every block of [0, n) using work stealing
+// over `threads` workers. blocks are handed out in contiguous runs, so
+// callers that write per block output get a deterministic merge for free.
+// the first exception thrown by fn is rethrown once all workers stopped
+template <typename F>
+void parallel_blocks(const unsigned &n, const unsigned &block,
+                     const unsigned &threads, F &&fn) {
+  const unsigned nblocks = (n + block - 1) / block;
+  const unsigned workers = std::min(resolve_threads(threads), nblocks);
+  if (workers <= 1) {
+    for (unsigned b = 0; b < nblocks; ++b) {
+      fn(b, b * block, std::min(n, (b + 1) * block));
+    }
+    return;
+  }
+  auto deques = std::make_unique<_block_deque[]>(workers);
+  for (unsigned w = 0; w < workers; ++w) {
+    deques[w].reset(static_cast<uint64_t>(nblocks) * w / workers,
+                    static_cast<uint64_t>(nblocks) * (w + 1) / workers);
+  }
+  std::exception_ptr error;
+  std::mutex error_lock;
+  std::atomic<bool> failed{false};
+#ifdef ENRICHED_PROFILE
+  query_profile *const query = query_profile::current();
+#endif
+  auto work = [&](const unsigned &w) {
+#ifdef ENRICHED_PROFILE
+    // the other workers count into the caller's query
+    profile_worker lent(query);
+#endif
+    try {
+      uint32_t b;
+      while (!failed.load(std::memory_order_relaxed)) {
+        bool found = deques[w].pop(b);
+        for (unsigned v = 1; !found && v < workers; ++v) {
+          found = deques[(w + v) % workers].steal(b);
+        }
+        if (!found)
+          return;
+        fn(b, b * block, std::min(n, (b + 1) * block));
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_lock);
+      if (!error)
+        error = std::current_exception();
+      failed = true;
+    }
+  };
+  std::vector<std::thread> pool;
+  pool.reserve(workers - 1);
+  for (unsigned w = 1; w < workers; ++w) {
+    pool.emplace_back(work, w);
+  }
+  work(0);
+  for (auto &t : pool) {
+    t.join();
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// block size that gives every worker many blocks to balance skewed costs
+inline unsigned block_size(const unsigned &n, const unsigned &threads,
+                           const unsigned &min_block = 16) {
+  const unsigned workers = resolve_threads(threads);
+  return std::max(min_block, n / (workers * 16) + 1);
+}
+#endif
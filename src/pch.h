@@ -1,8 +1,23 @@
 #ifndef PCH_H
 #define PCH_H
+#include "background.hpp"
+#include "compose.hpp"
 #include "data.hpp"
+#include "gsea.hpp"
+#include "hypergeom.hpp"
 #include "io.hpp"
+#include "kernels.hpp"
+#include "live.hpp"
+#include "ontology.hpp"
+#include "parallel.hpp"
+#include "permutation.hpp"
+#include "profile.hpp"
+#include "redundancy.hpp"
+#include "results.hpp"
+#include "roaring.hpp"
+#include "snapshot.hpp"
 #include "stats.hpp"
+#include "storage.hpp"
 #include <bitset>
 #include <exception>
 #include <memory>
@@ -0,0 +1,156 @@
+#ifndef PERMUTATION
+#define PERMUTATION
+#include "data.hpp"
+#include "parallel.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// counter based random numbers: the n-th draw of a stream is a pure
+// function of (key, n), so every permutation gets its own stream from its
+// number alone and results do not depend on which worker ran it
+struct counter_rng {
+  uint64_t key, ctr = 0;
+  counter_rng(const uint64_t &seed, const uint64_t &stream)
+      : key(_mix(seed ^ _mix(stream + 0x9e3779b97f4a7c15ULL))){};
+  static uint64_t _mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  };
+  uint64_t next() { return _mix(key + 0x9e3779b97f4a7c15ULL * ++ctr); };
+  // unbiased integer in [0, range), multiply and reject
+  uint32_t below(const uint32_t &range) {
+    uint64_t m = (next() >> 32) * range;
+    if (static_cast<uint32_t>(m) < range) {
+      const uint32_t t = -range % range;
+      while (static_cast<uint32_t>(m) < t)
+        m = (next() >> 32) * range;
+    }
+    return m >> 32;
+  };
+};
+
+// empirical p-values of the annotations hit by a test set, one entry per
+// annotation in annos: empirical is the share of random sets of the same
+// size that hit the annotation at least as often, fwer the share whose
+// smallest Fisher p-value over all annotations is at least as small as the
+// observed one (Westfall-Young minP), both as (hits + 1) / (perms + 1)
+struct permutation_result {
+  std::vector<unsigned> annos;
+  std::vector<double> empirical, fwer;
+  unsigned perms = 0;
+};
+
+// draws `perms` random sets of test.total distinct symbols out of the whole
+// dataset and counts every annotation for each through the CSR index.
+// permutations run in blocks over `threads` workers, each block with its own
+// counters, so the result only depends on seed. the statistic is over
+// representation, for which the hit count and fisher_p_greater agree
+template <typename D>
+permutation_result permute_annos(const anno_counts &test, const D &dataset,
+                                 const unsigned &perms,
+                                 const uint64_t &seed = 1,
+                                 const unsigned &threads = 1) {
+  if (!dataset.has_index()) {
+    throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+  }
+  const unsigned n = dataset.total_syms(), na = dataset.total_annos();
+  const unsigned m = test.total;
+  auto p_greater = [&](const unsigned &a, const unsigned &x) {
+    const unsigned k = dataset.anno_size(a);
+    return fisher_p_greater(x, k - x, m - x, n - m - k + x);
+  };
+  permutation_result out;
+  out.perms = perms;
+  out.annos = test.hot;
+  std::vector<double> observed(out.annos.size());
+  for (unsigned j = 0; j < out.annos.size(); ++j) {
+    observed[j] = p_greater(out.annos[j], test.counts[out.annos[j]]);
+  }
+  std::vector<double> min_p(perms, 1.0);
+  const unsigned block = block_size(perms, threads, 64);
+  std::vector<std::vector<unsigned>> hits((perms + block - 1) / block);
+  parallel_blocks(
+      perms, block, threads,
+      [&](const unsigned &b, const unsigned &begin, const unsigned &end) {
+        std::vector<unsigned> counts(na, 0), hot, drawn;
+        std::vector<uint64_t> mask((n + 63) / 64, 0);
+        hits[b].assign(out.annos.size(), 0);
+        for (unsigned p = begin; p < end; ++p) {
+          // 1, Floyd's sampling of m distinct symbols
+          counter_rng rng(seed, p);
+          drawn.clear();
+          for (unsigned j = n - m; j < n; ++j) {
+            unsigned t = rng.below(j + 1);
+            if (mask[t >> 6] >> (t & 63) & 1)
+              t = j;
+            mask[t >> 6] |= uint64_t(1) << (t & 63);
+            drawn.push_back(t);
+          }
+          // 2, count the annotations of the drawn symbols
+          for (const unsigned &s : drawn) {
+            mask[s >> 6] = 0;
+            for (const unsigned &a : dataset.sym_row(s)) {
+              if (counts[a]++ == 0)
+                hot.push_back(a);
+            }
+          }
+          // 3, accumulate: hits against the observed counts, and the
+          // smallest p-value of this permutation for the minP step
+          for (unsigned j = 0; j < out.annos.size(); ++j) {
+            if (counts[out.annos[j]] >= test.counts[out.annos[j]])
+              ++hits[b][j];
+          }
+          double best = 1.0;
+          for (const unsigned &a : hot) {
+            const unsigned x = counts[a], k = dataset.anno_size(a);
+            if (fisher_p_bound(x, k - x, m - x, n - m - k + x) < best)
+              best = std::min(best, p_greater(a, x));
+            counts[a] = 0;
+          }
+          hot.clear();
+          min_p[p] = best;
+        }
+      });
+  std::vector<unsigned> total(out.annos.size(), 0);
+  for (const auto &h : hits) {
+    for (unsigned j = 0; j < h.size(); ++j) {
+      total[j] += h[j];
+    }
+  }
+  std::sort(min_p.begin(), min_p.end());
+  out.empirical.resize(out.annos.size());
+  out.fwer.resize(out.annos.size());
+  for (unsigned j = 0; j < out.annos.size(); ++j) {
+    const unsigned below =
+        std::upper_bound(min_p.begin(), min_p.end(), observed[j]) -
+        min_p.begin();
+    out.empirical[j] = (total[j] + 1.0) / (perms + 1.0);
+    out.fwer[j] = (below + 1.0) / (perms + 1.0);
+  }
+  return out;
+}
+
+// adds the empirical and the FWER adjusted p-values of a test set as two
+// sections, each with its best k annotations
+template <typename S, typename D>
+void permutation_test(const S &test_set, const D &dataset, ResultDataset &rout,
+                      const unsigned &perms = 1000, const uint64_t &seed = 1,
+                      std::string test_name = "Permutation Test",
+                      const unsigned &threads = 1,
+                      const unsigned &k = default_top_k) {
+  const auto test = dataset.count_set(test_set, threads);
+  const auto res = permute_annos(test, dataset, perms, seed, threads);
+  top_k<ascending> empirical(k), fwer(k);
+  for (unsigned j = 0; j < res.annos.size(); ++j) {
+    const bool enriched = rest_table(test, dataset, res.annos[j]).enriched;
+    empirical.push({res.annos[j], res.empirical[j], enriched});
+    fwer.push({res.annos[j], res.fwer[j], enriched});
+  }
+  rout.add(test_name + " (empirical P)", empirical.take(), dataset);
+  rout.add(test_name + " (FWER)", fwer.take(), dataset);
+}
+#endif
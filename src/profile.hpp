@@ -0,0 +1,237 @@
+#ifndef PROFILE
+#define PROFILE
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// per phase timers and work counters of one query. collection is compiled
+// in only when ENRICHED_PROFILE is defined; otherwise ENRICHED_PHASE and
+// ENRICHED_COUNT expand to nothing and their arguments are never
+// evaluated. everything is recorded into the query_profile open on the
+// calling thread, nothing is shared between queries
+
+enum profile_phase : unsigned {
+  phase_parse,
+  phase_add,
+  phase_gen_mappings,
+  phase_masks,
+  phase_set,
+  phase_count,
+  phase_stats,
+  profile_phases
+};
+
+enum profile_counter : unsigned {
+  prof_lines_parsed,
+  prof_edges_inserted,
+  prof_annos_scanned,
+  prof_annos_skipped,
+  prof_bitsets,
+  prof_bytes_popcounted,
+  prof_results,
+  profile_counters
+};
+
+constexpr const char *profile_phase_names[profile_phases] = {
+    "parse", "add", "gen_mappings", "masks", "set", "count", "stats"};
+constexpr const char *profile_counter_names[profile_counters] = {
+    "lines_parsed", "edges_inserted", "annos_scanned",   "annos_skipped",
+    "bitsets",      "bytes_popcounted", "results_emitted"};
+
+// what one thread did for one query. only the thread that opened the
+// query times phases; threads lent to it by parallel_blocks count work
+struct profile_tally {
+  uint64_t phase_ns[profile_phases] = {};
+  uint64_t counters[profile_counters] = {};
+  bool timed = false;
+};
+
+class query_profile;
+class profile_timer;
+
+// the query and tally the calling thread records into, and its innermost
+// open phase
+inline query_profile *&_profile_query() {
+  static thread_local query_profile *query = nullptr;
+  return query;
+}
+inline profile_tally *&_profile_tally() {
+  static thread_local profile_tally *tally = nullptr;
+  return tally;
+}
+inline profile_timer *&_profile_timer() {
+  static thread_local profile_timer *timer = nullptr;
+  return timer;
+}
+
+inline void profile_count(const profile_counter &c, const uint64_t &n) {
+  if (profile_tally *tally = _profile_tally())
+    tally->counters[c] += n;
+}
+
+// adds the lifetime of the scope to a phase, less the time of the phases
+// opened inside it, so each moment counts for the innermost phase only
+class profile_timer {
+private:
+  profile_phase phase;
+  profile_tally *tally;
+  profile_timer *outer = nullptr;
+  uint64_t inner_ns = 0;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit profile_timer(const profile_phase &p)
+      : phase(p), tally(_profile_tally()) {
+    if (!tally || !tally->timed) {
+      tally = nullptr;
+      return;
+    }
+    outer = _profile_timer();
+    _profile_timer() = this;
+    start = std::chrono::steady_clock::now();
+  };
+  profile_timer(const profile_timer &) = delete;
+  profile_timer &operator=(const profile_timer &) = delete;
+  ~profile_timer() {
+    if (!tally)
+      return;
+    const uint64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+    tally->phase_ns[phase] += ns - std::min(ns, inner_ns);
+    if (outer)
+      outer->inner_ns += ns;
+    _profile_timer() = outer;
+  };
+};
+
+#ifdef ENRICHED_PROFILE
+#define ENRICHED_PHASE(p) profile_timer _profile_scope(p)
+#define ENRICHED_COUNT(c, n) profile_count(c, n)
+#else
+#define ENRICHED_PHASE(p) ((void)0)
+#define ENRICHED_COUNT(c, n) ((void)0)
+#endif
+
+// the profile of one query, opened and stopped on the same thread:
+// everything that thread and the workers it starts do in between, dumped
+// as one JSON object. the phases split the wall time of the opening
+// thread, which includes waiting for its workers; the counters add up
+// every thread
+class query_profile {
+private:
+  profile_tally own;
+  std::vector<std::unique_ptr<profile_tally>> lent;
+  std::mutex lock;
+  query_profile *prev_query;
+  profile_tally *prev_tally;
+  profile_timer *prev_timer;
+  profile_tally total;
+  std::chrono::steady_clock::time_point start, finish;
+  bool stopped = false;
+
+public:
+  query_profile()
+      : prev_query(_profile_query()), prev_tally(_profile_tally()),
+        prev_timer(_profile_timer()) {
+    own.timed = true;
+    _profile_query() = this;
+    _profile_tally() = &own;
+    _profile_timer() = nullptr;
+    start = std::chrono::steady_clock::now();
+  };
+  query_profile(const query_profile &) = delete;
+  query_profile &operator=(const query_profile &) = delete;
+  ~query_profile() { stop(); };
+  // the query open on the calling thread, if any
+  static query_profile *current() { return _profile_query(); };
+  // a tally for another thread working on this query
+  profile_tally *lend() {
+    std::lock_guard<std::mutex> guard(lock);
+    lent.push_back(std::make_unique<profile_tally>());
+    return lent.back().get();
+  };
+  // merges the tallies; the workers have been joined by now
+  void stop() {
+    if (stopped)
+      return;
+    finish = std::chrono::steady_clock::now();
+    stopped = true;
+    _profile_query() = prev_query;
+    _profile_tally() = prev_tally;
+    _profile_timer() = prev_timer;
+    total = own;
+    for (const auto &t : lent) {
+      for (unsigned i = 0; i < profile_counters; ++i) {
+        total.counters[i] += t->counters[i];
+      }
+    }
+  };
+  uint64_t phase_ns(const profile_phase &p) const {
+    return total.phase_ns[p];
+  };
+  uint64_t counter(const profile_counter &c) const {
+    return total.counters[c];
+  };
+  std::string json() {
+    stop();
+    std::ostringstream ss;
+#ifdef ENRICHED_PROFILE
+    ss << "{\"enabled\":true";
+#else
+    ss << "{\"enabled\":false";
+#endif
+    ss << ",\"wall_ms\":"
+       << std::chrono::duration<double, std::milli>(finish - start).count()
+       << ",\"threads\":" << lent.size() + 1 << ",\"phases_ms\":{";
+    for (unsigned i = 0; i < profile_phases; ++i) {
+      ss << (i ? "," : "") << "\"" << profile_phase_names[i]
+         << "\":" << total.phase_ns[i] / 1e6;
+    }
+    ss << "},\"counters\":{";
+    for (unsigned i = 0; i < profile_counters; ++i) {
+      ss << (i ? "," : "") << "\"" << profile_counter_names[i]
+         << "\":" << total.counters[i];
+    }
+    ss << "}}";
+    return ss.str();
+  };
+};
+
+// records the calling worker thread into query for its lifetime; with no
+// query, or the one already open on this thread, it changes nothing
+class profile_worker {
+private:
+  bool attached;
+  query_profile *prev_query;
+  profile_tally *prev_tally;
+  profile_timer *prev_timer;
+
+public:
+  explicit profile_worker(query_profile *query)
+      : attached(query && query != _profile_query()),
+        prev_query(_profile_query()), prev_tally(_profile_tally()),
+        prev_timer(_profile_timer()) {
+    if (!attached)
+      return;
+    _profile_query() = query;
+    _profile_tally() = query->lend();
+    _profile_timer() = nullptr;
+  };
+  profile_worker(const profile_worker &) = delete;
+  profile_worker &operator=(const profile_worker &) = delete;
+  ~profile_worker() {
+    if (!attached)
+      return;
+    _profile_query() = prev_query;
+    _profile_tally() = prev_tally;
+    _profile_timer() = prev_timer;
+  };
+};
+#endif
@@ -0,0 +1,190 @@
+#ifndef REDUNDANCY
+#define REDUNDANCY
+#include "data.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+#include "results.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// overlap of two terms within a test set of n symbols, of which the terms
+// hold a and b and both of them hold both
+constexpr double jaccard(const unsigned &both, const unsigned &a,
+                         const unsigned &b, const unsigned &) {
+  return a + b == both ? 0
+                       : static_cast<double>(both) /
+                             static_cast<double>(a + b - both);
+}
+// Cohen's kappa of the two terms' memberships over the n symbols, the
+// agreement beyond chance that DAVID clusters terms with
+constexpr double kappa(const unsigned &both, const unsigned &a,
+                       const unsigned &b, const unsigned &n) {
+  const double nn = static_cast<double>(n), x = static_cast<double>(a),
+               y = static_cast<double>(b);
+  const double observed = (nn - x - y + 2.0 * both) / nn,
+               chance = (x * y + (nn - x) * (nn - y)) / (nn * nn);
+  return chance == 1 ? 1 : (observed - chance) / (1 - chance);
+}
+
+// disjoint sets over [0, n); a union keeps the smaller root, so the root
+// of a set is its smallest member whatever order the unions come in
+class _term_forest {
+private:
+  std::vector<unsigned> parent;
+
+public:
+  _term_forest(const unsigned &n) : parent(n) {
+    for (unsigned i = 0; i < n; ++i)
+      parent[i] = i;
+  };
+  unsigned find(unsigned x) {
+    while (parent[x] != x) {
+      parent[x] = parent[parent[x]];
+      x = parent[x];
+    }
+    return x;
+  };
+  // false if x and y were already joined
+  bool join(const unsigned &x, const unsigned &y) {
+    const unsigned rx = find(x), ry = find(y);
+    if (rx == ry)
+      return false;
+    parent[std::max(rx, ry)] = std::min(rx, ry);
+    return true;
+  };
+};
+
+// redundancy groups among the rows of one result section
+struct term_clusters {
+  // the rows clustered, best first, and the cluster of each
+  std::vector<unsigned> rows, cluster;
+  // the best row of every cluster, clusters numbered in that order
+  std::vector<unsigned> representatives;
+};
+
+// groups the best `top` enriched rows of a section by how much their terms
+// overlap within the test set: terms whose similarity sim reaches
+// threshold are joined, and so are their groups (single linkage). dataset
+// is the one the section was scored on. every term becomes a bitmap over
+// the members of the test set only, and the pairs are counted tile by tile
+// with one fused AND+popcount each: a tile of terms stays in cache while
+// it is matched against every later tile, tile rows are spread over
+// `threads` workers. each worker keeps its own forest and only hands on
+// the pairs that joined two of its groups, so the result does not depend
+// on the thread count. a tile holds tile_terms terms, or with 0 as many
+// as fit in about 64KB
+template <decltype(jaccard) sim = jaccard, typename S, typename D>
+term_clusters cluster_terms(const ResultDataset &res, const unsigned &section,
+                            const S &test_set, const D &dataset,
+                            const double &threshold = 0.5,
+                            const unsigned &top = 2000,
+                            const unsigned &threads = 1,
+                            const unsigned &tile_terms = 0) {
+  if (section >= res.sections().size()) {
+    throw(std::out_of_range("no result section " + std::to_string(section)));
+  }
+  if (!dataset.has_index()) {
+    throw(std::logic_error("dataset is not indexed, call gen_mappings"));
+  }
+  ENRICHED_PHASE(phase_stats);
+  term_clusters out;
+  const auto &sec = res.sections()[section];
+  for (unsigned i = sec.begin; i < sec.end && out.rows.size() < top; ++i) {
+    if (res.is_enriched(i))
+      out.rows.push_back(i);
+  }
+  // 1, the terms as bitmaps over the test set positions
+  const auto &members = test_set.get_idxs();
+  const unsigned n = out.rows.size(), m = members.size();
+  const size_t words = (m + 63) / 64;
+  std::vector<unsigned> pos(dataset.total_syms(), id_table::npos),
+      sizes(n, 0);
+  for (unsigned p = 0; p < m; ++p) {
+    pos[members[p]] = p;
+  }
+  std::vector<uint64_t> bits(static_cast<size_t>(n) * words, 0);
+  for (unsigned t = 0; t < n; ++t) {
+    uint64_t *w = bits.data() + static_cast<size_t>(t) * words;
+    for (const unsigned &s : dataset.anno_row(res.anno(out.rows[t]))) {
+      const unsigned p = pos[s];
+      if (p == id_table::npos)
+        continue;
+      w[p >> 6] |= uint64_t(1) << (p & 63);
+      ++sizes[t];
+    }
+  }
+  // 2, all pairs in tiles of about 64KB of bitmaps
+  const unsigned tile =
+      tile_terms ? tile_terms
+                 : static_cast<unsigned>(std::max<size_t>(
+                       8, (64 << 10) / (8 * std::max<size_t>(words, 1))));
+  ENRICHED_COUNT(prof_bytes_popcounted,
+                 static_cast<uint64_t>(n) * n * words * 8);
+  std::vector<std::vector<std::pair<unsigned, unsigned>>> joins(
+      (n + tile - 1) / tile);
+  parallel_blocks(
+      n, tile, threads,
+      [&](const unsigned &b, const unsigned &begin, const unsigned &end) {
+        _term_forest local(n);
+        for (unsigned first = begin; first < n; first += tile) {
+          const unsigned last = std::min(n, first + tile);
+          for (unsigned i = begin; i < end; ++i) {
+            const uint64_t *wi = bits.data() + static_cast<size_t>(i) * words;
+            for (unsigned j = std::max(first, i + 1); j < last; ++j) {
+              const unsigned both = popcount_and(
+                  wi, bits.data() + static_cast<size_t>(j) * words, words);
+              if (sim(both, sizes[i], sizes[j], m) >= threshold &&
+                  local.join(i, j))
+                joins[b].emplace_back(i, j);
+            }
+          }
+        }
+      });
+  // 3, single linkage over every worker's joins
+  _term_forest forest(n);
+  for (const auto &block : joins) {
+    for (const auto &p : block) {
+      forest.join(p.first, p.second);
+    }
+  }
+  std::vector<unsigned> id_of(n, id_table::npos);
+  out.cluster.resize(n);
+  for (unsigned t = 0; t < n; ++t) {
+    const unsigned root = forest.find(t);
+    if (id_of[root] == id_table::npos) {
+      id_of[root] = out.representatives.size();
+      out.representatives.push_back(out.rows[root]);
+    }
+    out.cluster[t] = id_of[root];
+  }
+  return out;
+}
+
+// adds the representatives of a section's redundancy groups (the best row
+// of each group, best first) as a section of rout named after the
+// original; takes the same arguments as cluster_terms
+template <decltype(jaccard) sim = jaccard, typename S, typename D>
+term_clusters reduce_redundancy(const ResultDataset &res,
+                                const unsigned &section, const S &test_set,
+                                const D &dataset, ResultDataset &rout,
+                                const double &threshold = 0.5,
+                                const unsigned &top = 2000,
+                                const unsigned &threads = 1,
+                                const unsigned &tile_terms = 0) {
+  auto clusters = cluster_terms<sim>(res, section, test_set, dataset,
+                                     threshold, top, threads, tile_terms);
+  std::vector<test_result> kept;
+  kept.reserve(clusters.representatives.size());
+  for (const unsigned &i : clusters.representatives) {
+    kept.push_back({res.anno(i), res.stat(i), res.is_enriched(i)});
+  }
+  const auto &sec = res.sections()[section];
+  rout.add(sec.name + " (representatives)", kept, sec.id_of, sec.name_of);
+  return clusters;
+}
+#endif
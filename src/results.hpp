@@ -0,0 +1,383 @@
+#ifndef RESULTS
+#define RESULTS
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// one scored annotation, by index into the dataset it was tested on
+struct test_result {
+  unsigned anno = 0;
+  double stat = -1000;
+  bool enriched = false;
+};
+
+// the results of one test: rows [begin, end) of a ResultDataset, best
+// first, and how to name their annotations
+struct idxrange {
+  std::string name;
+  unsigned begin, end;
+  std::function<std::string_view(const unsigned &)> id_of, name_of;
+};
+
+// writes v in its shortest round trip form, returns the length
+inline size_t format_double(char (&buf)[32], const double &v) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  return std::to_chars(buf, buf + sizeof(buf), v).ptr - buf;
+#else
+  return std::snprintf(buf, sizeof(buf), "%.17g", v);
+#endif
+}
+
+// appends s as a JSON string literal
+inline void json_string(std::string &out, const std::string_view &s) {
+  out += '"';
+  for (const char &c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+  }
+  out += '"';
+}
+
+// appends s as one TSV field: backslash, tab, newline and carriage return
+// are escaped as \\, \t, \n and \r so they cannot split the row
+inline void tsv_field(std::string &out, const std::string_view &s) {
+  for (const char &c : s) {
+    switch (c) {
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    default:
+      out += c;
+    }
+  }
+}
+
+// appends a double as a JSON number, null if it has no JSON form
+inline void json_number(std::string &out, const double &v) {
+  if (!std::isfinite(v)) {
+    out += "null";
+    return;
+  }
+  char buf[32];
+  out.append(buf, format_double(buf, v));
+}
+
+// results stored as columns, one row per scored annotation: the
+// annotation index, the test (section) it belongs to, the statistic and
+// the direction. names are not copied but looked up when written, so the
+// datasets a ResultDataset was filled from must outlive it
+class ResultDataset {
+private:
+  std::vector<idxrange> tests;
+  std::vector<unsigned> annos, test_ids;
+  std::vector<double> stats;
+  std::vector<uint8_t> enriched;
+
+public:
+  ResultDataset(){};
+  template <typename D>
+  ResultDataset(const std::string &name, const std::vector<test_result> &res,
+                const D &dataset) {
+    add(name, res, dataset);
+  };
+  // adds a section whose annotation indices refer to dataset
+  template <typename D>
+  void add(const std::string &name, const std::vector<test_result> &res,
+           const D &dataset) {
+    add(name, res,
+        [&dataset](const unsigned &i) { return dataset.anno_id(i); },
+        [&dataset](const unsigned &i) { return dataset.anno_name(i); });
+  };
+  void add(const std::string &name, const std::vector<test_result> &res,
+           std::function<std::string_view(const unsigned &)> id_of,
+           std::function<std::string_view(const unsigned &)> name_of) {
+    const unsigned start = annos.size(), test = tests.size();
+    annos.reserve(start + res.size());
+    test_ids.reserve(start + res.size());
+    stats.reserve(start + res.size());
+    enriched.reserve(start + res.size());
+    for (const auto &r : res) {
+      annos.push_back(r.anno);
+      test_ids.push_back(test);
+      stats.push_back(r.stat);
+      enriched.push_back(r.enriched);
+    }
+    tests.push_back({name, start, static_cast<unsigned>(annos.size()),
+                     std::move(id_of), std::move(name_of)});
+  };
+  // the sections in the order they were added
+  const std::vector<idxrange> &sections() const { return tests; };
+  size_t size() const { return annos.size(); };
+  // the columns of row i
+  unsigned anno(const size_t &i) const { return annos[i]; };
+  unsigned test(const size_t &i) const { return test_ids[i]; };
+  double stat(const size_t &i) const { return stats[i]; };
+  bool is_enriched(const size_t &i) const { return enriched[i]; };
+  std::string_view id(const size_t &i) const {
+    return tests[test_ids[i]].id_of(annos[i]);
+  };
+  std::string_view name(const size_t &i) const {
+    return tests[test_ids[i]].name_of(annos[i]);
+  };
+  const unsigned *anno_column() const { return annos.data(); };
+  const double *stat_column() const { return stats.data(); };
+  const uint8_t *enriched_column() const { return enriched.data(); };
+  // every annotation name on one line with its results in all sections,
+  // in the order the names first appear
+  void print() const {
+    std::ostringstream out;
+    out << " ========== TEST RESULT ==========\n";
+    for (auto &t : tests) {
+      out << "\t" << t.name;
+    }
+    out << "\n";
+    std::unordered_map<std::string_view, unsigned> row_of;
+    std::vector<std::vector<unsigned>> rows;
+    for (unsigned i = 0; i < annos.size(); ++i) {
+      const auto it = row_of.emplace(name(i), rows.size());
+      if (it.second)
+        rows.emplace_back();
+      rows[it.first->second].push_back(i);
+    }
+    for (const auto &row : rows) {
+      out << name(row[0]);
+      for (const unsigned &i : row) {
+        out << "\t" << stats[i] << (enriched[i] ? "+" : "-");
+      }
+      out << "\n";
+    }
+    std::cout << out.str() << std::flush;
+  };
+  template <typename W> void write(W &writer) const {
+    writer.begin();
+    for (unsigned t = 0; t < tests.size(); ++t) {
+      writer.section(*this, t);
+    }
+    writer.finish();
+  };
+};
+
+// a buffered sink over a file descriptor. bytes are collected into blocks
+// of block bytes and handed to the OS one block at a time
+class fd_sink {
+private:
+  int fd;
+  bool owned;
+  std::vector<char> buf;
+  size_t used = 0;
+
+  void _write(const char *p, const size_t &n) {
+    size_t done = 0;
+    while (done < n) {
+#if defined(_WIN32)
+      const long w = ::_write(fd, p + done, static_cast<unsigned>(n - done));
+#else
+      const long w = ::write(fd, p + done, n - done);
+#endif
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0) {
+        throw(std::runtime_error("Failed writing results"));
+      }
+      done += w;
+    }
+  };
+
+public:
+  explicit fd_sink(const int &fd, const size_t &block = 1 << 20)
+      : fd(fd), owned(false), buf(block){};
+  explicit fd_sink(const std::string &fname, const size_t &block = 1 << 20)
+      : owned(true), buf(block) {
+#if defined(_WIN32)
+    fd = ::_open(fname.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+                 _S_IREAD | _S_IWRITE);
+#else
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+      throw(std::runtime_error("Cannot write file:" + fname));
+    }
+  };
+  fd_sink(const fd_sink &) = delete;
+  fd_sink &operator=(const fd_sink &) = delete;
+  ~fd_sink() {
+    try {
+      flush();
+    } catch (const std::exception &) {
+    }
+    if (owned) {
+#if defined(_WIN32)
+      ::_close(fd);
+#else
+      ::close(fd);
+#endif
+    }
+  };
+  // appends n bytes; a run larger than a block bypasses the buffer
+  void put(const char *p, const size_t &n) {
+    if (used + n > buf.size()) {
+      flush();
+      if (n >= buf.size()) {
+        _write(p, n);
+        return;
+      }
+    }
+    std::memcpy(buf.data() + used, p, n);
+    used += n;
+  };
+  void put(const std::string_view &s) { put(s.data(), s.size()); };
+  template <typename T> void put_raw(const T &v) {
+    put(reinterpret_cast<const char *>(&v), sizeof(T));
+  };
+  void flush() {
+    const size_t n = used;
+    used = 0;
+    _write(buf.data(), n);
+  };
+};
+
+// result writers stream a ResultDataset into a sink section by section,
+// rows in the order they were added. pass one to ResultDataset::write
+class result_writer {
+protected:
+  fd_sink &out;
+
+public:
+  explicit result_writer(fd_sink &out) : out(out){};
+  virtual ~result_writer(){};
+  virtual void begin(){};
+  virtual void section(const ResultDataset &rd, const unsigned &test) = 0;
+  virtual void finish() { out.flush(); };
+};
+
+// one line per row: test, annotation id, name, statistic and + or -.
+// text fields are escaped as by tsv_field
+class tsv_writer : public result_writer {
+private:
+  std::string line;
+
+public:
+  using result_writer::result_writer;
+  void begin() override { out.put("test\tid\tname\tstat\tenriched\n"); };
+  void section(const ResultDataset &rd, const unsigned &test) override {
+    const idxrange &t = rd.sections()[test];
+    char buf[32];
+    for (unsigned i = t.begin; i < t.end; ++i) {
+      line.clear();
+      tsv_field(line, t.name);
+      line += '\t';
+      tsv_field(line, t.id_of(rd.anno(i)));
+      line += '\t';
+      tsv_field(line, t.name_of(rd.anno(i)));
+      line += '\t';
+      line.append(buf, format_double(buf, rd.stat(i)));
+      line += rd.is_enriched(i) ? "\t+\n" : "\t-\n";
+      out.put(line);
+    }
+  };
+};
+
+// one JSON object per row with the same fields as tsv_writer
+class json_lines_writer : public result_writer {
+private:
+  std::string line;
+
+public:
+  using result_writer::result_writer;
+  void section(const ResultDataset &rd, const unsigned &test) override {
+    const idxrange &t = rd.sections()[test];
+    for (unsigned i = t.begin; i < t.end; ++i) {
+      line = "{\"test\":";
+      json_string(line, t.name);
+      line += ",\"id\":";
+      json_string(line, t.id_of(rd.anno(i)));
+      line += ",\"name\":";
+      json_string(line, t.name_of(rd.anno(i)));
+      line += ",\"stat\":";
+      json_number(line, rd.stat(i));
+      line += rd.is_enriched(i) ? ",\"enriched\":true}\n"
+                                : ",\"enriched\":false}\n";
+      out.put(line);
+    }
+  };
+};
+
+// compact binary form, the columns of each section as bare arrays in host
+// byte order:
+//   header   "ENRRES1\0", uint32 0x01020304
+//   section  uint32 name length, name, uint32 rows,
+//            uint32 anno[rows], double stat[rows], uint8 enriched[rows]
+// names are left out; the annotation indices refer to the dataset tested
+class binary_writer : public result_writer {
+public:
+  using result_writer::result_writer;
+  void begin() override {
+    out.put("ENRRES1", 8);
+    out.put_raw(uint32_t(0x01020304));
+  };
+  void section(const ResultDataset &rd, const unsigned &test) override {
+    const idxrange &t = rd.sections()[test];
+    const uint32_t rows = t.end - t.begin;
+    out.put_raw(static_cast<uint32_t>(t.name.size()));
+    out.put(t.name);
+    out.put_raw(rows);
+    out.put(reinterpret_cast<const char *>(rd.anno_column() + t.begin),
+            rows * sizeof(unsigned));
+    out.put(reinterpret_cast<const char *>(rd.stat_column() + t.begin),
+            rows * sizeof(double));
+    out.put(reinterpret_cast<const char *>(rd.enriched_column() + t.begin),
+            rows);
+  };
+};
+#endif
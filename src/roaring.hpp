@@ -0,0 +1,268 @@
+#ifndef ROARING
+#define ROARING
+#include "kernels.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// a runtime sized set of 32 bit indices in the style of Roaring bitmaps.
+// the index space is cut into chunks of 2^16 by the high half of an index;
+// every non empty chunk keeps its low halves in whichever container is the
+// smallest: a sorted array, a 1024 word bitmap or a list of runs. all
+// containers live in two shared pools, so a mask is three allocations
+// however many chunks it has. masks are immutable once built
+class roaring_mask {
+public:
+  enum kind : uint8_t { array, bitmap, run };
+  struct chunk {
+    uint16_t key;
+    kind type;
+    uint32_t card;
+    // array: card values in vals, run: size (start, last) pairs in vals,
+    // bitmap: 1024 words in words
+    uint32_t offset, size;
+  };
+  static constexpr unsigned bitmap_words = 1024;
+
+private:
+  std::vector<chunk> chunks;
+  std::vector<uint16_t> vals;
+  std::vector<uint64_t> words;
+  uint64_t card = 0;
+
+  void _add_chunk(const uint16_t &key, const unsigned *first,
+                  const unsigned *last) {
+    const uint32_t n = last - first;
+    uint32_t runs = 1;
+    for (const unsigned *it = first + 1; it < last; ++it) {
+      runs += *it != it[-1] + 1;
+    }
+    chunk c{key, array, n, 0, n};
+    if (4 * runs < std::min<size_t>(2 * n, 8 * bitmap_words)) {
+      c.type = run;
+      c.offset = vals.size();
+      c.size = runs;
+      for (const unsigned *it = first; it < last;) {
+        const unsigned *end = it + 1;
+        while (end < last && *end == end[-1] + 1)
+          ++end;
+        vals.push_back(*it & 0xffff);
+        vals.push_back(end[-1] & 0xffff);
+        it = end;
+      }
+    } else if (2 * n > 8 * bitmap_words) {
+      c.type = bitmap;
+      c.offset = words.size();
+      c.size = bitmap_words;
+      words.resize(words.size() + bitmap_words, 0);
+      uint64_t *w = words.data() + c.offset;
+      for (const unsigned *it = first; it < last; ++it) {
+        w[(*it & 0xffff) >> 6] |= uint64_t(1) << (*it & 63);
+      }
+    } else {
+      c.offset = vals.size();
+      for (const unsigned *it = first; it < last; ++it) {
+        vals.push_back(*it & 0xffff);
+      }
+    }
+    chunks.push_back(c);
+    card += n;
+  };
+
+  // |A & B| of two containers, one routine per pair of kinds
+  static unsigned _array_array(const uint16_t *a, const uint32_t &na,
+                               const uint16_t *b, const uint32_t &nb) {
+    if (na > nb)
+      return _array_array(b, nb, a, na);
+    unsigned out = 0;
+    if (na * 32 < nb) {
+      // galloping: binary search the long side from the last match on
+      const uint16_t *lo = b, *end = b + nb;
+      for (uint32_t i = 0; i < na && lo < end; ++i) {
+        lo = std::lower_bound(lo, end, a[i]);
+        out += lo < end && *lo == a[i];
+      }
+      return out;
+    }
+    uint32_t i = 0, j = 0;
+    while (i < na && j < nb) {
+      const uint16_t x = a[i], y = b[j];
+      out += x == y;
+      i += x <= y;
+      j += y <= x;
+    }
+    return out;
+  };
+  static unsigned _array_bitmap(const uint16_t *a, const uint32_t &na,
+                                const uint64_t *w) {
+    unsigned out = 0;
+    for (uint32_t i = 0; i < na; ++i) {
+      out += w[a[i] >> 6] >> (a[i] & 63) & 1;
+    }
+    return out;
+  };
+  static unsigned _array_run(const uint16_t *a, const uint32_t &na,
+                             const uint16_t *r, const uint32_t &nr) {
+    unsigned out = 0;
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < na && j < nr; ++i) {
+      while (j < nr && r[2 * j + 1] < a[i])
+        ++j;
+      out += j < nr && r[2 * j] <= a[i];
+    }
+    return out;
+  };
+  // bits set in w within [start, last]
+  static unsigned _bitmap_range(const uint64_t *w, const unsigned &start,
+                                const unsigned &last) {
+    const unsigned first_word = start >> 6, last_word = last >> 6;
+    const uint64_t head = ~uint64_t(0) << (start & 63),
+                   tail = ~uint64_t(0) >> (63 - (last & 63));
+    if (first_word == last_word)
+      return popcount64(w[first_word] & head & tail);
+    unsigned out = popcount64(w[first_word] & head) +
+                   popcount64(w[last_word] & tail);
+    for (unsigned i = first_word + 1; i < last_word; ++i) {
+      out += popcount64(w[i]);
+    }
+    return out;
+  };
+  static unsigned _bitmap_run(const uint64_t *w, const uint16_t *r,
+                              const uint32_t &nr) {
+    unsigned out = 0;
+    for (uint32_t j = 0; j < nr; ++j) {
+      out += _bitmap_range(w, r[2 * j], r[2 * j + 1]);
+    }
+    return out;
+  };
+  static unsigned _run_run(const uint16_t *a, const uint32_t &na,
+                           const uint16_t *b, const uint32_t &nb) {
+    unsigned out = 0;
+    uint32_t i = 0, j = 0;
+    while (i < na && j < nb) {
+      const unsigned lo = std::max(a[2 * i], b[2 * j]),
+                     hi = std::min(a[2 * i + 1], b[2 * j + 1]);
+      if (lo <= hi)
+        out += hi - lo + 1;
+      if (a[2 * i + 1] < b[2 * j + 1])
+        ++i;
+      else
+        ++j;
+    }
+    return out;
+  };
+  unsigned _intersect(const chunk &x, const roaring_mask &other,
+                      const chunk &y) const {
+    if (x.type > y.type)
+      return other._intersect(y, *this, x);
+    auto v = [](const roaring_mask &m, const chunk &c) {
+      return m.vals.data() + c.offset;
+    };
+    auto w = [](const roaring_mask &m, const chunk &c) {
+      return m.words.data() + c.offset;
+    };
+    switch (x.type) {
+    case array:
+      if (y.type == array)
+        return _array_array(v(*this, x), x.size, v(other, y), y.size);
+      if (y.type == bitmap)
+        return _array_bitmap(v(*this, x), x.size, w(other, y));
+      return _array_run(v(*this, x), x.size, v(other, y), y.size);
+    case bitmap:
+      if (y.type == bitmap)
+        return popcount_and(w(*this, x), w(other, y), bitmap_words);
+      return _bitmap_run(w(*this, x), v(other, y), y.size);
+    default:
+      return _run_run(v(*this, x), x.size, v(other, y), y.size);
+    }
+  };
+
+public:
+  roaring_mask(){};
+  // from ascending, distinct indices
+  roaring_mask(const unsigned *first, const unsigned *last) {
+    while (first < last) {
+      const unsigned key = *first >> 16;
+      const unsigned *end = first;
+      while (end < last && *end >> 16 == key)
+        ++end;
+      _add_chunk(key, first, end);
+      first = end;
+    }
+    chunks.shrink_to_fit();
+    vals.shrink_to_fit();
+  };
+  explicit roaring_mask(const std::vector<unsigned> &sorted)
+      : roaring_mask(sorted.data(), sorted.data() + sorted.size()){};
+  uint64_t count() const { return card; };
+  bool empty() const { return card == 0; };
+  const std::vector<chunk> &containers() const { return chunks; };
+  // heap bytes held by the containers
+  size_t bytes() const {
+    return chunks.size() * sizeof(chunk) + vals.size() * sizeof(uint16_t) +
+           words.size() * sizeof(uint64_t);
+  };
+  bool test(const unsigned &idx) const {
+    const uint16_t key = idx >> 16, low = idx & 0xffff;
+    const auto it = std::lower_bound(
+        chunks.begin(), chunks.end(), key,
+        [](const chunk &c, const uint16_t &k) { return c.key < k; });
+    if (it == chunks.end() || it->key != key)
+      return false;
+    if (it->type == bitmap)
+      return words[it->offset + (low >> 6)] >> (low & 63) & 1;
+    const uint16_t *v = vals.data() + it->offset;
+    if (it->type == array)
+      return std::binary_search(v, v + it->size, low);
+    for (uint32_t j = 0; j < it->size; ++j) {
+      if (v[2 * j] <= low && low <= v[2 * j + 1])
+        return true;
+    }
+    return false;
+  };
+  // calls fn on every index, ascending
+  template <typename F> void for_each(F &&fn) const {
+    for (const chunk &c : chunks) {
+      const unsigned high = static_cast<unsigned>(c.key) << 16;
+      if (c.type == bitmap) {
+        for (unsigned i = 0; i < bitmap_words; ++i) {
+          uint64_t w = words[c.offset + i];
+          while (w) {
+            // the lowest set bit, counted as the ones below it
+            fn(high | (i << 6) | popcount64((w & (0 - w)) - 1));
+            w &= w - 1;
+          }
+        }
+        continue;
+      }
+      const uint16_t *v = vals.data() + c.offset;
+      if (c.type == array) {
+        for (uint32_t i = 0; i < c.size; ++i)
+          fn(high | v[i]);
+      } else {
+        for (uint32_t j = 0; j < c.size; ++j) {
+          for (unsigned x = v[2 * j]; x <= v[2 * j + 1]; ++x)
+            fn(high | x);
+        }
+      }
+    }
+  };
+  // |this & other| without building the intersection, chunk by chunk
+  unsigned intersect_count(const roaring_mask &other) const {
+    unsigned out = 0;
+    size_t i = 0, j = 0;
+    while (i < chunks.size() && j < other.chunks.size()) {
+      const uint16_t x = chunks[i].key, y = other.chunks[j].key;
+      if (x == y)
+        out += _intersect(chunks[i], other, other.chunks[j]);
+      i += x <= y;
+      j += y <= x;
+    }
+    return out;
+  };
+};
+
+inline unsigned intersect_count(const roaring_mask &a, const roaring_mask &b) {
+  return a.intersect_count(b);
+}
+#endif
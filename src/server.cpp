@@ -0,0 +1,105 @@
+#include "pch.h"
+#include "server.hpp"
+#include <csignal>
+#include <cstdlib>
+
+// resident enrichment server: loads every dataset once and answers query
+// lines over a Unix domain socket until it gets SIGINT or SIGTERM
+//
+//   server --socket path [--workers n] [--cache entries]
+//          --dataset name=file.snap | name=annotations.tsv,symbols.tsv |
+//                    name=ontology.obo,annotations.gaf | name=clinvar.vcf ...
+//
+// the obo, gaf and vcf files may be gzipped when built with ENRICHED_ZLIB
+//
+// a client writes one JSON query per line and reads one JSON line back,
+// see enrichment_query for the fields, e.g.
+//   {"id":1,"dataset":"go","symbols":["ARNTL","CLOCK"],"k":20}
+
+typedef Dataset<symbol16, annotation16> ServerDataset;
+
+static socket_server<enrichment_service<symbol16, annotation16>> *running;
+
+static void on_signal(int) {
+  if (running)
+    running->stop();
+}
+
+static bool has_suffix(const std::string &fname, const std::string &ext) {
+  for (const std::string &e : {ext, ext + ".gz"}) {
+    if (fname.size() >= e.size() &&
+        fname.compare(fname.size() - e.size(), e.size(), e) == 0)
+      return true;
+  }
+  return false;
+}
+
+std::shared_ptr<live_dataset<ServerDataset>> open_dataset(std::string files) {
+  ServerDataset data;
+  const size_t comma = files.find(',');
+  if (comma == std::string::npos) {
+    if (has_suffix(files, ".vcf"))
+      load_clinvar_vcf(data, files);
+    else
+      data.load(files);
+  } else if (has_suffix(files.substr(0, comma), ".obo")) {
+    load_obo(data, files.substr(0, comma));
+    load_gaf(data, files.substr(comma + 1));
+  } else {
+    load_annotations_plain(data, files.substr(0, comma));
+    load_syms_with_mappings(data, files.substr(comma + 1));
+  }
+  data.gen_mappings();
+  return std::make_shared<live_dataset<ServerDataset>>(std::move(data));
+}
+
+int main(int argc, char **argv) {
+  std::string socket_path;
+  unsigned workers = 0;
+  size_t cache_size = 1024;
+  std::vector<std::pair<std::string, std::string>> sources;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string arg = argv[i], value = argv[i + 1];
+    if (arg == "--socket") {
+      socket_path = value;
+    } else if (arg == "--workers") {
+      workers = std::atoi(value.c_str());
+    } else if (arg == "--cache") {
+      cache_size = std::atol(value.c_str());
+    } else if (arg == "--dataset") {
+      const size_t eq = value.find('=');
+      if (eq == std::string::npos) {
+        std::cerr << "--dataset takes name=files" << std::endl;
+        return 2;
+      }
+      sources.emplace_back(value.substr(0, eq), value.substr(eq + 1));
+    }
+  }
+  if (socket_path.empty() || sources.empty()) {
+    std::cerr << "usage: server --socket path --dataset name=files ..."
+              << std::endl;
+    return 2;
+  }
+  enrichment_service<symbol16, annotation16> service(cache_size);
+  try {
+    for (const auto &src : sources) {
+      service.add(src.first, open_dataset(src.second));
+    }
+    socket_server<enrichment_service<symbol16, annotation16>> server(
+        service, socket_path, workers);
+    running = &server;
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::cerr << "serving " << sources.size() << " datasets on "
+              << socket_path << std::endl;
+    server.run();
+    running = nullptr;
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  const auto stats = service.cache_stats();
+  std::cerr << "cache hits " << stats.first << ", misses " << stats.second
+            << std::endl;
+  return 0;
+}
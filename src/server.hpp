@@ -0,0 +1,716 @@
+#ifndef SERVER
+#define SERVER
+#include "data.hpp"
+#include "live.hpp"
+#include "parallel.hpp"
+#include "results.hpp"
+#include "stats.hpp"
+#include "storage.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#define ENRICHED_SOCKETS
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// a forward only reader over one JSON text, just enough for the flat query
+// objects of the server. malformed input throws std::runtime_error
+class json_reader {
+private:
+  std::string_view in;
+  size_t pos = 0;
+
+  [[noreturn]] void _fail(const char *what) const {
+    throw(std::runtime_error(std::string("bad query: ") + what + " at " +
+                             std::to_string(pos)));
+  };
+  void _space() {
+    while (pos < in.size() && (in[pos] == ' ' || in[pos] == '\t' ||
+                               in[pos] == '\r' || in[pos] == '\n'))
+      ++pos;
+  };
+  static void _utf8(std::string &out, const unsigned &cp) {
+    if (cp < 0x80) {
+      out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      out += static_cast<char>(0xc0 | cp >> 6);
+      out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+      out += static_cast<char>(0xe0 | cp >> 12);
+      out += static_cast<char>(0x80 | (cp >> 6 & 0x3f));
+      out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+      out += static_cast<char>(0xf0 | cp >> 18);
+      out += static_cast<char>(0x80 | (cp >> 12 & 0x3f));
+      out += static_cast<char>(0x80 | (cp >> 6 & 0x3f));
+      out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+  };
+  // the four hex digits of a \u escape
+  unsigned _hex4() {
+    if (pos + 4 > in.size())
+      _fail("short escape");
+    unsigned out = 0;
+    for (const char &c : in.substr(pos, 4)) {
+      if (c >= '0' && c <= '9')
+        out = out << 4 | (c - '0');
+      else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        out = out << 4 | ((c | 0x20) - 'a' + 10);
+      else
+        _fail("bad escape");
+    }
+    pos += 4;
+    return out;
+  };
+
+public:
+  explicit json_reader(const std::string_view &text) : in(text){};
+  // skips white space and takes c if it comes next
+  bool take(const char &c) {
+    _space();
+    if (pos < in.size() && in[pos] == c) {
+      ++pos;
+      return true;
+    }
+    return false;
+  };
+  void expect(const char &c) {
+    if (!take(c))
+      _fail((std::string("expected ") + c).c_str());
+  };
+  bool at_end() {
+    _space();
+    return pos == in.size();
+  };
+  std::string string() {
+    expect('"');
+    std::string out;
+    while (pos < in.size() && in[pos] != '"') {
+      char c = in[pos++];
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (pos >= in.size())
+        break;
+      c = in[pos++];
+      switch (c) {
+      case 'n':
+        out += '\n';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'u': {
+        // a UTF-16 surrogate pair is one code point, a lone half is none
+        unsigned cp = _hex4();
+        if (cp >= 0xdc00 && cp < 0xe000)
+          _fail("lone surrogate");
+        if (cp >= 0xd800 && cp < 0xdc00) {
+          if (in.substr(pos, 2) != "\\u")
+            _fail("lone surrogate");
+          pos += 2;
+          const unsigned low = _hex4();
+          if (low < 0xdc00 || low >= 0xe000)
+            _fail("lone surrogate");
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        }
+        _utf8(out, cp);
+        break;
+      }
+      default:
+        out += c;
+      }
+    }
+    if (pos >= in.size())
+      _fail("unterminated string");
+    ++pos;
+    return out;
+  };
+  double number() {
+    _space();
+    const size_t start = pos;
+    while (pos < in.size() && in[pos] &&
+           std::strchr("+-.0123456789eE", in[pos]))
+      ++pos;
+    if (start == pos)
+      _fail("expected a number");
+    return std::stod(std::string(in.substr(start, pos - start)));
+  };
+  std::vector<std::string> strings() {
+    std::vector<std::string> out;
+    expect('[');
+    if (take(']'))
+      return out;
+    do {
+      out.push_back(string());
+    } while (take(','));
+    expect(']');
+    return out;
+  };
+  // the next value as JSON text that can be echoed back, if it is a string
+  // or a number. a string is encoded again, a number kept as written
+  std::string scalar() {
+    _space();
+    if (pos < in.size() && in[pos] == '"') {
+      std::string out;
+      json_string(out, string());
+      return out;
+    }
+    const size_t start = pos;
+    auto digits = [&]() {
+      const size_t from = pos;
+      while (pos < in.size() && in[pos] >= '0' && in[pos] <= '9')
+        ++pos;
+      return pos > from;
+    };
+    if (pos < in.size() && in[pos] == '-')
+      ++pos;
+    const size_t lead = pos;
+    if (!digits() || (in[lead] == '0' && pos - lead > 1))
+      _fail("expected a string or a number");
+    if (pos < in.size() && in[pos] == '.') {
+      ++pos;
+      if (!digits())
+        _fail("expected a fraction");
+    }
+    if (pos < in.size() && (in[pos] == 'e' || in[pos] == 'E')) {
+      ++pos;
+      if (pos < in.size() && (in[pos] == '+' || in[pos] == '-'))
+        ++pos;
+      if (!digits())
+        _fail("expected an exponent");
+    }
+    return std::string(in.substr(start, pos - start));
+  };
+  // the source text of the next value, whatever it is
+  std::string_view raw() {
+    _space();
+    const size_t start = pos;
+    if (pos < in.size() && in[pos] == '"') {
+      string();
+    } else if (take('[') || take('{')) {
+      const char close = in[pos - 1] == '[' ? ']' : '}';
+      if (!take(close)) {
+        do {
+          if (close == '}') {
+            string();
+            expect(':');
+          }
+          raw();
+        } while (take(','));
+        expect(close);
+      }
+    } else {
+      while (pos < in.size() && std::strchr(",]} \t\r\n", in[pos]) == nullptr)
+        ++pos;
+      if (start == pos)
+        _fail("expected a value");
+    }
+    return in.substr(start, pos - start);
+  };
+};
+
+// one line of the query protocol:
+//   {"id": "q1" | 1, "dataset": "go", "test": "fisher" | "fold_change",
+//    "symbols": [...], "control": [...], "k": 100, "threshold": 0.05}
+// only symbols is required. without a control set the symbols are tested
+// against the rest of the dataset. k must be a whole number in [1, max_k].
+// the id, a string or a number, is echoed in the response
+struct enrichment_query {
+  static constexpr unsigned max_k = 1u << 20;
+  std::string id = "null", dataset, test = "fisher";
+  std::vector<std::string> symbols, control;
+  bool has_control = false;
+  unsigned k = default_top_k;
+  double threshold = no_threshold;
+
+  static enrichment_query parse(const std::string_view &line) {
+    enrichment_query q;
+    json_reader in(line);
+    in.expect('{');
+    if (!in.take('}')) {
+      do {
+        const std::string key = in.string();
+        in.expect(':');
+        if (key == "id") {
+          q.id = in.scalar();
+        } else if (key == "dataset") {
+          q.dataset = in.string();
+        } else if (key == "test") {
+          q.test = in.string();
+        } else if (key == "symbols") {
+          q.symbols = in.strings();
+        } else if (key == "control") {
+          q.control = in.strings();
+          q.has_control = true;
+        } else if (key == "k") {
+          const double k = in.number();
+          if (!(k >= 1 && k <= max_k && k == std::floor(k))) {
+            throw(std::runtime_error("bad query: k must be a whole number "
+                                     "from 1 to " +
+                                     std::to_string(max_k)));
+          }
+          q.k = static_cast<unsigned>(k);
+        } else if (key == "threshold") {
+          q.threshold = in.number();
+        } else {
+          in.raw();
+        }
+      } while (in.take(','));
+      in.expect('}');
+    }
+    if (!in.at_end()) {
+      throw(std::runtime_error("bad query: trailing characters"));
+    }
+    return q;
+  };
+};
+
+// a thread safe least recently used map of bounded size
+template <typename V> class lru_cache {
+private:
+  typedef std::list<std::pair<std::string, V>> entries;
+  entries order;
+  std::unordered_map<std::string, typename entries::iterator> index;
+  size_t capacity;
+  mutable std::mutex lock;
+  uint64_t hits = 0, misses = 0;
+
+public:
+  explicit lru_cache(const size_t &capacity) : capacity(capacity){};
+  // copies the value of key into out and marks it as most recently used;
+  // match decides whether a found value is still good, one that is not is
+  // dropped
+  template <typename M> bool get(const std::string &key, V &out, M &&match) {
+    std::lock_guard<std::mutex> guard(lock);
+    const auto it = index.find(key);
+    if (it == index.end() || !match(it->second->second)) {
+      if (it != index.end()) {
+        order.erase(it->second);
+        index.erase(it);
+      }
+      ++misses;
+      return false;
+    }
+    order.splice(order.begin(), order, it->second);
+    out = it->second->second;
+    ++hits;
+    return true;
+  };
+  void put(const std::string &key, V value) {
+    if (capacity == 0)
+      return;
+    std::lock_guard<std::mutex> guard(lock);
+    const auto it = index.find(key);
+    if (it != index.end()) {
+      it->second->second = std::move(value);
+      order.splice(order.begin(), order, it->second);
+      return;
+    }
+    order.emplace_front(key, std::move(value));
+    index[key] = order.begin();
+    if (order.size() > capacity) {
+      index.erase(order.back().first);
+      order.pop_back();
+    }
+  };
+  // drops every entry for which drop(key, value) is true
+  template <typename P> void erase_if(P &&drop) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = order.begin(); it != order.end();) {
+      if (drop(it->first, it->second)) {
+        index.erase(it->first);
+        it = order.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  };
+  size_t size() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return order.size();
+  };
+  std::pair<uint64_t, uint64_t> stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return {hits, misses};
+  };
+};
+
+// answers query lines against a set of named datasets. results are cached
+// under the hash of the resolved, sorted symbol indices of both sets, so
+// the same sets spelled in another order or with unknown or repeated ids
+// hit the same entry. an entry only counts for the dataset version it was
+// computed on; datasets are live, so a caller may update them while the
+// service runs. entries do not keep their version alive, and the first
+// query to see a new version of a dataset drops the entries of the older
+// ones. answer is safe to call from any number of threads
+template <typename stype, typename atype> class enrichment_service {
+public:
+  typedef Dataset<stype, atype> dataset_type;
+  typedef SymSet<stype, atype> set_type;
+
+private:
+  struct cached {
+    std::weak_ptr<const dataset_type> version;
+    std::vector<unsigned> test, control;
+    std::string body;
+  };
+  std::unordered_map<std::string, std::shared_ptr<live_dataset<dataset_type>>>
+      datasets;
+  std::string first;
+  lru_cache<cached> cache;
+  // the version of each dataset the last query ran on
+  std::unordered_map<std::string, std::weak_ptr<const dataset_type>> seen;
+  std::mutex seen_lock;
+
+  static uint64_t _hash(const std::vector<unsigned> &idxs) {
+    return hash_id({reinterpret_cast<const char *>(idxs.data()),
+                    idxs.size() * sizeof(unsigned)});
+  };
+  // the results as a JSON array of sections
+  static std::string _body(const ResultDataset &rd) {
+    std::string out = "[";
+    for (const auto &sec : rd.sections()) {
+      out += out.size() > 1 ? ",{\"name\":" : "{\"name\":";
+      json_string(out, sec.name);
+      out += ",\"results\":[";
+      for (unsigned i = sec.begin; i < sec.end; ++i) {
+        out += i > sec.begin ? ",{\"id\":" : "{\"id\":";
+        json_string(out, sec.id_of(rd.anno(i)));
+        out += ",\"name\":";
+        json_string(out, sec.name_of(rd.anno(i)));
+        out += ",\"stat\":";
+        json_number(out, rd.stat(i));
+        out += rd.is_enriched(i) ? ",\"enriched\":true}"
+                                 : ",\"enriched\":false}";
+      }
+      out += "]}";
+    }
+    return out + "]";
+  };
+  static void _run(const enrichment_query &q, const set_type &test,
+                   const set_type *control, const dataset_type &data,
+                   ResultDataset &rd) {
+    if (q.test == "fisher") {
+      if (control)
+        ab_test<set_type, dataset_type, fisher_p, stat_sig_05, ascending>(
+            test, *control, data, rd, "Fisher's Exact Test (P <= 0.05)", 1,
+            q.k, q.threshold);
+      else
+        ab_test<set_type, dataset_type, fisher_p, stat_sig_05, ascending>(
+            test, data, rd, "Fisher's Exact Test (P <= 0.05)", 1, q.k,
+            q.threshold);
+    } else if (q.test == "fold_change") {
+      if (control)
+        ab_test<set_type, dataset_type, fold_change, fold_1, descending>(
+            test, *control, data, rd, "Fold Change (Fold > 1)", 1, q.k,
+            q.threshold);
+      else
+        ab_test<set_type, dataset_type, fold_change, fold_1, descending>(
+            test, data, rd, "Fold Change (Fold > 1)", 1, q.k, q.threshold);
+    } else {
+      throw(std::runtime_error("unknown test: " + q.test));
+    }
+  };
+
+public:
+  explicit enrichment_service(const size_t &cache_size = 1024)
+      : cache(cache_size){};
+  // registers a dataset under a name; not to be called while serving. the
+  // first one is the default for queries that do not name one
+  void add(const std::string &name,
+           std::shared_ptr<live_dataset<dataset_type>> dataset) {
+    if (datasets.empty())
+      first = name;
+    seen[name] = dataset->snapshot();
+    datasets[name] = std::move(dataset);
+  };
+  std::pair<uint64_t, uint64_t> cache_stats() const { return cache.stats(); };
+  // the response to one query line, without the newline. errors are
+  // answered as {"id": ..., "error": "..."} rather than thrown
+  std::string answer(const std::string_view &line) {
+    std::string id = "null";
+    try {
+      const enrichment_query q = enrichment_query::parse(line);
+      id = q.id;
+      const auto it = datasets.find(q.dataset.empty() ? first : q.dataset);
+      if (it == datasets.end()) {
+        throw(std::runtime_error("unknown dataset: " + q.dataset));
+      }
+      const auto data = it->second->snapshot();
+      if (!data->has_index()) {
+        throw(std::runtime_error("dataset is not indexed"));
+      }
+      bool swapped;
+      {
+        std::lock_guard<std::mutex> guard(seen_lock);
+        auto &last = seen[it->first];
+        swapped = last.lock() != data;
+        if (swapped)
+          last = data;
+      }
+      if (swapped) {
+        const std::string prefix = it->first + '\n';
+        cache.erase_if([&](const std::string &key, const cached &c) {
+          return key.compare(0, prefix.size(), prefix) == 0 &&
+                 c.version.lock() != data;
+        });
+      }
+      const set_type test(q.symbols, *data);
+      std::unique_ptr<set_type> control;
+      if (q.has_control)
+        control = std::make_unique<set_type>(q.control, *data);
+      cached entry;
+      entry.test = test.get_idxs();
+      if (control)
+        entry.control = control->get_idxs();
+      char threshold[32], hashes[40];
+      const size_t len = format_double(threshold, q.threshold);
+      std::snprintf(hashes, sizeof(hashes), "%016llx %016llx",
+                    static_cast<unsigned long long>(_hash(entry.test)),
+                    static_cast<unsigned long long>(_hash(entry.control)));
+      const std::string key = it->first + '\n' + q.test + '\n' +
+                              std::to_string(q.k) + ' ' +
+                              std::string(threshold, len) +
+                              (q.has_control ? " 1 " : " 0 ") + hashes;
+      bool hit = cache.get(key, entry, [&](const cached &c) {
+        return c.version.lock() == data && c.test == entry.test &&
+               c.control == entry.control;
+      });
+      if (!hit) {
+        ResultDataset rd;
+        _run(q, test, control.get(), *data, rd);
+        entry.version = data;
+        entry.body = _body(rd);
+        cache.put(key, entry);
+      }
+      return "{\"id\":" + id +
+             (hit ? ",\"cached\":true" : ",\"cached\":false") +
+             ",\"sections\":" + entry.body + "}";
+    } catch (const std::exception &e) {
+      std::string out = "{\"id\":" + id + ",\"error\":";
+      json_string(out, e.what());
+      return out + "}";
+    }
+  };
+};
+
+#ifdef ENRICHED_SOCKETS
+// serves a service over a Unix domain socket: every connection sends query
+// lines and reads one response line per query, in order. one thread polls
+// all connections and hands complete lines to a fixed pool of workers; a
+// connection has at most one query in flight, so its answers cannot be
+// reordered, and any number of clients share the pool
+template <typename Service> class socket_server {
+private:
+  struct connection {
+    std::string in;
+    bool busy = false;
+  };
+  Service &service;
+  std::string path;
+  unsigned workers;
+  int listen_fd = -1, wake[2] = {-1, -1};
+  std::atomic<bool> stopping{false};
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<std::pair<int, std::string>> jobs;
+  std::vector<int> done;
+  static constexpr size_t max_line = 64 << 20;
+
+  static bool _send(const int &fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+#ifdef MSG_NOSIGNAL
+      const ssize_t n =
+          ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+#else
+      const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, 0);
+#endif
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      sent += n;
+    }
+    return true;
+  };
+  void _work() {
+    while (true) {
+      std::pair<int, std::string> job;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this]() { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+          return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      _send(job.first, service.answer(job.second) + "\n");
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        done.push_back(job.first);
+      }
+      const char c = 0;
+      while (::write(wake[1], &c, 1) < 0 && errno == EINTR)
+        ;
+    }
+  };
+  // queues the next complete line of an idle connection
+  void _dispatch(const int &fd, connection &conn) {
+    while (!conn.busy) {
+      const size_t end = conn.in.find('\n');
+      if (end == std::string::npos)
+        return;
+      std::string line = conn.in.substr(0, end);
+      conn.in.erase(0, end + 1);
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (line.empty())
+        continue;
+      conn.busy = true;
+      std::lock_guard<std::mutex> guard(lock);
+      jobs.emplace_back(fd, std::move(line));
+      ready.notify_one();
+    }
+  };
+
+public:
+  // binds and listens on path, replacing a stale socket file. workers = 0
+  // means one per hardware thread
+  socket_server(Service &service, const std::string &path,
+                const unsigned &workers = 0)
+      : service(service), path(path), workers(resolve_threads(workers)) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      throw(std::runtime_error("Socket path too long:" + path));
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    ::unlink(path.c_str());
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 ||
+        ::bind(listen_fd, reinterpret_cast<sockaddr *>(&addr),
+               sizeof(addr)) < 0 ||
+        ::listen(listen_fd, 128) < 0 || ::pipe(wake) < 0) {
+      if (listen_fd >= 0)
+        ::close(listen_fd);
+      throw(std::runtime_error("Cannot listen on socket:" + path));
+    }
+  };
+  socket_server(const socket_server &) = delete;
+  socket_server &operator=(const socket_server &) = delete;
+  ~socket_server() {
+    ::close(listen_fd);
+    ::close(wake[0]);
+    ::close(wake[1]);
+    ::unlink(path.c_str());
+  };
+  // makes run return once the queries in flight are answered. only sets a
+  // flag and writes a byte, so it may be called from a signal handler
+  void stop() {
+    stopping = true;
+    const char c = 0;
+    const ssize_t n = ::write(wake[1], &c, 1);
+    (void)n;
+  };
+  // serves until stop is called
+  void run() {
+    std::vector<std::thread> pool;
+    for (unsigned i = 0; i < workers; ++i) {
+      pool.emplace_back([this]() { _work(); });
+    }
+    std::unordered_map<int, connection> conns;
+    std::vector<pollfd> fds;
+    std::vector<char> buf(1 << 16);
+    while (!stopping) {
+      fds.assign({{listen_fd, POLLIN, 0}, {wake[0], POLLIN, 0}});
+      for (const auto &c : conns) {
+        if (!c.second.busy)
+          fds.push_back({c.first, POLLIN, 0});
+      }
+      if (::poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (fds[1].revents) {
+        while (::read(wake[0], buf.data(), buf.size()) == -1 && errno == EINTR)
+          ;
+        std::vector<int> finished;
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          finished.swap(done);
+        }
+        for (const int &fd : finished) {
+          auto &conn = conns[fd];
+          conn.busy = false;
+          _dispatch(fd, conn);
+        }
+      }
+      if (fds[0].revents & POLLIN) {
+        const int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd >= 0)
+          conns[fd];
+      }
+      for (size_t i = 2; i < fds.size(); ++i) {
+        if (!fds[i].revents)
+          continue;
+        const int fd = fds[i].fd;
+        auto &conn = conns[fd];
+        const ssize_t n = ::read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0 || conn.in.size() + n > max_line) {
+          ::close(fd);
+          conns.erase(fd);
+          continue;
+        }
+        conn.in.append(buf.data(), n);
+        _dispatch(fd, conn);
+      }
+    }
+    stopping = true;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      ready.notify_all();
+    }
+    for (auto &t : pool) {
+      t.join();
+    }
+    for (const auto &c : conns) {
+      ::close(c.first);
+    }
+  };
+};
+#endif
+#endif
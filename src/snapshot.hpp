@@ -0,0 +1,146 @@
+#ifndef SNAPSHOT
+#define SNAPSHOT
+#include "storage.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+// binary Dataset snapshot. the file is a fixed header followed by flat
+// sections, each 64 byte aligned, which a loaded Dataset reads in place
+// from the mapped pages:
+//   string pools and their offsets (id, name[, description] per datum),
+//   the two id_table slot arrays, the CSR index in both directions and,
+//   optionally, the dense annotation and symbol masks
+// numbers are stored in host byte order; the header records it and a
+// snapshot from a machine of the other endianness is rejected
+
+constexpr char snapshot_magic[8] = {'E', 'N', 'R', 'S', 'N', 'A', 'P', 0};
+constexpr uint32_t snapshot_version = 1;
+constexpr uint32_t snapshot_endian = 0x01020304;
+constexpr size_t snapshot_align = 64;
+
+enum snapshot_section : unsigned {
+  snap_sym_pool,
+  snap_sym_strs,
+  snap_anno_pool,
+  snap_anno_strs,
+  snap_sym_index,
+  snap_anno_index,
+  snap_sym_offsets,
+  snap_sym_edges,
+  snap_anno_offsets,
+  snap_anno_edges,
+  snap_anno_masks,
+  snap_sym_masks,
+  snap_sections
+};
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version, endian;
+  uint64_t sym_bits, anno_bits, n_syms, n_annos, n_edges;
+  uint64_t sections[snap_sections][2]; // byte offset and byte size
+};
+
+class snapshot_writer {
+private:
+  std::ofstream out;
+  snapshot_header header;
+  uint64_t pos = 0;
+
+  void pad() {
+    static const char zeros[snapshot_align] = {};
+    const uint64_t rem = pos % snapshot_align;
+    if (rem) {
+      out.write(zeros, snapshot_align - rem);
+      pos += snapshot_align - rem;
+    }
+  };
+
+public:
+  snapshot_writer(const std::string &fname, const snapshot_header &h)
+      : out(fname, std::ios::binary | std::ios::trunc), header(h) {
+    if (!out.is_open()) {
+      throw(std::runtime_error("Cannot write snapshot:" + fname));
+    }
+    std::memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+    header.version = snapshot_version;
+    header.endian = snapshot_endian;
+    std::memset(header.sections, 0, sizeof(header.sections));
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    pos = sizeof(header);
+  };
+  void section(const snapshot_section &id, const void *data,
+               const uint64_t &bytes) {
+    pad();
+    header.sections[id][0] = pos;
+    header.sections[id][1] = bytes;
+    if (bytes > 0)
+      out.write(static_cast<const char *>(data), bytes);
+    pos += bytes;
+  };
+  template <typename T>
+  void section(const snapshot_section &id, const column<T> &col) {
+    section(id, col.data(), col.size() * sizeof(T));
+  };
+  void finish() {
+    pad();
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.close();
+    if (!out) {
+      throw(std::runtime_error("Failed writing snapshot"));
+    }
+  };
+};
+
+// a mapped snapshot file, checked once on open. sections are handed out as
+// borrowed columns that stay valid as long as the image is alive
+class snapshot_image {
+private:
+  mapped_file file;
+
+public:
+  snapshot_header header;
+  snapshot_image(const std::string &fname, const uint64_t &sym_bits,
+                 const uint64_t &anno_bits)
+      : file(fname, false) {
+    if (file.size() < sizeof(header)) {
+      throw(std::runtime_error("Not a snapshot:" + fname));
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic))) {
+      throw(std::runtime_error("Not a snapshot:" + fname));
+    }
+    if (header.endian != snapshot_endian ||
+        header.version != snapshot_version) {
+      throw(std::runtime_error("Unsupported snapshot version:" + fname));
+    }
+    if (header.sym_bits != sym_bits || header.anno_bits != anno_bits) {
+      throw(std::runtime_error("Snapshot was saved with other mask sizes:" +
+                               fname));
+    }
+    for (const auto &sec : header.sections) {
+      if (sec[0] % snapshot_align || sec[0] > file.size() ||
+          sec[1] > file.size() - sec[0]) {
+        throw(std::runtime_error("Corrupt snapshot:" + fname));
+      }
+    }
+  };
+  template <typename T>
+  column<T> section(const snapshot_section &id, const uint64_t &n) const {
+    const uint64_t bytes = header.sections[id][1];
+    if (bytes != n * sizeof(T)) {
+      throw(std::runtime_error("Corrupt snapshot section"));
+    }
+    return column<T>::borrow(
+        reinterpret_cast<const T *>(file.data() + header.sections[id][0]), n);
+  };
+  template <typename T> uint64_t count(const snapshot_section &id) const {
+    return header.sections[id][1] / sizeof(T);
+  };
+};
+#endif
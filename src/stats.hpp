@@ -1,7 +1,14 @@
 #ifndef STATS
 #define STATS
+#include "background.hpp"
 #include "data.hpp"
+#include "hypergeom.hpp"
+#include "parallel.hpp"
+#include "profile.hpp"
+#include "results.hpp"
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <string>
 #include <vector>
 
@@ -27,6 +34,51 @@ constexpr double fisher_t(const unsigned &a, const unsigned &b,
   return ans;
 }
 
+// exact Fisher p-values from the log space hypergeometric engine, with the
+// same signature as fisher_t so they fit the ab_test statistic slot.
+// greater tests for over representation of the top left cell, less for
+// under representation
+inline double fisher_p(const unsigned &a, const unsigned &b, const unsigned &c,
+                       const unsigned &d) {
+  return std::exp(hypergeom(a, b, c, d).log_two_sided(a));
+}
+inline double fisher_p_greater(const unsigned &a, const unsigned &b,
+                               const unsigned &c, const unsigned &d) {
+  return std::exp(hypergeom(a, b, c, d).log_greater(a));
+}
+inline double fisher_p_less(const unsigned &a, const unsigned &b,
+                            const unsigned &c, const unsigned &d) {
+  return std::exp(hypergeom(a, b, c, d).log_less(a));
+}
+
+// a lower bound of all three Fisher p-values: each one sums the observed
+// table's own probability with others, so it is at least P(X = a) (less a
+// little slack for rounding). one log_pmf instead of a tail walk, which is
+// enough to skip most tables that cannot make the cut
+inline double fisher_p_bound(const unsigned &a, const unsigned &b,
+                             const unsigned &c, const unsigned &d) {
+  return std::exp(hypergeom(a, b, c, d).log_pmf(a)) * (1 - 1e-9);
+}
+
+// maps a statistic to a cheap lower bound of it, if it has one. prunable
+// says whether value is set, without comparing a function pointer
+template <decltype(fisher_t) fn> struct stat_bound {
+  static constexpr bool prunable = false;
+  static constexpr decltype(fisher_t) *value = nullptr;
+};
+template <> struct stat_bound<fisher_p> {
+  static constexpr bool prunable = true;
+  static constexpr decltype(fisher_t) *value = fisher_p_bound;
+};
+template <> struct stat_bound<fisher_p_greater> {
+  static constexpr bool prunable = true;
+  static constexpr decltype(fisher_t) *value = fisher_p_bound;
+};
+template <> struct stat_bound<fisher_p_less> {
+  static constexpr bool prunable = true;
+  static constexpr decltype(fisher_t) *value = fisher_p_bound;
+};
+
 constexpr double fold_change(const unsigned &_a, const unsigned &_b,
                              const unsigned &_c, const unsigned &_d) {
   double ans = 1.0;
@@ -53,140 +105,378 @@ constexpr bool descending(const test_result &a, const test_result &b) {
   return a.stat > b.stat;
 }
 
+// whether smaller stats are better under cmp, which a lower bound needs
+template <decltype(ascending) cmp> struct lower_is_better {
+  static constexpr bool value = false;
+};
+template <> struct lower_is_better<ascending> {
+  static constexpr bool value = true;
+};
+
+// results a test keeps by default, and the threshold value meaning "none"
+constexpr unsigned default_top_k = 1000;
+constexpr double no_threshold = std::numeric_limits<double>::quiet_NaN();
+
+// bounded selection of the k best results under cmp, optionally only those
+// at least as good as threshold. ties are broken by annotation index, so
+// the survivors do not depend on the order results arrive in
+template <decltype(ascending) cmp> class top_k {
+private:
+  // a heap whose front is the worst result kept
+  std::vector<test_result> heap;
+  unsigned k;
+  double threshold;
+
+  static bool better(const test_result &a, const test_result &b) {
+    if (cmp(a, b))
+      return true;
+    if (cmp(b, a))
+      return false;
+    return a.anno < b.anno;
+  };
+
+public:
+  top_k(const unsigned &k = default_top_k,
+        const double &threshold = no_threshold)
+      : k(k), threshold(threshold){};
+  // true if a result with this stat for annotation idx would not be kept,
+  // always with k = 0
+  bool prunes(const double &stat, const unsigned &idx) const {
+    if (k == 0)
+      return true;
+    const test_result res = {idx, stat, false};
+    if (!std::isnan(threshold) && cmp({idx, threshold, false}, res))
+      return true;
+    return heap.size() >= k && !better(res, heap.front());
+  };
+  void push(const test_result &res) {
+    if (prunes(res.stat, res.anno))
+      return;
+    if (heap.size() == k) {
+      std::pop_heap(heap.begin(), heap.end(), better);
+      heap.pop_back();
+    }
+    heap.push_back(res);
+    std::push_heap(heap.begin(), heap.end(), better);
+  };
+  void merge(const top_k &other) {
+    for (const auto &res : other.heap) {
+      push(res);
+    }
+  };
+  // the kept results, best first
+  std::vector<test_result> take() {
+    std::sort_heap(heap.begin(), heap.end(), better);
+    std::vector<test_result> out = std::move(heap);
+    heap.clear();
+    return out;
+  };
+};
+
+// the 2x2 table of one annotation as laid out for fn, with its direction
+struct anno_table {
+  unsigned anno, a, b, c, d;
+  bool enriched;
+};
+
+// scores table(j) for every j in [0, n) and keeps the best k that pass gn
+// (and the threshold). p-value statistics with a lower bound skip the
+// exact test whenever the bound alone cannot make the cut. with more than
+// one thread the index space is split in blocks that are work stolen
+// between workers, each keeping its own top k, and merged at the end;
+// the selection is the same for any thread count
+template <decltype(fisher_t) fn, decltype(fold_1) gn, decltype(ascending) cmp,
+          typename T>
+std::vector<test_result> select_annos(const unsigned &n,
+                                      const unsigned &threads,
+                                      const unsigned &k,
+                                      const double &threshold, T &&table) {
+  ENRICHED_PHASE(phase_stats);
+  ENRICHED_COUNT(prof_annos_scanned, n);
+  auto score = [&](top_k<cmp> &keep, const unsigned &begin,
+                   const unsigned &end) {
+    uint64_t skipped = 0;
+    for (unsigned j = begin; j < end; ++j) {
+      const anno_table t = table(j);
+      if constexpr (stat_bound<fn>::prunable &&
+                    lower_is_better<cmp>::value) {
+        const double best = stat_bound<fn>::value(t.a, t.b, t.c, t.d);
+        if (gn({t.anno, best, t.enriched}) ||
+            keep.prunes(best, t.anno)) {
+          ++skipped;
+          continue;
+        }
+      }
+      const test_result res = {t.anno, fn(t.a, t.b, t.c, t.d), t.enriched};
+      if (!gn(res))
+        keep.push(res);
+    }
+    ENRICHED_COUNT(prof_annos_skipped, skipped);
+  };
+  top_k<cmp> keep(k, threshold);
+  if (resolve_threads(threads) == 1) {
+    score(keep, 0, n);
+  } else {
+    const unsigned block = block_size(n, threads);
+    std::vector<top_k<cmp>> blocks((n + block - 1) / block,
+                                   top_k<cmp>(k, threshold));
+    parallel_blocks(n, block, threads,
+                    [&](const unsigned &b, const unsigned &begin,
+                        const unsigned &end) { score(blocks[b], begin, end); });
+    for (const auto &b : blocks) {
+      keep.merge(b);
+    }
+  }
+  auto out = keep.take();
+  ENRICHED_COUNT(prof_results, out.size());
+  return out;
+}
+
 template <typename S, typename D, decltype(fisher_t) fn, decltype(fold_1) gn,
           decltype(ascending) cmp>
 void ab_test(const S &test_set, const S &control_set, const D &dataset,
-             ResultDataset &rout, std::string test_name = "fisher") {
-  std::vector<test_result> out;
-  // 1, get all hot annotations from test set
-  auto hot_mask = test_set.get_mapped_mask();
-  auto test_mask = test_set.get_mask(), control_mask = control_set.get_mask();
-  unsigned total_test = test_mask->count(),
-           total_control = control_mask->count();
-  // 2, for each annotation
-  for (unsigned i = 0; i < hot_mask->size(); ++i) {
-    if (!hot_mask->test(i))
-      continue;
-    // 3, build contingency table
-    const auto anno = dataset.get_anno(i);
-    auto total_mask = anno->get_mask();
-    test_mask = test_set.get_mask(), control_mask = control_set.get_mask();
-    test_mask->operator&=(*total_mask);
-    control_mask->operator&=(*total_mask);
-    unsigned test_count = test_mask->count(),
-             control_count = control_mask->count();
-    // no 4, add test statistics by calling fn
-    double stat = fn(test_count, control_count, total_test - test_count,
-                     total_control - control_count);
-    bool enriched = (static_cast<double>(test_count)) /
-                        (static_cast<double>(total_test) + 1) >
-                    (static_cast<double>(control_count)) /
-                        (static_cast<double>(total_control) + 1);
-    out.push_back({anno->data.name, stat, enriched});
-  }
-  out.erase(std::remove_if(out.begin(), out.end(), gn), out.end());
-  std::sort(out.begin(), out.end(), cmp);
-  out.resize(std::min(out.size(), (size_t)1000));
-  rout.add(test_name, out);
+             ResultDataset &rout, std::string test_name = "fisher",
+             const unsigned &threads = 1,
+             const unsigned &k = default_top_k,
+             const double &threshold = no_threshold) {
+  // 1, count every annotation hit by either set by walking their edges
+  const auto test = dataset.count_set(test_set, threads);
+  const auto control = dataset.count_set(control_set, threads);
+  unsigned total_test = test.total, total_control = control.total;
+  // 2, for each hot annotation of the test set
+  auto out = select_annos<fn, gn, cmp>(
+      test.hot.size(), threads, k, threshold,
+      [&](const unsigned &j) {
+        // 3, build contingency table
+        const unsigned i = test.hot[j];
+        unsigned test_count = test.counts[i],
+                 control_count = control.counts[i];
+        // no 4, fn is applied to it by select_annos
+        bool enriched = (static_cast<double>(test_count)) /
+                            (static_cast<double>(total_test) + 1) >
+                        (static_cast<double>(control_count)) /
+                            (static_cast<double>(total_control) + 1);
+        return anno_table{i, test_count, control_count,
+                          total_test - test_count,
+                          total_control - control_count, enriched};
+      });
+  rout.add(test_name, out, dataset);
   return;
 }
 
-template <typename S, typename D, decltype(fisher_t) fn, decltype(fold_1) gn,
+// the table of annotation i for a set of counts against the rest of the
+// dataset
+template <typename D>
+anno_table rest_table(const anno_counts &test, const D &dataset,
+                      const unsigned &i) {
+  unsigned total_test = test.total, total_control = dataset.total_syms();
+  unsigned test_count = test.counts[i], total_count = dataset.anno_size(i);
+  bool enriched = (static_cast<double>(test_count)) /
+                      (static_cast<double>(total_test) + 1) >
+                  (static_cast<double>(total_count)) /
+                      (static_cast<double>(total_control) + 1);
+  return anno_table{i, test_count, total_count - test_count,
+                    total_test - test_count,
+                    total_control - total_test - total_count + test_count,
+                    enriched};
+}
+
+// scores the hot annotations of one set of counts against the rest of the
+// dataset and keeps the best k
+template <typename D, decltype(fisher_t) fn, decltype(fold_1) gn,
           decltype(ascending) cmp>
-void ab_test(const S &test_set, const D &dataset, ResultDataset &rout,
-             std::string test_name = "fisher") {
-  std::vector<test_result> out;
-  // 1, get all hot annotations from test set
-  auto hot_mask = test_set.get_mapped_mask();
-  auto test_mask = test_set.get_mask();
-  unsigned total_test = test_mask->count(),
-           total_control = dataset.total_syms();
+std::vector<test_result> score_counts(const anno_counts &test,
+                                      const D &dataset,
+                                      const unsigned &threads = 1,
+                                      const unsigned &k = default_top_k,
+                                      const double &threshold = no_threshold) {
   // 2, for each annotation, generally speaking if the annotation is not
   // in test set, we are not interested either way
-  for (unsigned i = 0; i < hot_mask->size(); ++i) {
-    if (!hot_mask->test(i))
-      continue;
-    // 3, build contingency table
-    const auto anno = dataset.get_anno(i);
-    test_mask = test_set.get_mask();
-    auto total_mask = anno->get_mask();
-    test_mask->operator&=(*total_mask);
-    unsigned test_count = test_mask->count(), total_count = total_mask->count();
-    // no 4, add test statistics by calling fn
-    double stat = fn(test_count, total_count, total_test - test_count,
-                     total_control - test_count);
-    bool enriched = (static_cast<double>(test_count)) /
-                        (static_cast<double>(total_test) + 1) >
-                    (static_cast<double>(total_count)) /
-                        (static_cast<double>(total_control) + 1);
-    out.push_back({anno->data.name, stat, enriched});
+  return select_annos<fn, gn, cmp>(
+      test.hot.size(), threads, k, threshold,
+      [&](const unsigned &j) {
+        // 3, build contingency table
+        return rest_table(test, dataset, test.hot[j]);
+      });
+}
+
+template <typename S, typename D, decltype(fisher_t) fn, decltype(fold_1) gn,
+          decltype(ascending) cmp>
+void ab_test(const S &test_set, const D &dataset, ResultDataset &rout,
+             std::string test_name = "fisher", const unsigned &threads = 1,
+             const unsigned &k = default_top_k,
+             const double &threshold = no_threshold) {
+  // 1, count all hot annotations from test set in one pass over its edges
+  const auto test = dataset.count_set(test_set, threads);
+  rout.add(test_name,
+           score_counts<D, fn, gn, cmp>(test, dataset, threads, k, threshold),
+           dataset);
+  return;
+}
+
+// the single set test against a custom universe: the test set is cut down
+// to the universe and scored against the in universe annotation sizes the
+// background already holds
+template <typename S, typename D, decltype(fisher_t) fn, decltype(fold_1) gn,
+          decltype(ascending) cmp>
+void ab_test(const S &test_set, const Background<D> &background,
+             ResultDataset &rout, std::string test_name = "fisher",
+             const unsigned &threads = 1,
+             const unsigned &k = default_top_k,
+             const double &threshold = no_threshold) {
+  const auto test = background.count_set(test_set, threads);
+  rout.add(test_name,
+           score_counts<Background<D>, fn, gn, cmp>(test, background, threads,
+                                                    k, threshold),
+           background.dataset());
+  return;
+}
+
+// scores many index sets against one dataset: the whole sets x annotations
+// count matrix is built in one batched pass, then each set is scored on its
+// own worker and added as its own section, in input order
+template <typename D, decltype(fisher_t) fn, decltype(fold_1) gn,
+          decltype(ascending) cmp>
+void ab_test_batch(const std::vector<std::vector<unsigned>> &sets,
+                   const D &dataset, ResultDataset &rout,
+                   std::string test_name = "fisher",
+                   const unsigned &threads = 1,
+                   const unsigned &k = default_top_k,
+                   const double &threshold = no_threshold) {
+  const auto counts = dataset.count_batch(sets, threads);
+  std::vector<std::vector<test_result>> res(sets.size());
+  parallel_blocks(sets.size(), block_size(sets.size(), threads, 1), threads,
+                  [&](const unsigned &, const unsigned &begin,
+                      const unsigned &end) {
+                    for (unsigned i = begin; i < end; ++i) {
+                      res[i] = score_counts<D, fn, gn, cmp>(
+                          counts[i], dataset, 1, k, threshold);
+                    }
+                  });
+  for (unsigned i = 0; i < sets.size(); ++i) {
+    rout.add(test_name + " #" + std::to_string(i + 1), res[i], dataset);
   }
-  out.erase(std::remove_if(out.begin(), out.end(), gn), out.end());
-  std::sort(out.begin(), out.end(), cmp);
-  out.resize(std::min(out.size(), (size_t)1000));
-  rout.add(test_name, out);
   return;
 }
 
 template <typename S, typename D, decltype(fisher_t) fn, decltype(fold_1) gn,
           decltype(ascending) cmp>
 void ab_test_full(const S &test_set, const D &dataset, ResultDataset &rout,
-                  std::string test_name = "fisher") {
-  std::vector<test_result> out;
-  // 1, get all hot annotations from test set
-  auto hot_mask = test_set.get_mapped_mask();
-  auto test_mask = test_set.get_mask();
-  unsigned total_test = test_mask->count(),
-           total_control = dataset.total_syms();
+                  std::string test_name = "fisher",
+                  const unsigned &threads = 1,
+                  const unsigned &k = default_top_k,
+                  const double &threshold = no_threshold) {
+  // 1, count all hot annotations from test set in one pass over its edges
+  const auto test = dataset.count_set(test_set, threads);
   // 2, for each annotation in all possible annotations (to find negatively
-  // enriched)
-  for (unsigned i = 0; i < dataset.total_annos(); ++i) {
-    // 3, build contingency table
-    const auto anno = dataset.get_anno(i);
-    test_mask = test_set.get_mask();
-    auto total_mask = anno->get_mask();
-    test_mask->operator&=(*total_mask);
-    unsigned test_count = test_mask->count(), total_count = total_mask->count();
-    // no 4, add test statistics by calling fn
-    double stat = fn(test_count, total_count, total_test - test_count,
-                     total_control - test_count);
-    bool enriched = (static_cast<double>(test_count)) /
-                        (static_cast<double>(total_test) + 1) >
-                    (static_cast<double>(total_count)) /
-                        (static_cast<double>(total_control) + 1);
-    out.push_back({anno->data.name, stat, enriched});
-  }
-  out.erase(std::remove_if(out.begin(), out.end(), gn), out.end());
-  std::sort(out.begin(), out.end(), cmp);
-  out.resize(std::min(out.size(), (size_t)1000));
-  rout.add(test_name, out);
+  // enriched); most of them are dropped on their margins alone
+  auto out = select_annos<fn, gn, cmp>(
+      dataset.total_annos(), threads, k, threshold,
+      [&](const unsigned &i) {
+        // 3, build contingency table
+        return rest_table(test, dataset, i);
+      });
+  rout.add(test_name, out, dataset);
   return;
 }
 
 template <typename S, typename D>
-void fisher_test(const S &test_set, const D &dataset,
-                 ResultDataset &res) { //$17 return type auto
-  ab_test<S, D, fisher_t, stat_sig_05, ascending>(
-      test_set, dataset, res, "Fisher's Exact Test (P <= 0.05)");
+void fisher_test(const S &test_set, const D &dataset, ResultDataset &res,
+                 const unsigned &threads = 1) { //$17 return type auto
+  ab_test<S, D, fisher_p, stat_sig_05, ascending>(
+      test_set, dataset, res, "Fisher's Exact Test (P <= 0.05)", threads);
 }
 
 template <typename S, typename D>
 void fisher_test_ab(const S &test_set, const S &control_set, const D &dataset,
-                 ResultDataset &res) {
-  ab_test<S, D, fisher_t, stat_sig_05, ascending>(
-      test_set, control_set, dataset, res, "Fisher's Exact Test (P <= 0.05)");
+                 ResultDataset &res, const unsigned &threads = 1) {
+  ab_test<S, D, fisher_p, stat_sig_05, ascending>(
+      test_set, control_set, dataset, res, "Fisher's Exact Test (P <= 0.05)",
+      threads);
 }
 
 template <typename S, typename D>
-void fold_change_test(const S &test_set, const D &dataset, ResultDataset &res) {
-  ab_test<S, D, fold_change, fold_1, descending>(test_set, dataset, res,
-                                                 "Fold Change (Fold > 1)");
+void fisher_test_bg(const S &test_set, const Background<D> &background,
+                    ResultDataset &res, const unsigned &threads = 1) {
+  ab_test<S, D, fisher_p, stat_sig_05, ascending>(
+      test_set, background, res, "Fisher's Exact Test (P <= 0.05)", threads);
+}
+
+// batch versions take the sets either as SymSets or as raw symbol lists
+template <typename S>
+std::vector<std::vector<unsigned>> batch_idxs(const std::vector<S> &sets) {
+  std::vector<std::vector<unsigned>> out;
+  out.reserve(sets.size());
+  for (const auto &set : sets) {
+    out.push_back(set.get_idxs());
+  }
+  return out;
+}
+
+template <typename D>
+std::vector<std::vector<unsigned>>
+batch_idxs(const std::vector<std::vector<std::string>> &sets,
+           const D &dataset) {
+  std::vector<std::vector<unsigned>> out;
+  out.reserve(sets.size());
+  for (const auto &set : sets) {
+    out.push_back(dataset.sym_idxs(set));
+  }
+  return out;
+}
+
+template <typename S, typename D>
+void fisher_test_batch(const std::vector<S> &sets, const D &dataset,
+                       ResultDataset &res, const unsigned &threads = 1) {
+  ab_test_batch<D, fisher_p, stat_sig_05, ascending>(
+      batch_idxs(sets), dataset, res, "Fisher's Exact Test (P <= 0.05)",
+      threads);
+}
+
+template <typename D>
+void fisher_test_batch(const std::vector<std::vector<std::string>> &sets,
+                       const D &dataset, ResultDataset &res,
+                       const unsigned &threads = 1) {
+  ab_test_batch<D, fisher_p, stat_sig_05, ascending>(
+      batch_idxs(sets, dataset), dataset, res,
+      "Fisher's Exact Test (P <= 0.05)", threads);
+}
+
+template <typename S, typename D>
+void fold_change_test_batch(const std::vector<S> &sets, const D &dataset,
+                            ResultDataset &res, const unsigned &threads = 1) {
+  ab_test_batch<D, fold_change, fold_1, descending>(
+      batch_idxs(sets), dataset, res, "Fold Change (Fold > 1)", threads);
+}
+
+template <typename D>
+void fold_change_test_batch(const std::vector<std::vector<std::string>> &sets,
+                            const D &dataset, ResultDataset &res,
+                            const unsigned &threads = 1) {
+  ab_test_batch<D, fold_change, fold_1, descending>(
+      batch_idxs(sets, dataset), dataset, res, "Fold Change (Fold > 1)",
+      threads);
+}
+
+template <typename S, typename D>
+void fold_change_test(const S &test_set, const D &dataset, ResultDataset &res,
+                      const unsigned &threads = 1) {
+  ab_test<S, D, fold_change, fold_1, descending>(
+      test_set, dataset, res, "Fold Change (Fold > 1)", threads);
 }
 
 template <typename S, typename D>
 void fold_change_test_ab(const S &test_set, const S &control_set, const D &dataset,
-                      ResultDataset &res) {
+                      ResultDataset &res, const unsigned &threads = 1) {
   ab_test<S, D, fold_change, fold_1, descending>(test_set, control_set, dataset,
-                                                 res, "Fold Change (Fold > 1)");
+                                                 res, "Fold Change (Fold > 1)",
+                                                 threads);
+}
+
+template <typename S, typename D>
+void fold_change_test_bg(const S &test_set, const Background<D> &background,
+                         ResultDataset &res, const unsigned &threads = 1) {
+  ab_test<S, D, fold_change, fold_1, descending>(
+      test_set, background, res, "Fold Change (Fold > 1)", threads);
 }
-#endif
\ No newline at end of file
+#endif
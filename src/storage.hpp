@@ -0,0 +1,241 @@
+#ifndef STORAGE
+#define STORAGE
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#define ENRICHED_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// read only view of a whole file. it is memory mapped where the platform
+// has mmap, elsewhere the file is read into one buffer
+class mapped_file {
+private:
+  const char *addr = nullptr;
+  size_t len = 0;
+  std::string buffer;
+
+public:
+  explicit mapped_file(const std::string &fname,
+                       const bool &sequential = true) {
+#ifdef ENRICHED_MMAP
+    const int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw(std::runtime_error("Wrong filename provided:" + fname));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw(std::runtime_error("Cannot stat file:" + fname));
+    }
+    len = static_cast<size_t>(st.st_size);
+    if (len > 0) {
+      void *p = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        ::close(fd);
+        throw(std::runtime_error("Cannot map file:" + fname));
+      }
+      if (sequential)
+        ::madvise(p, len, MADV_SEQUENTIAL);
+      addr = static_cast<const char *>(p);
+    }
+    ::close(fd);
+#else
+    std::ifstream ifs(fname, std::ios::binary);
+    if (!ifs.is_open()) {
+      throw(std::runtime_error("Wrong filename provided:" + fname));
+    }
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    buffer = ss.str();
+    addr = buffer.data();
+    len = buffer.size();
+#endif
+  };
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file() {
+#ifdef ENRICHED_MMAP
+    if (addr && len > 0)
+      ::munmap(const_cast<char *>(addr), len);
+#endif
+  };
+  const char *data() const { return addr; };
+  size_t size() const { return len; };
+  std::string_view view() const { return {addr, len}; };
+};
+
+// a contiguous array that either owns its elements or borrows them from
+// memory someone else keeps alive, such as a mapped snapshot. the query
+// paths only ever see a pointer and a size. owned elements sit in a buffer
+// shared by every copy, so copying a column is O(1) and copies are how
+// Dataset versions share their unchanged parts:
+//   append writes past the end in place while the buffer has room and no
+//   other copy appended first, else it moves to a new, larger buffer;
+//   copies still reading the old one keep it alive and never look past
+//   their own size
+//   set copies the buffer first unless this column is its only user
+template <typename T> class column {
+private:
+  std::shared_ptr<std::vector<T>> owned;
+  const T *ptr = nullptr;
+  size_t len = 0;
+
+  void _grow(const size_t &n) {
+    auto next = std::make_shared<std::vector<T>>();
+    next->reserve(n ? std::max(len + n, 2 * len) : len);
+    next->assign(ptr, ptr + len);
+    owned = std::move(next);
+  };
+
+public:
+  column() = default;
+  column(std::vector<T> &&v)
+      : owned(std::make_shared<std::vector<T>>(std::move(v))) {
+    ptr = owned->data();
+    len = owned->size();
+  };
+  column(const column &other) = default;
+  column(column &&other) noexcept
+      : owned(std::move(other.owned)), ptr(other.ptr), len(other.len) {
+    other.ptr = nullptr;
+    other.len = 0;
+  };
+  column &operator=(const column &other) = default;
+  column &operator=(column &&other) noexcept {
+    owned = std::move(other.owned);
+    ptr = other.ptr;
+    len = other.len;
+    other.ptr = nullptr;
+    other.len = 0;
+    return *this;
+  };
+  static column borrow(const T *p, const size_t &n) {
+    column out;
+    out.ptr = p;
+    out.len = n;
+    return out;
+  };
+  bool is_borrowed() const { return !owned || ptr != owned->data(); };
+  const T &operator[](const size_t &i) const { return ptr[i]; };
+  const T *data() const { return ptr; };
+  size_t size() const { return len; };
+  bool empty() const { return len == 0; };
+  const T *begin() const { return ptr; };
+  const T *end() const { return ptr + len; };
+  void clear() { *this = column(); };
+  void append(const T *p, const size_t &n) {
+    if (is_borrowed() || owned->size() != len ||
+        owned->capacity() < len + n)
+      _grow(n);
+    owned->insert(owned->end(), p, p + n);
+    ptr = owned->data();
+    len = owned->size();
+  };
+  void push_back(const T &v) { append(&v, 1); };
+  void set(const size_t &i, const T &v) {
+    if (is_borrowed() || owned.use_count() > 1)
+      _grow(0);
+    (*owned)[i] = v;
+    ptr = owned->data();
+  };
+};
+
+// stable 64 bit hash of an id. it is stored in snapshots, so unlike
+// std::hash it must not change between builds or platforms
+inline uint64_t hash_id(const std::string_view &key) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char &c : key) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// open addressing id -> index table. a slot holds the upper 32 bits of the
+// key hash and index + 1 (0 marks an empty slot); the keys themselves are
+// not stored but looked up through key_of(index), so the table is a single
+// flat array that can be saved and mapped as is. lookups take any
+// std::string_view and cost one probe sequence, no temporary strings
+class id_table {
+private:
+  column<uint64_t> slots;
+  size_t used = 0;
+
+  static constexpr uint64_t tag_mask = 0xffffffff00000000ULL;
+  static size_t _place(std::vector<uint64_t> &out, const uint64_t &h,
+                       const unsigned &idx) {
+    const size_t mask = out.size() - 1;
+    size_t pos = h & mask;
+    while (out[pos] != 0)
+      pos = (pos + 1) & mask;
+    out[pos] = (h & tag_mask) | (static_cast<uint64_t>(idx) + 1);
+    return pos;
+  };
+
+public:
+  static constexpr unsigned npos = ~0u;
+  id_table() = default;
+  explicit id_table(column<uint64_t> &&s) : slots(std::move(s)) {
+    for (const uint64_t &slot : slots) {
+      used += slot != 0;
+    }
+  };
+  template <typename K>
+  unsigned find(const std::string_view &key, K &&key_of) const {
+    if (slots.empty())
+      return npos;
+    const size_t mask = slots.size() - 1;
+    const uint64_t h = hash_id(key), tag = h & tag_mask;
+    for (size_t pos = h & mask;; pos = (pos + 1) & mask) {
+      const uint64_t slot = slots[pos];
+      if (slot == 0)
+        return npos;
+      if ((slot & tag_mask) == tag) {
+        const unsigned idx = static_cast<unsigned>(slot & 0xffffffffu) - 1;
+        if (key_of(idx) == key)
+          return idx;
+      }
+    }
+  };
+  // adds idx, whose key_of(idx) must not be in the table yet. the table
+  // doubles, rehashing through key_of, whenever it would get over half full
+  template <typename K> void insert(const unsigned &idx, K &&key_of) {
+    if (2 * (used + 1) > slots.size()) {
+      std::vector<uint64_t> out(std::max<size_t>(8, 2 * slots.size()), 0);
+      for (const uint64_t &slot : slots) {
+        if (slot != 0) {
+          const unsigned i = static_cast<unsigned>(slot & 0xffffffffu) - 1;
+          _place(out, hash_id(key_of(i)), i);
+        }
+      }
+      slots = column<uint64_t>(std::move(out));
+    }
+    const uint64_t h = hash_id(key_of(idx));
+    const size_t mask = slots.size() - 1;
+    size_t pos = h & mask;
+    while (slots[pos] != 0)
+      pos = (pos + 1) & mask;
+    slots.set(pos, (h & tag_mask) | (static_cast<uint64_t>(idx) + 1));
+    ++used;
+  };
+  size_t size() const { return used; };
+  const column<uint64_t> &data() const { return slots; };
+};
+#endif
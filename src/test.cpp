@@ -0,0 +1,2120 @@
+#include "pch.h"
+#include "server.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// behaviour tests over small hand made datasets, built like main, server
+// and bench:
+//
+//   test [name ...]
+//
+// runs every test, or only the named ones, and prints one line per failed
+// check. the exit code is 1 if any check failed. build it once more with
+// -DENRICHED_PROFILE to check the profile counters
+
+static unsigned checks = 0, failures = 0;
+
+static void check(const bool &ok, const std::string &what) {
+  ++checks;
+  if (!ok) {
+    ++failures;
+    std::printf("FAIL %s\n", what.c_str());
+  }
+}
+
+// allocations are counted by replacing the global operator new, as bench
+// does, so a test can check that a path allocates nothing
+static std::atomic<size_t> alloc_count{0};
+
+void *operator new(size_t n) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+void operator delete(void *p) noexcept {
+  std::free(p);
+}
+void operator delete(void *p, std::size_t) noexcept { ::operator delete(p); }
+
+// a small deterministic generator for the test inputs
+struct test_rng {
+  uint64_t state;
+  explicit test_rng(const uint64_t &seed) : state(seed){};
+  uint64_t next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  };
+};
+
+// every kernel this cpu runs against the scalar one, over all lengths up
+// to 300 words and every starting offset within a 64 byte line
+static void test_kernels() {
+  const auto kernels = popcount_kernels::available();
+  const auto &scalar = popcount_kernels::scalar();
+  test_rng rng(42);
+  std::vector<uint64_t> a(400), b(400), c(400);
+  for (size_t i = 0; i < a.size(); ++i) {
+    a[i] = rng.next();
+    b[i] = rng.next() | rng.next();
+    c[i] = rng.next() & rng.next();
+  }
+  a[17] = b[17] = c[17] = ~uint64_t(0);
+  for (const auto &k : kernels) {
+    bool same = true;
+    for (size_t offset = 0; offset < 8; ++offset) {
+      for (size_t n = 0; n <= 300; ++n) {
+        const uint64_t *x = a.data() + offset, *y = b.data() + 7 - offset,
+                       *z = c.data() + (offset * 3) % 8;
+        same &= k.and2(x, y, n) == scalar.and2(x, y, n) &&
+                k.and3(x, y, z, n) == scalar.and3(x, y, z, n);
+      }
+    }
+    check(same, std::string("kernel ") + k.name + " matches scalar");
+  }
+  check(popcount_and(a.data(), b.data(), 300) ==
+            scalar.and2(a.data(), b.data(), 300),
+        "dispatched popcount_and matches scalar");
+}
+
+typedef Dataset<symbol16, annotation16> test_dataset;
+typedef SymSet<symbol16, annotation16> test_set;
+
+// symbols s0..s19; A holds s0..s4, B holds s5..s19
+static test_dataset two_terms(const unsigned &masks = dense_masks) {
+  test_dataset d;
+  d.add_anno("A", "a", "");
+  d.add_anno("B", "b", "");
+  for (unsigned i = 0; i < 20; ++i) {
+    d.add_sym("s" + std::to_string(i), "s", {i < 5 ? "A" : "B"});
+  }
+  d.gen_mappings(masks);
+  return d;
+}
+
+// six genes over three terms: A {g1, g2, g6}, B {g1, g3}, C {g3, g4, g6};
+// g5 has no terms
+static test_dataset six_genes(const unsigned &masks = dense_masks) {
+  test_dataset d;
+  d.add_anno("A", "a", "");
+  d.add_anno("B", "b", "");
+  d.add_anno("C", "c", "");
+  d.add_sym("g1", "g", {"A", "B"});
+  d.add_sym("g2", "g", {"A"});
+  d.add_sym("g3", "g", {"B", "C"});
+  d.add_sym("g4", "g", {"C"});
+  d.add_sym("g5", "g");
+  d.add_sym("g6", "g", {"C", "A"});
+  d.gen_mappings(masks);
+  return d;
+}
+
+static std::string mask_name(const unsigned &masks) {
+  return " (masks " + std::to_string(masks) + ")";
+}
+
+// the same rows in the same order
+static bool same_rows(const ResultDataset &x, const ResultDataset &y) {
+  if (x.size() != y.size())
+    return false;
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (x.anno(i) != y.anno(i) || x.stat(i) != y.stat(i) ||
+        x.is_enriched(i) != y.is_enriched(i))
+      return false;
+  }
+  return true;
+}
+
+// per annotation counts of a test set by every counting path
+static void test_counts() {
+  for (const unsigned masks :
+       {no_masks, dense_masks, compressed_masks, all_masks}) {
+    const test_dataset d = six_genes(masks);
+    const std::string tag = mask_name(masks);
+    check(d.anno_size(0) == 3 && d.anno_size(1) == 2 && d.anno_size(2) == 3,
+          "annotation sizes" + tag);
+    const idx_span row = d.sym_row(5);
+    check(std::vector<unsigned>(row.begin(), row.end()) ==
+              std::vector<unsigned>({0, 2}),
+          "symbol row sorted" + tag);
+    const test_set set({"g1", "g2", "g4", "g5", "nope"}, d);
+    const std::vector<unsigned> want = {2, 1, 1}, hot = {0, 1, 2};
+    const auto walked = d.count_annos(set.get_idxs());
+    check(walked.counts == want && walked.hot == hot && walked.total == 4,
+          "counts from the index" + tag);
+    const auto picked = d.count_set(set);
+    check(picked.counts == want && picked.total == 4,
+          "counts from count_set" + tag);
+    if (d.has_masks()) {
+      const auto dense = d.count_annos(set.get_mask_ref());
+      check(dense.counts == want && dense.total == 4,
+            "counts from a dense mask" + tag);
+    }
+    if (d.has_compressed_masks()) {
+      const auto compressed = d.count_annos(set.get_compressed_ref());
+      check(compressed.counts == want && compressed.total == 4,
+            "counts from a compressed mask" + tag);
+    }
+    const auto batch = d.count_batch({set.get_idxs(), {5}, {}});
+    check(batch.size() == 3 && batch[0].counts == want &&
+              batch[1].counts == std::vector<unsigned>({1, 0, 1}) &&
+              batch[2].hot.empty(),
+          "counts from count_batch" + tag);
+    // a raw list with repeats counts each symbol once on every path
+    const std::vector<unsigned> twice = {4, 0, 1, 0, 3, 4};
+    const auto repeated = d.count_annos(twice);
+    const auto repeated_batch = d.count_batch({twice, twice});
+    check(repeated.counts == want && repeated.total == 4 &&
+              repeated_batch[1].counts == want &&
+              repeated_batch[1].total == 4,
+          "repeated indices count once" + tag);
+    ResultDataset once, batched;
+    fisher_test(set, d, once);
+    ab_test_batch<test_dataset, fisher_p, stat_sig_05, ascending>(
+        {twice}, d, batched);
+    check(same_rows(once, batched), "repeated indices in a batch" + tag);
+    bool refused = false;
+    try {
+      d.count_batch({{0}, {1, 6}});
+    } catch (const std::out_of_range &) {
+      refused = true;
+    }
+    check(refused, "out of range indices refused" + tag);
+  }
+}
+
+static bool near(const double &x, const double &want) {
+  return std::fabs(x - want) <= 1e-10 * std::fabs(want);
+}
+
+// Fisher p-values against exact values (R's fisher.test and the sums of
+// the hypergeometric terms), and through a whole test
+static void test_pvalues() {
+  check(near(fisher_p(3, 1, 1, 3), 34.0 / 70) &&
+            near(fisher_p_greater(3, 1, 1, 3), 17.0 / 70) &&
+            near(fisher_p_less(3, 1, 1, 3), 69.0 / 70),
+        "tea tasting p-values");
+  check(near(fisher_t(3, 1, 1, 3), 16.0 / 70), "table probability");
+  check(near(fisher_p(1, 9, 11, 3), 0.002759456185220083) &&
+            near(fisher_p_greater(1, 9, 11, 3), 0.9999663480953022),
+        "p-values of a small table");
+  check(near(fisher_p(10, 40, 90, 860), 0.02591612035928856) &&
+            near(fisher_p_greater(10, 40, 90, 860), 0.021440329381402473),
+        "p-values of a large table");
+  check(fisher_p_bound(10, 40, 90, 860) <= fisher_p(10, 40, 90, 860) &&
+            fisher_p_bound(1, 9, 11, 3) <= fisher_p_less(1, 9, 11, 3),
+        "p-value bound");
+  // all five symbols of A tested: 1 / C(20, 5); B is not hit
+  const test_dataset d = two_terms();
+  ResultDataset res;
+  fisher_test(test_set({"s0", "s1", "s2", "s3", "s4"}, d), d, res);
+  check(res.size() == 1 && res.anno(0) == 0 && res.is_enriched(0) &&
+            near(res.stat(0), 1.0 / 15504),
+        "fisher_test results");
+  // against every annotation B scores too, depleted by the same amount
+  ResultDataset full;
+  ab_test_full<test_set, test_dataset, fisher_p, stat_sig_05, ascending>(
+      test_set({"s0", "s1", "s2", "s3", "s4"}, d), d, full);
+  check(full.size() == 2 && full.anno(1) == 1 && !full.is_enriched(1) &&
+            near(full.stat(1), 1.0 / 15504),
+        "ab_test_full results");
+}
+
+// 300 terms over 120 symbols where term t holds the symbols s with
+// (s + t) % 6 < t % 6 + 1 and s < 60 + t % 5 * 12, so every term shares its
+// membership, and its p-value, with dozens of others
+static test_dataset tied_terms(const unsigned &masks = dense_masks) {
+  test_dataset d;
+  for (unsigned t = 0; t < 300; ++t) {
+    d.add_anno("t" + std::to_string(t), "t", "");
+  }
+  for (unsigned s = 0; s < 120; ++s) {
+    d.add_sym("s" + std::to_string(s), "s");
+  }
+  std::vector<std::pair<unsigned, unsigned>> edges;
+  for (unsigned t = 0; t < 300; ++t) {
+    for (unsigned s = 0; s < 60 + t % 5 * 12; ++s) {
+      if ((s + t) % 6 < t % 6 + 1)
+        edges.emplace_back(s, t);
+    }
+  }
+  d.add_edges(edges);
+  d.gen_mappings(masks);
+  return d;
+}
+
+// every test keeps the same rows, ties included, on any thread count
+static void test_threads() {
+  const test_dataset d = tied_terms();
+  std::vector<std::string> picked, control;
+  for (unsigned s = 0; s < 120; ++s) {
+    (s % 3 == 0 ? picked : control).push_back("s" + std::to_string(s));
+  }
+  const test_set set(picked, d), other(control, d);
+  auto run = [&](const unsigned &threads) {
+    ResultDataset res;
+    fisher_test(set, d, res, threads);
+    fold_change_test(set, d, res, threads);
+    for (const unsigned k : {default_top_k, 7u}) {
+      ab_test<test_set, test_dataset, fisher_p, stat_sig_05, ascending>(
+          set, other, d, res, "ab", threads, k);
+      ab_test_full<test_set, test_dataset, fisher_p, stat_sig_05, ascending>(
+          set, d, res, "full", threads, k);
+      ab_test<test_set, test_dataset, fold_change, fold_1, descending>(
+          set, d, res, "fold", threads, k);
+    }
+    return res;
+  };
+  const ResultDataset one = run(1);
+  bool tied = false;
+  for (size_t i = 1; i < one.size(); ++i) {
+    tied |= one.test(i) == one.test(i - 1) && one.stat(i) == one.stat(i - 1);
+  }
+  check(one.size() > 100 && tied, "tied results are kept");
+  for (const unsigned threads : {2u, 8u}) {
+    check(same_rows(one, run(threads)),
+          "results on " + std::to_string(threads) + " threads match one");
+  }
+}
+
+// the members of a compressed mask, ascending
+static std::vector<unsigned> members_of(const roaring_mask &mask) {
+  std::vector<unsigned> out;
+  mask.for_each([&](const unsigned &idx) { out.push_back(idx); });
+  return out;
+}
+
+// masks of a symbol set and an annotation set built on first use by eight
+// threads at once, some of them copying the set meanwhile, against masks
+// built directly from the members
+static void test_lazy_masks() {
+  typedef AnnoSet<symbol16, annotation16> test_annos;
+  const test_dataset d = tied_terms();
+  std::vector<std::string> picked;
+  for (unsigned s = 0; s < 120; s += 7) {
+    picked.push_back("s" + std::to_string(s));
+  }
+  const test_annos annos =
+      test_annos::from_idxs({299, 5, 3, 0, 3, 128, 5}, d);
+  check(annos.get_idxs() == std::vector<unsigned>({0, 3, 5, 128, 299}) &&
+            annos.size() == 5 && annos.contains(128) && !annos.contains(4),
+        "annotation set from raw indices");
+  bool refused = false;
+  try {
+    test_annos::from_idxs({1, 300}, d);
+  } catch (const std::out_of_range &) {
+    refused = true;
+  }
+  check(refused, "annotation index out of range");
+  auto race = [](const auto &set) {
+    auto direct = set.get_mask();
+    direct->reset();
+    for (const unsigned &idx : set.get_idxs())
+      direct->set(idx);
+    bool same = true;
+    for (unsigned round = 0; round < 20; ++round) {
+      const auto fresh = set;
+      std::vector<const void *> dense(8), compressed(8);
+      std::vector<char> ok(8);
+      std::vector<std::thread> pool;
+      for (unsigned w = 0; w < 8; ++w) {
+        pool.emplace_back([&, w] {
+          const auto copy = fresh;
+          const auto &m = w % 2 ? fresh.get_mask_ref() : copy.get_mask_ref();
+          const auto &c = fresh.get_compressed_ref();
+          dense[w] = &fresh.get_mask_ref();
+          compressed[w] = &c;
+          ok[w] = m == *direct && members_of(c) == fresh.get_idxs();
+        });
+      }
+      for (auto &t : pool) {
+        t.join();
+      }
+      const auto later = fresh;
+      for (unsigned w = 0; w < 8; ++w) {
+        same &= ok[w] && dense[w] == dense[0] &&
+                compressed[w] == compressed[0];
+      }
+      same &= &later.get_mask_ref() == dense[0] &&
+              &later.get_compressed_ref() == compressed[0];
+    }
+    return same;
+  };
+  check(race(test_set(picked, d)), "symbol masks built by racing threads");
+  check(race(annos), "annotation masks built by racing threads");
+}
+
+// fisher_p without a lower bound, so select_annos scores every table
+static double fisher_p_unpruned(const unsigned &a, const unsigned &b,
+                                const unsigned &c, const unsigned &d) {
+  return fisher_p(a, b, c, d);
+}
+
+// bounded selection on its own, the k and threshold cutoffs of a test, and
+// the pruned Fisher path against scoring every table
+static void test_top_k() {
+  top_k<ascending> keep(3);
+  for (const test_result &r : std::vector<test_result>(
+           {{5, 0.2, true}, {1, 0.1, true}, {4, 0.1, true}, {2, 0.3, true},
+            {3, 0.1, false}, {0, 0.05, true}})) {
+    keep.push(r);
+  }
+  auto kept = keep.take();
+  check(kept.size() == 3 && kept[0].anno == 0 && kept[1].anno == 1 &&
+            kept[2].anno == 3,
+        "top k keeps the best and breaks ties by annotation");
+  top_k<descending> high(2, 2.0), other(2, 2.0);
+  high.push({0, 1.5, true});
+  high.push({1, 4.0, true});
+  other.push({2, 3.0, true});
+  other.push({3, 5.0, true});
+  high.merge(other);
+  kept = high.take();
+  check(kept.size() == 2 && kept[0].anno == 3 && kept[1].anno == 1,
+        "top k threshold and merge");
+  top_k<ascending> none(0);
+  none.push({0, 0.0, true});
+  check(none.take().empty() && none.prunes(0.0, 0), "top k of zero");
+  const test_dataset d = tied_terms();
+  std::vector<std::string> picked;
+  for (unsigned s = 0; s < 120; s += 2 + s % 3) {
+    picked.push_back("s" + std::to_string(s));
+  }
+  const test_set set(picked, d);
+  ResultDataset all, best, sure;
+  ab_test<test_set, test_dataset, fisher_p, stat_sig_05, ascending>(
+      set, d, all, "all");
+  ab_test<test_set, test_dataset, fisher_p, stat_sig_05, ascending>(
+      set, d, best, "best", 1, 9);
+  ab_test<test_set, test_dataset, fisher_p, stat_sig_05, ascending>(
+      set, d, sure, "sure", 1, default_top_k, 1e-3);
+  bool prefix = all.size() > 9 && best.size() == 9, cut = sure.size() > 0;
+  for (size_t i = 0; i < best.size() && prefix; ++i) {
+    prefix &= best.anno(i) == all.anno(i) && best.stat(i) == all.stat(i);
+  }
+  for (size_t i = 0; i < all.size(); ++i) {
+    cut &= (i < sure.size()) == (all.stat(i) <= 1e-3);
+    if (i < sure.size())
+      cut &= sure.anno(i) == all.anno(i);
+  }
+  check(prefix, "k cuts the sorted results");
+  check(cut, "threshold cuts the sorted results");
+  for (const unsigned threads : {1u, 4u}) {
+    for (const unsigned k : {default_top_k, 9u, 1u}) {
+      for (const double threshold : {no_threshold, 1e-3}) {
+        ResultDataset pruned, full;
+        ab_test<test_set, test_dataset, fisher_p, stat_sig_05, ascending>(
+            set, d, pruned, "t", threads, k, threshold);
+        ab_test<test_set, test_dataset, fisher_p_unpruned, stat_sig_05,
+                ascending>(set, d, full, "t", threads, k, threshold);
+        ab_test_full<test_set, test_dataset, fisher_p, stat_sig_05,
+                     ascending>(set, d, pruned, "t", threads, k, threshold);
+        ab_test_full<test_set, test_dataset, fisher_p_unpruned, stat_sig_05,
+                     ascending>(set, d, full, "t", threads, k, threshold);
+        check(pruned.size() > 0 && same_rows(pruned, full),
+              "pruned results match scoring every table (k " +
+                  std::to_string(k) + ", threads " +
+                  std::to_string(threads) + ")");
+      }
+    }
+  }
+}
+
+// permutations over ten symbols and four terms: the same seed gives the
+// same values on any thread count, the minP step matches replaying every
+// draw without its bound, and both p-values approach the ones over all
+// C(10, 4) sets of the test set's size
+static void test_permutation() {
+  test_dataset d;
+  const std::vector<std::vector<unsigned>> terms = {
+      {0, 1, 2, 3}, {0, 1, 5, 6, 7}, {2, 8}, {1, 3, 4, 5, 6, 8, 9}};
+  for (unsigned t = 0; t < terms.size(); ++t) {
+    d.add_anno("T" + std::to_string(t), "t", "");
+  }
+  for (unsigned g = 0; g < 10; ++g) {
+    d.add_sym("g" + std::to_string(g), "g");
+  }
+  std::vector<std::pair<unsigned, unsigned>> edges;
+  for (unsigned t = 0; t < terms.size(); ++t) {
+    for (const unsigned &g : terms[t])
+      edges.emplace_back(g, t);
+  }
+  d.add_edges(edges);
+  d.gen_mappings();
+  const test_set set({"g0", "g1", "g2", "g8"}, d);
+  const auto test = d.count_set(set);
+  const unsigned n = 10, m = 4, perms = 20000;
+  const auto one = permute_annos(test, d, perms, 7, 1),
+             many = permute_annos(test, d, perms, 7, 4);
+  check(one.annos == test.hot && one.annos == many.annos &&
+            one.empirical == many.empirical && one.fwer == many.fwer,
+        "permutations match on 1 and 4 threads");
+  ResultDataset r1, r4;
+  permutation_test(set, d, r1, 500, 3, "perm", 1);
+  permutation_test(set, d, r4, 500, 3, "perm", 4);
+  check(r1.size() == 2 * test.hot.size() && same_rows(r1, r4),
+        "permutation sections match on 1 and 4 threads");
+  // the p-value of every annotation, and the smallest, for one set
+  auto p_of = [&](const std::vector<unsigned> &counts,
+                  std::vector<double> &p) {
+    double best = 1.0;
+    for (unsigned a = 0; a < terms.size(); ++a) {
+      const unsigned x = counts[a], k = terms[a].size();
+      p[a] = fisher_p_greater(x, k - x, m - x, n - m - k + x);
+      best = std::min(best, p[a]);
+    }
+    return best;
+  };
+  auto counts_of = [&](const std::vector<unsigned> &drawn) {
+    std::vector<unsigned> counts(terms.size(), 0);
+    for (const unsigned &s : drawn) {
+      for (const unsigned &a : d.sym_row(s))
+        ++counts[a];
+    }
+    return counts;
+  };
+  std::vector<double> observed(terms.size());
+  p_of(test.counts, observed);
+  // every draw replayed with the same generator, minimum over all terms
+  std::vector<double> min_p(perms);
+  for (unsigned p = 0; p < perms; ++p) {
+    counter_rng rng(7, p);
+    std::vector<unsigned> drawn;
+    for (unsigned j = n - m; j < n; ++j) {
+      unsigned t = rng.below(j + 1);
+      if (std::find(drawn.begin(), drawn.end(), t) != drawn.end())
+        t = j;
+      drawn.push_back(t);
+    }
+    std::vector<double> ps(terms.size());
+    min_p[p] = p_of(counts_of(drawn), ps);
+  }
+  bool replayed = true, significant = true;
+  for (unsigned j = 0; j < one.annos.size(); ++j) {
+    const double want =
+        (std::count_if(min_p.begin(), min_p.end(),
+                       [&](const double &x) {
+                         return x <= observed[one.annos[j]];
+                       }) +
+         1.0) /
+        (perms + 1.0);
+    replayed &= one.fwer[j] == want;
+    significant &= (one.fwer[j] <= 0.05) == (want <= 0.05);
+  }
+  check(replayed, "minP matches every draw scored in full");
+  check(significant, "minP bound keeps the significant set");
+  // all 210 sets of four symbols
+  std::vector<unsigned> fwer_hits(terms.size(), 0),
+      count_hits(terms.size(), 0);
+  unsigned sets = 0;
+  for (unsigned bits = 0; bits < (1u << n); ++bits) {
+    if (std::bitset<16>(bits).count() != m)
+      continue;
+    ++sets;
+    std::vector<unsigned> drawn;
+    for (unsigned s = 0; s < n; ++s) {
+      if (bits >> s & 1)
+        drawn.push_back(s);
+    }
+    const auto counts = counts_of(drawn);
+    std::vector<double> ps(terms.size());
+    const double best = p_of(counts, ps);
+    for (unsigned a = 0; a < terms.size(); ++a) {
+      fwer_hits[a] += best <= observed[a];
+      count_hits[a] += counts[a] >= test.counts[a];
+    }
+  }
+  bool close = sets == 210;
+  for (unsigned j = 0; j < one.annos.size(); ++j) {
+    const unsigned a = one.annos[j];
+    close &= std::fabs(one.fwer[j] - fwer_hits[a] / double(sets)) < 0.02 &&
+             std::fabs(one.empirical[j] - count_hits[a] / double(sets)) <
+                 0.02;
+  }
+  check(close, "permutation p-values approach the exact ones");
+}
+
+// queries, the cache under them and answers over a live dataset
+static void test_server() {
+  const auto q = enrichment_query::parse(
+      " {\"id\": \"a\\\"b\", \"symbols\": [\"g1\", \"g2\"], \"k\": 5,"
+      " \"control\": [], \"threshold\": 1e-300, \"extra\": {\"x\": [1]}}");
+  check(q.id == "\"a\\\"b\"" && q.symbols.size() == 2 && q.has_control &&
+            q.control.empty() && q.k == 5 && q.threshold == 1e-300 &&
+            q.test == "fisher",
+        "query fields");
+  check(enrichment_query::parse("{\"id\": -1.5e3}").id == "-1.5e3" &&
+            enrichment_query::parse("{}").id == "null",
+        "query ids");
+  const auto wide = enrichment_query::parse(
+      "{\"id\": \"\\ud83d\\ude00\\u00E9\\u20ac\","
+      " \"symbols\": [\"g\\u0031\"]}");
+  check(wide.id == "\"\xf0\x9f\x98\x80\xc3\xa9\xe2\x82\xac\"" &&
+            wide.symbols == std::vector<std::string>({"g1"}),
+        "escapes decode to UTF-8, surrogate pairs as one code point");
+  bool refused = true;
+  for (const char *bad :
+       {"{\"id\": abc}", "{\"id\": [1]}", "{\"id\": 01}", "{\"k\": 0}",
+        "{\"k\": 1.5}", "{\"symbols\": [\"g1\"", "{} x", "{\"test\": \"t}",
+        "[]", "{\"id\": \"\\ud83d\"}", "{\"id\": \"\\ude00\\ud83d\"}",
+        "{\"id\": \"\\ud83d\\u0041\"}", "{\"id\": \"\\u12zz\"}"}) {
+    try {
+      enrichment_query::parse(bad);
+      refused = false;
+    } catch (const std::runtime_error &) {
+    }
+  }
+  check(refused, "bad queries refused");
+  lru_cache<int> lru(2);
+  int v = 0;
+  lru.put("a", 1);
+  lru.put("b", 2);
+  const bool hit_a = lru.get("a", v, [](const int &) { return true; });
+  lru.put("c", 3);
+  const bool hit_b = lru.get("b", v, [](const int &) { return true; }),
+             stale = lru.get("a", v, [](const int &x) { return x != 1; });
+  check(hit_a && !hit_b && !stale && lru.size() == 1 &&
+            lru.stats() == std::pair<uint64_t, uint64_t>(1, 2),
+        "lru cache hits, evictions and stale entries");
+  auto live = std::make_shared<live_dataset<test_dataset>>(six_genes());
+  enrichment_service<symbol16, annotation16> service(8);
+  service.add("six", live);
+  const std::string query = "{\"id\": 7, \"symbols\": [\"g1\", \"g3\"], "
+                            "\"k\": 1000000, \"threshold\": 1e-300}",
+                    same = "{\"id\": \"x\", \"symbols\": [\"g3\", \"g1\", "
+                           "\"g1\", \"nope\"], \"k\": 1000000, "
+                           "\"threshold\": 1e-300}";
+  const std::string first = service.answer(query),
+                    again = service.answer(same);
+  check(first.rfind("{\"id\":7,\"cached\":false,\"sections\":[", 0) == 0 &&
+            again.rfind("{\"id\":\"x\",\"cached\":true,", 0) == 0 &&
+            first.substr(first.find("\"sections\"")) ==
+                again.substr(again.find("\"sections\"")),
+        "answers are cached under the resolved sets");
+  const std::string folds = service.answer(
+      "{\"id\": 8, \"symbols\": [\"g1\", \"g3\"], \"test\": \"fold_change\"}");
+  check(folds.find("\"cached\":false") != std::string::npos &&
+            folds.find("\"id\":\"B\"") == std::string::npos,
+        "other parameters miss the cache");
+  live->update([](test_dataset &d) { d.add_edge("g4", "B"); });
+  const std::string after = service.answer(
+      "{\"id\": 9, \"symbols\": [\"g1\", \"g3\"], \"test\": \"fold_change\"}");
+  check(after.find("\"cached\":false") != std::string::npos &&
+            after.find("\"id\":\"B\",\"name\":\"b\",\"stat\":4") !=
+                std::string::npos,
+        "a live update invalidates the cache");
+  check(service.answer("{\"id\": abc}") ==
+                "{\"id\":null,\"error\":\"bad query: expected a string or "
+                "a number at 7\"}" &&
+            service.answer("{\"id\": 3, \"dataset\": \"none\"}") ==
+                "{\"id\":3,\"error\":\"unknown dataset: none\"}",
+        "errors are answered");
+}
+
+// one row of results as a writer wrote it
+struct written_row {
+  std::string test, id, name;
+  double stat;
+  bool enriched;
+};
+
+// what ResultDataset::print shows for the rows, laid out as print does
+static std::string print_layout(const std::vector<written_row> &rows) {
+  std::ostringstream out;
+  out << " ========== TEST RESULT ==========\n";
+  for (size_t i = 0; i < rows.size(); ++i) {
+    if (i == 0 || rows[i].test != rows[i - 1].test)
+      out << "\t" << rows[i].test;
+  }
+  out << "\n";
+  std::vector<std::string> names;
+  for (const auto &r : rows) {
+    if (std::find(names.begin(), names.end(), r.name) == names.end())
+      names.push_back(r.name);
+  }
+  for (const auto &name : names) {
+    out << name;
+    for (const auto &r : rows) {
+      if (r.name == name)
+        out << "\t" << r.stat << (r.enriched ? "+" : "-");
+    }
+    out << "\n";
+  }
+  return out.str();
+}
+
+static std::string read_file(const std::string &fname) {
+  std::ifstream in(fname, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in), {});
+}
+
+// the tsv, json lines and binary writers read back, against print, with
+// names that hold every character tsv_field escapes
+static void test_writers() {
+  test_dataset d;
+  d.add_anno("A", "tab\there", "");
+  d.add_anno("B", "line\nbreak\r", "");
+  d.add_anno("C\\1", "back\\slash \"quoted\"", "");
+  d.add_sym("g1", "g", {"A", "B", "C\\1"});
+  d.gen_mappings();
+  ResultDataset rd;
+  rd.add("first\ttest", {{1, 0.25, true}, {0, 1.0 / 3, false}}, d);
+  rd.add("second", {{2, 1e-300, true}}, d);
+  rd.add("third", {{0, 2.5, true}, {2, 0.125, false}}, d);
+  std::ostringstream printed;
+  std::streambuf *old = std::cout.rdbuf(printed.rdbuf());
+  rd.print();
+  std::cout.rdbuf(old);
+  const std::string fname = "enriched_test.out";
+  auto written = [&](auto &&make) {
+    {
+      fd_sink sink(fname, 16);
+      auto writer = make(sink);
+      rd.write(writer);
+    }
+    return read_file(fname);
+  };
+  // tsv, unescaped field by field
+  std::vector<written_row> rows;
+  std::istringstream tsv(
+      written([](fd_sink &s) { return tsv_writer(s); }));
+  std::string line;
+  std::getline(tsv, line);
+  bool header = line == "test\tid\tname\tstat\tenriched";
+  while (std::getline(tsv, line)) {
+    std::vector<std::string> fields(1);
+    for (size_t i = 0; i < line.size(); ++i) {
+      if (line[i] == '\t') {
+        fields.emplace_back();
+      } else if (line[i] == '\\' && i + 1 < line.size()) {
+        const char c = line[++i];
+        fields.back() += c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r'
+                                                                      : c;
+      } else {
+        fields.back() += line[i];
+      }
+    }
+    if (fields.size() != 5) {
+      header = false;
+      break;
+    }
+    rows.push_back({fields[0], fields[1], fields[2], std::stod(fields[3]),
+                    fields[4] == "+"});
+  }
+  check(header && rows.size() == rd.size() && rows[4].id == "C\\1" &&
+            rows[0].stat == 0.25 && rows[2].stat == 1e-300 &&
+            print_layout(rows) == printed.str(),
+        "tsv writer matches print");
+  // json lines, through the query reader
+  rows.clear();
+  std::istringstream json(
+      written([](fd_sink &s) { return json_lines_writer(s); }));
+  bool parsed = true;
+  while (std::getline(json, line)) {
+    json_reader in(line);
+    written_row r;
+    try {
+      in.expect('{');
+      do {
+        const std::string key = in.string();
+        in.expect(':');
+        if (key == "stat")
+          r.stat = in.number();
+        else if (key == "enriched")
+          r.enriched = in.raw() == "true";
+        else
+          (key == "test" ? r.test : key == "id" ? r.id : r.name) =
+              in.string();
+      } while (in.take(','));
+      in.expect('}');
+      parsed &= in.at_end();
+    } catch (const std::runtime_error &) {
+      parsed = false;
+    }
+    rows.push_back(r);
+  }
+  check(parsed && rows.size() == rd.size() &&
+            print_layout(rows) == printed.str(),
+        "json lines writer matches print");
+  // binary, names from the dataset
+  rows.clear();
+  const std::string bin =
+      written([](fd_sink &s) { return binary_writer(s); });
+  size_t at = 12;
+  auto take = [&](void *to, const size_t &n) {
+    if (at + n > bin.size())
+      return false;
+    std::memcpy(to, bin.data() + at, n);
+    at += n;
+    return true;
+  };
+  uint32_t endian = 0;
+  std::memcpy(&endian, bin.data() + 8, 4);
+  bool framed = bin.compare(0, 8, std::string("ENRRES1", 8)) == 0 &&
+                endian == 0x01020304;
+  unsigned sections = 0;
+  while (framed && at < bin.size()) {
+    uint32_t len = 0, n = 0;
+    framed &= take(&len, 4);
+    std::string name(len, 0);
+    framed &= take(&name[0], len) && take(&n, 4);
+    std::vector<unsigned> annos(n);
+    std::vector<double> stats(n);
+    std::vector<uint8_t> enriched(n);
+    framed &= take(annos.data(), 4 * n) && take(stats.data(), 8 * n) &&
+              take(enriched.data(), n);
+    for (uint32_t i = 0; framed && i < n; ++i) {
+      rows.push_back({name, std::string(d.anno_id(annos[i])),
+                      std::string(d.anno_name(annos[i])), stats[i],
+                      enriched[i] != 0});
+    }
+    ++sections;
+  }
+  check(framed && sections == 3 && print_layout(rows) == printed.str(),
+        "binary writer matches print");
+  std::remove(fname.c_str());
+}
+
+// elim scores as the method defines them: every term after all of its
+// descendants, without the symbols of any significant descendant
+static std::vector<test_result> elim_reference(const test_set &set,
+                                               const test_dataset &d,
+                                               const ontology &dag,
+                                               const double &cutoff) {
+  const unsigned ns = d.total_syms(), na = d.total_annos();
+  const auto &in = set.get_idxs();
+  std::vector<char> significant(na, 0);
+  std::vector<unsigned> order;
+  for (unsigned t = dag.size(); t < na; ++t) {
+    order.push_back(t);
+  }
+  order.insert(order.end(), dag.order().rbegin(), dag.order().rend());
+  top_k<ascending> keep(default_top_k, no_threshold);
+  for (const unsigned &t : order) {
+    std::vector<unsigned> removed;
+    for (const unsigned &c : dag.descendants(t)) {
+      if (significant[c]) {
+        const idx_span row = d.anno_row(c);
+        removed.insert(removed.end(), row.begin(), row.end());
+      }
+    }
+    unsigned a = 0, size = 0, hit = 0;
+    for (const unsigned &s : d.anno_row(t)) {
+      const bool test = std::binary_search(in.begin(), in.end(), s);
+      hit += test;
+      if (std::find(removed.begin(), removed.end(), s) != removed.end())
+        continue;
+      ++size;
+      a += test;
+    }
+    if (hit == 0)
+      continue;
+    const unsigned m = in.size();
+    const double p = fisher_p_greater(a, size - a, m - a, ns - size - m + a);
+    significant[t] = p < cutoff;
+    keep.push({t, p, a / (m + 1.0) > size / (ns + 1.0)});
+  }
+  return keep.take();
+}
+
+// a hand made DAG, R <- A, R <- B, A <- C, B <- C, A <- D, over g1..g10
+// with C {g1, g2, g3}, D {g4, g5}, A {g6}, B {g7}, R {g8, g9} before
+// propagation, tested with {g1, g2, g3, g4}; then random DAGs against the
+// elim reference, and an OBO file
+static void test_ontology() {
+  test_dataset d;
+  for (const char *t : {"R", "A", "B", "C", "D"}) {
+    d.add_anno(t, t, "");
+  }
+  const std::vector<std::vector<std::string>> direct = {
+      {"C"}, {"C"}, {"C"}, {"D"}, {"D"}, {"A"}, {"B"}, {"R"}, {"R"}, {}};
+  for (unsigned g = 0; g < 10; ++g) {
+    d.add_sym("g" + std::to_string(g + 1), "g", direct[g]);
+  }
+  d.gen_mappings();
+  const ontology dag(5, {{1, 0}, {2, 0}, {3, 1}, {3, 2}, {4, 1}});
+  check(dag.order().front() == 0 && dag.order().back() >= 3 &&
+            std::vector<unsigned>(dag.ancestors(3).begin(),
+                                  dag.ancestors(3).end()) ==
+                std::vector<unsigned>({0, 1, 2}) &&
+            dag.descendants(0).size() == 4,
+        "ontology closure");
+  check(propagate(d, dag) == 15 && d.anno_size(0) == 9 &&
+            d.anno_size(1) == 6 && d.anno_size(2) == 4,
+        "propagated sizes");
+  const test_set set({"g1", "g2", "g3", "g4"}, d);
+  auto rows = [](const ResultDataset &rd) {
+    std::vector<std::pair<unsigned, double>> out;
+    for (size_t i = 0; i < rd.size(); ++i)
+      out.emplace_back(rd.anno(i), rd.stat(i));
+    return out;
+  };
+  auto same = [](const std::vector<std::pair<unsigned, double>> &got,
+                 const std::vector<std::pair<unsigned, double>> &want) {
+    bool ok = got.size() == want.size();
+    for (size_t i = 0; ok && i < got.size(); ++i)
+      ok = got[i].first == want[i].first && near(got[i].second, want[i].second);
+    return ok;
+  };
+  // C by C(7, 4) tables within A or B, D within A, A and B within R
+  ResultDataset pc, pc_cut;
+  parent_child_test(set, d, dag, pc, "pc", default_top_k, no_threshold);
+  parent_child_test(set, d, dag, pc_cut);
+  check(same(rows(pc), {{3, 4.0 / 35},
+                        {1, 5.0 / 42},
+                        {2, 1.0 / 6},
+                        {0, 3.0 / 5},
+                        {4, 14.0 / 15}}) &&
+            pc_cut.size() == 0,
+        "parent-child p-values");
+  // C is significant, so A, B and R lose g1..g3
+  ResultDataset el, el_cut;
+  elim_test(set, d, dag, el, 0.05, "elim", default_top_k, no_threshold);
+  elim_test(set, d, dag, el_cut, 0.05);
+  check(same(rows(el), {{3, 1.0 / 30},
+                        {4, 2.0 / 3},
+                        {1, 5.0 / 6},
+                        {0, 209.0 / 210},
+                        {2, 1.0}}) &&
+            same(rows(el_cut), {{3, 1.0 / 30}}),
+        "elim p-values");
+  // random DAGs, terms in shuffled order, against the reference
+  bool matched = true;
+  for (unsigned round = 0; round < 20; ++round) {
+    test_rng rng(100 + round);
+    const unsigned n = 40, extra = round % 3;
+    std::vector<unsigned> label(n);
+    for (unsigned t = 0; t < n; ++t) {
+      label[t] = t;
+    }
+    for (unsigned t = n - 1; t > 0; --t) {
+      std::swap(label[t], label[rng.next() % (t + 1)]);
+    }
+    std::vector<std::pair<unsigned, unsigned>> relations;
+    for (unsigned t = 1; t < n; ++t) {
+      for (unsigned p = 0, np = 1 + rng.next() % 3; p < np; ++p)
+        relations.emplace_back(label[t], label[rng.next() % t]);
+    }
+    test_dataset r;
+    for (unsigned t = 0; t < n + extra; ++t) {
+      r.add_anno("t" + std::to_string(t), "t", "");
+    }
+    std::vector<std::string> picked;
+    for (unsigned g = 0; g < 80; ++g) {
+      std::vector<std::string> terms;
+      bool hot = false;
+      for (unsigned i = 0, nt = 1 + rng.next() % 2; i < nt; ++i) {
+        const unsigned t = rng.next() % (n + extra);
+        terms.push_back("t" + std::to_string(t));
+        hot |= t < 4;
+      }
+      r.add_sym("g" + std::to_string(g), "g", terms);
+      // symbols of the first terms are picked more often, so some of them
+      // and their ancestors come out significant
+      if (rng.next() % 20 < (hot ? 15u : 2u))
+        picked.push_back("g" + std::to_string(g));
+    }
+    r.gen_mappings(round % 2 ? compressed_masks : dense_masks);
+    const ontology rdag(n, relations);
+    propagate(r, rdag, dense_masks, 1 + round % 4);
+    const test_set rset(picked, r);
+    for (const double cutoff : {0.01, 0.2}) {
+      ResultDataset got;
+      elim_test(rset, r, rdag, got, cutoff, "elim", default_top_k,
+                no_threshold);
+      const auto want = elim_reference(rset, r, rdag, cutoff);
+      matched &= got.size() == want.size();
+      for (size_t i = 0; matched && i < want.size(); ++i) {
+        matched &= got.anno(i) == want[i].anno &&
+                   near(got.stat(i), want[i].stat) &&
+                   got.is_enriched(i) == want[i].enriched;
+      }
+    }
+  }
+  check(matched, "elim matches the reference on random DAGs");
+  // is_a, part_of, a relation the loader ignores, an obsolete term and
+  // relations to it and to an undefined term
+  const std::string fname = "enriched_test.obo";
+  {
+    std::ofstream out(fname, std::ios::binary);
+    out << "format-version: 1.2\n\n"
+           "[Term]\nid: GO:1 ! root\nname: root\n"
+           "def: \"The \\\"root\\\" term.\" [GOC:x]\n\n"
+           "[Term]\nid: GO:2\nname: a\nis_a: GO:1 ! root\n\n"
+           "[Term]\r\nid: GO:3\r\nname: b\r\n"
+           "relationship: part_of GO:1 ! root\r\n\r\n"
+           "[Term]\nid: GO:4\nname: c\nis_a: GO:2 ! a\n"
+           "relationship: part_of GO:3\nrelationship: regulates GO:1\n\n"
+           "[Term]\nid: GO:5\nname: old\nis_obsolete: true\n\n"
+           "[Term]\nid: GO:6\nname: d\nis_a: GO:5\nis_a: GO:9\n\n"
+           "[Typedef]\nid: part_of\nname: part of\n";
+  }
+  auto parents_of = [](const ontology &o, const unsigned &t) {
+    return std::vector<unsigned>(o.parents(t).begin(), o.parents(t).end());
+  };
+  test_dataset go, is_a_only;
+  const ontology full = load_obo(go, fname),
+                 part = load_obo(is_a_only, fname, false);
+  check(go.total_annos() == 5 && go.find_anno("GO:5") == id_table::npos &&
+            go.anno_id(4) == "GO:6" && go.anno_name(1) == "a" &&
+            go.anno_description(0) == "The \"root\" term.",
+        "OBO terms");
+  check(full.size() == 5 && parents_of(full, 1) == std::vector<unsigned>({0}) &&
+            parents_of(full, 2) == std::vector<unsigned>({0}) &&
+            parents_of(full, 3) == std::vector<unsigned>({1, 2}) &&
+            parents_of(full, 4).empty(),
+        "OBO relations");
+  check(parents_of(part, 2).empty() &&
+            parents_of(part, 3) == std::vector<unsigned>({1}),
+        "OBO relations without part_of");
+  std::remove(fname.c_str());
+}
+
+// the symbols, annotations and index of two datasets are the same
+static bool same_data(const test_dataset &x, const test_dataset &y) {
+  if (x.total_syms() != y.total_syms() || x.total_annos() != y.total_annos())
+    return false;
+  for (unsigned s = 0; s < x.total_syms(); ++s) {
+    const idx_span a = x.sym_row(s), b = y.sym_row(s);
+    if (x.sym_id(s) != y.sym_id(s) || x.sym_name(s) != y.sym_name(s) ||
+        !std::equal(a.begin(), a.end(), b.begin(), b.end()))
+      return false;
+  }
+  for (unsigned t = 0; t < x.total_annos(); ++t) {
+    const idx_span a = x.anno_row(t), b = y.anno_row(t);
+    if (x.anno_id(t) != y.anno_id(t) || x.anno_name(t) != y.anno_name(t) ||
+        x.anno_description(t) != y.anno_description(t) ||
+        !std::equal(a.begin(), a.end(), b.begin(), b.end()))
+      return false;
+  }
+  return true;
+}
+
+static void write_file(const std::string &fname, const std::string &text) {
+  std::ofstream out(fname, std::ios::binary);
+  out << text;
+}
+
+// the profile of known queries: a Fisher test over tied_terms on one and
+// four threads, the same test run by two threads at once, and a load whose
+// parse phase wraps the add phase. without ENRICHED_PROFILE it stays empty
+static void test_profile() {
+  const test_dataset d = tied_terms();
+  std::vector<std::string> picked;
+  for (unsigned s = 0; s < 120; s += 3) {
+    picked.push_back("s" + std::to_string(s));
+  }
+  std::vector<uint64_t> counted[2];
+  auto run = [&](const unsigned &threads, std::vector<uint64_t> &counts) {
+    query_profile q;
+    const test_set set(picked, d);
+    ResultDataset res;
+    fisher_test(set, d, res, threads);
+    q.stop();
+    counts.clear();
+    for (unsigned c = 0; c < profile_counters; ++c) {
+      counts.push_back(q.counter(static_cast<profile_counter>(c)));
+    }
+    counts.push_back(res.size());
+    uint64_t phases = 0;
+    for (unsigned p = 0; p < profile_phases; ++p) {
+      phases += q.phase_ns(static_cast<profile_phase>(p));
+    }
+    const std::string json = q.json();
+    const double wall = std::atof(json.c_str() + json.find(':', 12) + 1);
+    return phases / 1e6 <= wall + 1e-3;
+  };
+  const bool within = run(1, counted[0]) && run(4, counted[1]);
+  std::vector<uint64_t> apart[2];
+  std::thread other([&] { run(1, apart[1]); });
+  run(1, apart[0]);
+  other.join();
+#ifdef ENRICHED_PROFILE
+  const auto &one = counted[0];
+  check(one[prof_annos_scanned] == 300 && one[prof_lines_parsed] == 0 &&
+            one[prof_edges_inserted] == 0 && one[prof_bitsets] == 0 &&
+            one[prof_annos_skipped] + one[prof_results] <= 300 &&
+            one[prof_results] == one[profile_counters],
+        "counters of a Fisher test");
+  check(counted[1] == one, "counters on four threads match one");
+  check(apart[0] == one && apart[1] == one,
+        "concurrent queries count only their own work");
+  check(within, "phases split the wall time");
+  write_file("profile_test.tsv", "g1\tA,B\ng2\tA\r\ng3\tB\n");
+  query_profile q;
+  test_dataset loaded;
+  loaded.add_anno("A", "a", "");
+  loaded.add_anno("B", "b", "");
+  load_syms_with_mappings(loaded, "profile_test.tsv");
+  q.stop();
+  std::remove("profile_test.tsv");
+  check(q.counter(prof_lines_parsed) == 3 &&
+            q.counter(prof_edges_inserted) == 4 &&
+            q.phase_ns(phase_add) > 0 && q.phase_ns(phase_parse) > 0,
+        "a load counts its lines and edges");
+  const std::string json = q.json();
+  check(json.rfind("{\"enabled\":true,\"wall_ms\":", 0) == 0 &&
+            json.find(",\"threads\":1,\"phases_ms\":{\"parse\":") !=
+                std::string::npos &&
+            json.find("},\"counters\":{\"lines_parsed\":3,"
+                      "\"edges_inserted\":4,") != std::string::npos &&
+            json.find("\"results_emitted\":0}}") == json.size() - 21,
+        "profile json");
+#else
+  const std::vector<uint64_t> empty(profile_counters, 0);
+  check(std::equal(empty.begin(), empty.end(), counted[0].begin()) &&
+            std::equal(empty.begin(), empty.end(), apart[1].begin()) &&
+            within,
+        "no counters without ENRICHED_PROFILE");
+  query_profile q;
+  check(q.json().rfind("{\"enabled\":false,\"wall_ms\":", 0) == 0,
+        "profile json says it is disabled");
+#endif
+}
+
+// writes text gzipped, split over two gzip members
+static bool write_gzip(const std::string &fname, const std::string &text) {
+#ifdef ENRICHED_ZLIB
+  const size_t half = text.size() / 2;
+  for (const bool first : {true, false}) {
+    gzFile gz = gzopen(fname.c_str(), first ? "wb" : "ab");
+    const std::string part = first ? text.substr(0, half) : text.substr(half);
+    if (!gz || gzwrite(gz, part.data(), part.size()) != int(part.size()) ||
+        gzclose(gz) != Z_OK)
+      return false;
+  }
+  return true;
+#else
+  (void)fname;
+  (void)text;
+  return false;
+#endif
+}
+
+// the (symbol, annotation id) edges of a dataset, by symbol id
+static std::vector<std::string> edges_of(const test_dataset &d) {
+  std::vector<std::string> out;
+  for (unsigned s = 0; s < d.total_syms(); ++s) {
+    for (const unsigned &a : d.sym_row(s))
+      out.push_back(std::string(d.sym_id(s)) + " " +
+                    std::string(d.anno_id(a)));
+  }
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+// the mapped TSV loaders: tokens around empty fields, CRLF line ends,
+// blank lines, a last line with no newline, empty and missing files, and
+// a file of many lines against the same dataset built by hand
+static void test_tsv_loader() {
+  std::string_view rest = "a\t\tb\t";
+  std::vector<std::string_view> tokens;
+  while (!rest.empty()) {
+    tokens.push_back(next_token(rest, '\t'));
+  }
+  std::string_view single = "abc";
+  check(tokens == std::vector<std::string_view>({"a", "", "b"}) &&
+            next_token(single, ',') == "abc" && single.empty(),
+        "tokens");
+  write_file("tsv_annos.tsv",
+             "A\tAlpha\tfirst\r\nB\tBeta\tsecond\r\n\r\nC\tGamma\t");
+  write_file("tsv_syms.tsv",
+             "g1\tA,B\r\ng2\t\r\n\ng3\tC,,A\r\ng4\tB");
+  test_dataset loaded, want;
+  load_annotations_plain(loaded, "tsv_annos.tsv");
+  load_syms_with_mappings(loaded, "tsv_syms.tsv");
+  loaded.gen_mappings();
+  want.add_anno("A", "Alpha", "first");
+  want.add_anno("B", "Beta", "second");
+  want.add_anno("C", "Gamma", "");
+  want.add_sym("g1", "g1", {"A", "B"});
+  want.add_sym("g2", "g2");
+  want.add_sym("g3", "g3", {"C", "A"});
+  want.add_sym("g4", "g4", {"B"});
+  want.gen_mappings();
+  check(same_data(loaded, want), "CRLF files without a last newline");
+  check(load_syms_from_file("tsv_syms.tsv") ==
+            std::vector<std::string>(
+                {"g1\tA,B", "g2\t", "g3\tC,,A", "g4\tB"}),
+        "lines without their CR");
+  std::string many;
+  for (unsigned i = 0; i < 20000; ++i) {
+    many += "s" + std::to_string(i) + "\t" + (i % 3 ? "A" : "A,C") +
+            (i + 1 < 20000 ? "\n" : "");
+  }
+  write_file("tsv_syms.tsv", many);
+  load_syms_with_mappings(loaded, "tsv_syms.tsv");
+  loaded.gen_mappings();
+  check(loaded.total_syms() == 20004 && loaded.sym_id(20003) == "s19999" &&
+            loaded.anno_size(0) == 20002 && loaded.anno_size(2) == 6668,
+        "a file of many lines");
+  write_file("tsv_syms.tsv", "");
+  test_dataset none;
+  load_syms_with_mappings(none, "tsv_syms.tsv");
+  bool missing = false;
+  try {
+    load_annotations_plain(none, "tsv_missing.tsv");
+  } catch (const std::runtime_error &) {
+    missing = true;
+  }
+  check(none.total_syms() == 0 && missing, "empty and missing files");
+  std::remove("tsv_annos.tsv");
+  std::remove("tsv_syms.tsv");
+}
+
+// GAF and ClinVar VCF loading, plain and gzip: NOT qualifiers, excluded
+// evidence, empty optional columns at the end of a line and genes joined
+// in GENEINFO
+static void test_loaders() {
+  const std::string gaf_name = "enriched_test.gaf",
+                    vcf_name = "enriched_test.vcf",
+                    gt_name = "enriched_test.gt",
+                    gz_name = "enriched_test.gz";
+  const std::string tail = "\tprotein\ttaxon:9606\t20200101\tUniProt\t\t\n";
+  const std::string gaf =
+      "!gaf-version: 2.2\n"
+      "UniProtKB\tP1\tG1\t\tGO:1\tPMID:1\tIDA\t\tP\tgene one" + tail +
+      "UniProtKB\tP1\tG1\t\tGO:2\tGO_REF:2\tIEA\t\tP\tgene one" + tail +
+      "UniProtKB\tP2\tG2\tNOT\tGO:1\tPMID:2\tIDA\t\tP\tgene two" + tail +
+      "UniProtKB\tP2\tG2\tcontributes_to|NOT\tGO:3\tPMID:2\tIDA\t\tF\t" +
+      tail +
+      "UniProtKB\tP2\tG2\tenables\tGO:2\tPMID:2\tIMP\t\tF\tgene two" + tail +
+      "UniProtKB\tP3\tG3\t\tGO:3\tPMID:3\tTAS\t\tC\t\n"
+      "UniProtKB\tP4\tG4\t\tGO:9\tPMID:4\tIDA\t\tC\tgene four" + tail;
+  write_file(gaf_name, gaf);
+  auto go = []() {
+    test_dataset d;
+    for (const char *t : {"GO:1", "GO:2", "GO:3"}) {
+      d.add_anno(t, t, "");
+    }
+    return d;
+  };
+  test_dataset plain = go(), with_not = go(), no_iea = go();
+  load_gaf(plain, gaf_name);
+  load_gaf(with_not, gaf_name, false);
+  load_gaf(no_iea, gaf_name, true, {"IEA", "ND"});
+  for (auto *d : {&plain, &with_not, &no_iea}) {
+    d->gen_mappings();
+  }
+  check(edges_of(plain) ==
+                std::vector<std::string>(
+                    {"G1 GO:1", "G1 GO:2", "G2 GO:2", "G3 GO:3"}) &&
+            plain.sym_name(plain.find_sym("G1")) == "gene one" &&
+            plain.sym_name(plain.find_sym("G3")).empty() &&
+            plain.find_sym("G4") == id_table::npos,
+        "GAF edges");
+  check(edges_of(with_not) == std::vector<std::string>({"G1 GO:1", "G1 GO:2",
+                                                        "G2 GO:1", "G2 GO:2",
+                                                        "G2 GO:3", "G3 GO:3"}),
+        "GAF edges with NOT lines");
+  check(edges_of(no_iea) ==
+            std::vector<std::string>({"G1 GO:1", "G2 GO:2", "G3 GO:3"}),
+        "GAF edges without excluded evidence");
+  bool refused = false;
+  write_file(gaf_name, "UniProtKB\tP1\tG1\t\tGO:1\tPMID:1\tIDA\t\tP\n");
+  try {
+    test_dataset d = go();
+    load_gaf(d, gaf_name);
+  } catch (const std::runtime_error &) {
+    refused = true;
+  }
+  check(refused, "short GAF line refused");
+  const std::string vcf =
+      "##fileformat=VCFv4.1\n"
+      "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n"
+      "1\t100\t1\tA\tG\t.\t.\tRS=11;CLNDN=Disease_A;CLNDISDB=MONDO:1;"
+      "GENEINFO=GA:1\n"
+      "1\t200\t2\tC\tT\t.\t.\tRS=22;CLNDN=Disease_B;CLNDISDB=MONDO:2;"
+      "GENEINFO=GA:1|GB:2\n"
+      "1\t300\t3\tG\tA\t.\t.\tCLNDN=Disease_C;GENEINFO=GC:3\n"
+      "1\t400\t4\tT\tC\t.\t.\tRS=11;CLNDN=Disease_D;GENEINFO=GB:2\n"
+      "2\t500\t5\tA\tC\t.\t.\tRS=33;CLNDN=Disease_E;GENEINFO=GD:4\n";
+  write_file(vcf_name, vcf);
+  test_dataset clinvar;
+  check(load_clinvar_vcf(clinvar, vcf_name).empty(), "VCF without carriers");
+  clinvar.gen_mappings();
+  const unsigned gb = clinvar.find_anno("GB:2");
+  check(edges_of(clinvar) ==
+                std::vector<std::string>(
+                    {"11 GA:1", "22 GA:1", "22 GB:2", "33 GD:4"}) &&
+            clinvar.total_annos() == 4 &&
+            clinvar.anno_name(gb) == "Disease_B" &&
+            clinvar.anno_description(0) == "MONDO:1" &&
+            clinvar.find_anno("GC:3") != id_table::npos,
+        "VCF genes and variants");
+  write_file(gt_name, "# rsid\tchromosome\tposition\tgenotype\n"
+                      "rs11\t1\t100\tAG\nrs22\t1\t200\tCC\ni9\t1\t1\tAA\n");
+  const auto genotypes = load_genotypes(gt_name);
+  test_dataset mine;
+  const auto carriers = load_clinvar_vcf(mine, vcf_name, &genotypes);
+  check(genotypes.size() == 2 && genotypes.at("11") == "AG" &&
+            carriers == std::vector<std::string>({"11"}) &&
+            mine.total_syms() == 2 && mine.find_sym("33") == id_table::npos,
+        "VCF carriers from genotypes");
+  // the same files gzipped load the same
+  bool same = true, gzipped = true;
+  for (const std::string *text : {&gaf, &vcf}) {
+    gzipped &= write_gzip(gz_name, *text);
+    if (!gzipped)
+      break;
+    test_dataset from_gz = go(), from_text = go();
+    if (text == &gaf) {
+      write_file(gaf_name, gaf);
+      load_gaf(from_gz, gz_name);
+      load_gaf(from_text, gaf_name);
+    } else {
+      load_clinvar_vcf(from_gz, gz_name);
+      load_clinvar_vcf(from_text, vcf_name);
+    }
+    from_gz.gen_mappings();
+    from_text.gen_mappings();
+    same &= same_data(from_gz, from_text) && from_gz.total_syms() > 0;
+  }
+#ifdef ENRICHED_ZLIB
+  check(gzipped && same, "gzip input loads as plain text");
+#else
+  // without zlib a gzip file is refused, not read as text
+  refused = false;
+  write_file(gz_name, std::string("\x1f\x8b\x08\0", 4));
+  try {
+    test_dataset d = go();
+    load_gaf(d, gz_name);
+  } catch (const std::runtime_error &) {
+    refused = true;
+  }
+  check(refused, "gzip input refused without zlib");
+#endif
+  for (const auto &f : {gaf_name, vcf_name, gt_name, gz_name}) {
+    std::remove(f.c_str());
+  }
+}
+
+// the running sum walked rank by rank over the whole list
+static double full_walk_es(const std::vector<unsigned> &ranks,
+                           const std::vector<double> &weights) {
+  const unsigned n = weights.size(), k = ranks.size();
+  double total = 0;
+  for (const unsigned &r : ranks) {
+    total += weights[r];
+  }
+  double sum = 0, best = 0;
+  for (unsigned r = 0; r < n; ++r) {
+    if (std::binary_search(ranks.begin(), ranks.end(), r))
+      sum += total == 0 ? 1.0 / k : weights[r] / total;
+    else
+      sum -= 1.0 / (n - k);
+    if (std::fabs(sum) > std::fabs(best) ||
+        (std::fabs(sum) == std::fabs(best) && sum > best))
+      best = sum;
+  }
+  return best;
+}
+
+// score files, running sums worked out by hand and against a full walk,
+// and whole GSEA runs over a list where one term sits at the top and one
+// at the bottom
+static void test_gsea() {
+  // weights 3, 2, 1.5, 1, 0.5, 0.25. hits at 0 and 2 climb by 3 / 4.5 and
+  // 1.5 / 4.5 with a miss of 1 / 4 between them: 2/3, 5/12, 3/4. hits at
+  // 3 and 5 come after three misses, -3/4
+  const std::vector<double> w = {3, 2, 1.5, 1, 0.5, 0.25}, flat(6, 0);
+  const unsigned top[] = {0, 2}, low[] = {3, 5}, mid[] = {1, 4};
+  check(near(running_sum_es(top, 2, w.data(), 6), 0.75) &&
+            near(running_sum_es(low, 2, w.data(), 6), -0.75) &&
+            near(running_sum_es(mid, 2, flat.data(), 6), 0.25),
+        "running sums by hand");
+  test_rng rng(5);
+  bool walked = true;
+  for (unsigned round = 0; round < 200; ++round) {
+    const unsigned n = 2 + rng.next() % 60;
+    std::vector<double> weights(n);
+    for (auto &x : weights) {
+      x = round % 5 == 0 ? 0 : (rng.next() % 1000) / 100.0;
+    }
+    std::vector<unsigned> ranks;
+    for (unsigned r = 0; r < n; ++r) {
+      if (rng.next() % 3 == 0)
+        ranks.push_back(r);
+    }
+    if (ranks.empty() || ranks.size() >= n)
+      continue;
+    walked &= std::fabs(running_sum_es(ranks.data(), ranks.size(),
+                                       weights.data(), n) -
+                        full_walk_es(ranks, weights)) < 1e-12;
+  }
+  check(walked, "running sums match a full walk");
+  // 60 symbols scored 30 down to -29: T holds the first 10, B the last
+  // 10, M every sixth
+  test_dataset d;
+  for (const char *t : {"T", "B", "M"}) {
+    d.add_anno(t, t, "");
+  }
+  for (unsigned s = 0; s < 60; ++s) {
+    std::vector<std::string> terms;
+    if (s < 10)
+      terms.push_back("T");
+    if (s >= 50)
+      terms.push_back("B");
+    if (s % 6 == 0)
+      terms.push_back("M");
+    d.add_sym("g" + std::to_string(s), "g", terms);
+  }
+  d.gen_mappings();
+  std::vector<double> scores(60);
+  for (unsigned s = 0; s < 60; ++s) {
+    scores[s] = 30.0 - s;
+  }
+  const auto one = gsea(scores, d, 400, 9, 1, 1, 5),
+             many = gsea(scores, d, 400, 9, 3, 1, 5);
+  const ranked_list list(scores, 60);
+  std::vector<unsigned> hits_t, hits_b;
+  for (unsigned r = 0; r < 10; ++r) {
+    hits_t.push_back(r);
+    hits_b.push_back(50 + r);
+  }
+  check(one.annos == std::vector<unsigned>({0, 1, 2}) &&
+            one.sizes == std::vector<unsigned>({10, 10, 10}) &&
+            near(one.es[0], full_walk_es(hits_t, list.weights)) &&
+            near(one.es[1], full_walk_es(hits_b, list.weights)) &&
+            one.es[0] > 0.9 && one.es[1] < -0.9,
+        "GSEA enrichment scores");
+  check(one.p[0] < 0.01 && one.p[1] < 0.01 && one.p[2] > 0.1 &&
+            one.nes[0] > 1 && one.nes[1] < -1,
+        "GSEA p-values and normalized scores");
+  check(one.es == many.es && one.nes == many.nes && one.p == many.p,
+        "GSEA matches on 1 and 3 threads");
+  // score files: a data line with a missing score first, a header, and
+  // comments, unknown symbols and a repeated symbol
+  const std::string fname = "enriched_test.scores";
+  write_file(fname, "g1\t\t1.5\ng2\t2\t-3\n");
+  const auto data_first = load_scores(d, fname);
+  write_file(fname, "# scores\ngene\tlogfc\tp\ng1\t1\t0.5\n");
+  const auto with_header = load_scores(d, fname);
+  write_file(fname, "nope\t1\t2\ng3\tx\t4\ng3\t5\t6\ng4\t7\n");
+  const auto unknown_first = load_scores(d, fname);
+  check(data_first.columns() ==
+                std::vector<std::string>({"score", "score2"}) &&
+            std::isnan(data_first[0][1]) && data_first[1][1] == 1.5 &&
+            data_first[0][2] == 2 && data_first[1][2] == -3 &&
+            std::isnan(data_first[0][0]),
+        "scores without a header");
+  check(with_header.columns() == std::vector<std::string>({"logfc", "p"}) &&
+            with_header.column("p")[1] == 0.5,
+        "scores with a header");
+  check(unknown_first.columns() ==
+                std::vector<std::string>({"score", "score2"}) &&
+            unknown_first[1][3] == 4 && unknown_first[0][4] == 7 &&
+            std::isnan(unknown_first[1][4]),
+        "scores with unknown and repeated symbols");
+  std::remove(fname.c_str());
+}
+
+// the open addressing id table: hundreds of keys that share their home
+// slot at every table size, misses along the same probe chain, lookups by
+// views into larger strings that allocate nothing, and a table rebuilt
+// from its saved slots
+static void test_id_table() {
+  std::vector<std::string> keys, misses;
+  for (unsigned i = 0; misses.size() < 300; ++i) {
+    const std::string key = "k" + std::to_string(i);
+    if ((hash_id(key) & 1023) == 0)
+      (keys.size() < 300 ? keys : misses).push_back(key);
+  }
+  for (unsigned i = 0; i < 2000; ++i) {
+    keys.push_back("plain" + std::to_string(i));
+  }
+  auto key_of = [&](const unsigned &i) { return std::string_view(keys[i]); };
+  id_table table;
+  check(table.find("k0", key_of) == id_table::npos, "empty table");
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    table.insert(i, key_of);
+  }
+  const size_t slots = table.data().size();
+  check(table.size() == keys.size() && slots >= 2 * keys.size() &&
+            (slots & (slots - 1)) == 0,
+        "table grows by doubling and stays at most half full");
+  std::string buffer;
+  for (const auto &key : keys) {
+    buffer += "<" + key + ">";
+  }
+  const size_t before = alloc_count.load();
+  bool found = true, missed = true;
+  size_t at = 0;
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    const std::string_view view(buffer.data() + at + 1, keys[i].size());
+    found &= table.find(view, key_of) == i;
+    at += keys[i].size() + 2;
+  }
+  for (const auto &key : misses) {
+    missed &= table.find(key, key_of) == id_table::npos;
+  }
+  missed &= table.find("", key_of) == id_table::npos &&
+            table.find("k", key_of) == id_table::npos;
+  // read before check builds its message, which allocates
+  const bool quiet = alloc_count.load() == before;
+  check(found && missed && quiet,
+        "colliding keys are found, misses are npos, nothing allocates");
+  const id_table saved(column<uint64_t>(
+      std::vector<uint64_t>(table.data().begin(), table.data().end())));
+  bool reloaded = saved.size() == table.size();
+  for (unsigned i = 0; i < keys.size(); ++i) {
+    reloaded &= saved.find(keys[i], key_of) == i;
+  }
+  keys.push_back("");
+  table.insert(keys.size() - 1, key_of);
+  check(reloaded && table.find("", key_of) == keys.size() - 1 &&
+            saved.find("", key_of) == id_table::npos,
+        "a table rebuilt from its slots");
+  test_dataset d = six_genes();
+  const std::string line = "g4\tg6";
+  const size_t again = alloc_count.load();
+  const unsigned g4 = d.find_sym(std::string_view(line).substr(0, 2)),
+                 g6 = d.find_sym(std::string_view(line).substr(3)),
+                 gone = d.find_sym("g7");
+  const bool still = alloc_count.load() == again;
+  check(g4 == 3 && g6 == 5 && gone == id_table::npos && still,
+        "dataset lookups by view allocate nothing");
+}
+
+// the string pools: columns that own, share and borrow their elements,
+// ids and names read back after the pools grew many times, and copies and
+// loaded snapshots whose pools stay apart from the dataset they came from
+static void test_string_pool() {
+  const char text[] = "borrowed";
+  column<char> borrowed = column<char>::borrow(text, 8);
+  column<char> shared = borrowed;
+  borrowed.append("!", 1);
+  check(std::string(shared.begin(), shared.end()) == "borrowed" &&
+            shared.is_borrowed() && !borrowed.is_borrowed() &&
+            std::string(borrowed.begin(), borrowed.end()) == "borrowed!" &&
+            std::string(text) == "borrowed",
+        "appending to a borrowed column copies it");
+  column<unsigned> first(std::vector<unsigned>{1, 2, 3});
+  column<unsigned> second = first;
+  first.push_back(4);
+  second.push_back(5);
+  second.set(0, 9);
+  check(std::vector<unsigned>(first.begin(), first.end()) ==
+                std::vector<unsigned>({1, 2, 3, 4}) &&
+            std::vector<unsigned>(second.begin(), second.end()) ==
+                std::vector<unsigned>({9, 2, 3, 5}),
+        "copies of a column keep their own elements");
+  test_dataset d;
+  auto name = [](const unsigned &i) { return std::string(i % 7, 'n'); };
+  for (unsigned a = 0; a < 500; ++a) {
+    d.add_anno("a" + std::to_string(a), name(a), a % 2 ? "" : "desc");
+  }
+  for (unsigned s = 0; s < 3000; ++s) {
+    d.add_sym("s" + std::to_string(s), name(s),
+              {"a" + std::to_string(s % 500)});
+  }
+  d.gen_mappings();
+  auto intact = [&](const test_dataset &x) {
+    bool ok = x.total_syms() >= 3000 && x.total_annos() >= 500;
+    for (unsigned a = 0; ok && a < 500; ++a) {
+      ok = x.anno_id(a) == "a" + std::to_string(a) &&
+           x.anno_name(a) == name(a) &&
+           x.anno_description(a) == (a % 2 ? "" : "desc");
+    }
+    for (unsigned s = 0; ok && s < 3000; ++s) {
+      const auto sym = x.get_sym(s);
+      ok = sym.data.sym == "s" + std::to_string(s) &&
+           sym.data.name == name(s) && x.find_sym(sym.data.sym) == s &&
+           sym.mapped.size() == 1 &&
+           *sym.mapped.begin() == s % 500;
+    }
+    return ok;
+  };
+  check(intact(d), "ids and names after the pools grew");
+  test_dataset copy = d;
+  copy.add_sym("extra", "e", {"a1"});
+  copy.add_anno("b", "", "");
+  check(intact(copy) && intact(d) && d.total_syms() == 3000 &&
+            copy.sym_id(3000) == "extra" && !d.has_sym("extra"),
+        "a copy adds to its own pools");
+  const std::string fname = "enriched_pool.snap";
+  d.save(fname);
+  test_dataset back;
+  back.load(fname);
+  check(intact(back), "pools borrowed from a snapshot");
+  back.add_sym("extra", "e");
+  back.add_anno("b", "", "");
+  check(intact(back) && back.sym_id(3000) == "extra" &&
+            back.anno_id(500) == "b" && !d.has_sym("extra"),
+        "adding to a loaded snapshot");
+  std::remove(fname.c_str());
+}
+
+// a snapshot loads back as the dataset that was saved
+static void test_snapshot() {
+  const std::string fname = "enriched_test.snap";
+  const test_dataset d = six_genes(dense_masks);
+  for (const bool masks : {true, false}) {
+    d.save(fname, masks);
+    test_dataset back;
+    back.load(fname);
+    const std::string tag = masks ? " (masks)" : " (no masks)";
+    check(same_data(d, back) && back.has_index() &&
+              back.has_masks() == masks && back.find_sym("g6") == 5 &&
+              back.find_anno("C") == 2,
+          "snapshot round trip" + tag);
+    const test_set set({"g1", "g3", "g6"}, back),
+        same({"g1", "g3", "g6"}, d);
+    check(back.count_set(set).counts == d.count_set(same).counts,
+          "snapshot counts" + tag);
+    if (!masks) {
+      back.gen_mappings(dense_masks);
+      check(back.has_masks() && back.anno_mask(2) == d.anno_mask(2) &&
+                back.sym_mask(0) == d.sym_mask(0),
+            "masks built for a snapshot saved without them");
+    }
+    check(back.count_annos(set.get_mask_ref()).counts ==
+              std::vector<unsigned>({2, 2, 2}),
+          "snapshot masks" + tag);
+    back.add_edge("g5", "B");
+    back.add_sym("g7", "g", {"A"});
+    check(back.anno_size(1) == 3 && back.anno_size(0) == 4 &&
+              same_data(d, six_genes()),
+          "edits to a loaded snapshot" + tag);
+  }
+  std::string bytes;
+  {
+    std::ifstream in(fname, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  auto refused = [&](const std::string &edited, const size_t &len) {
+    {
+      std::ofstream out(fname, std::ios::binary);
+      out.write(edited.data(), len);
+    }
+    try {
+      test_dataset bad;
+      bad.load(fname);
+    } catch (const std::runtime_error &) {
+      return true;
+    }
+    return false;
+  };
+  check(refused(bytes, bytes.size() / 2), "truncated snapshot refused");
+  // id tables with a slot that has a tag but no index, an index twice and
+  // an index missing
+  snapshot_header h;
+  std::memcpy(&h, bytes.data(), sizeof(h));
+  const size_t at = h.sections[snap_sym_index][0],
+               slots = h.sections[snap_sym_index][1] / 8;
+  std::vector<uint64_t> table(slots);
+  std::memcpy(table.data(), bytes.data() + at, slots * 8);
+  const size_t used = std::find_if(table.begin(), table.end(),
+                                   [](const uint64_t &x) { return x; }) -
+                      table.begin(),
+               free = std::find(table.begin(), table.end(), 0) - table.begin();
+  auto with_slot = [&](const size_t &i, const uint64_t &v) {
+    std::string edited = bytes;
+    std::memcpy(&edited[at + i * 8], &v, 8);
+    return edited;
+  };
+  check(refused(with_slot(used, table[used] & 0xffffffff00000000ULL),
+                bytes.size()) &&
+            refused(with_slot(free, table[used]), bytes.size()) &&
+            refused(with_slot(used, 0), bytes.size()),
+        "snapshot with a bad id table refused");
+  check(!refused(bytes, bytes.size()), "intact snapshot loads");
+  std::remove(fname.c_str());
+}
+
+// random edits to an indexed dataset, enough to pass the point where the
+// index is rebuilt, against a dataset built from the final edges at once
+static void test_edits() {
+  for (const unsigned masks :
+       {no_masks, dense_masks, compressed_masks, all_masks}) {
+    const std::string tag = mask_name(masks);
+    test_rng rng(7 + masks);
+    unsigned syms = 40, annos = 12;
+    std::vector<std::vector<bool>> edges(syms, std::vector<bool>(annos));
+    test_dataset d;
+    for (unsigned a = 0; a < annos; ++a) {
+      d.add_anno("t" + std::to_string(a), "t", "");
+    }
+    for (unsigned s = 0; s < syms; ++s) {
+      std::vector<std::string> mapped;
+      for (unsigned a = 0; a < annos; ++a) {
+        if (rng.next() % 4 == 0) {
+          edges[s][a] = true;
+          mapped.push_back("t" + std::to_string(a));
+        }
+      }
+      d.add_sym("g" + std::to_string(s), "g", mapped);
+    }
+    d.gen_mappings(masks);
+    bool reported = true;
+    unsigned changes = 0;
+    for (unsigned i = 0; i < 4000; ++i) {
+      const unsigned pick = rng.next() % 100;
+      if (pick == 0) {
+        edges.emplace_back(annos);
+        d.add_sym("g" + std::to_string(syms++), "g", {"t0"});
+        edges.back()[0] = true;
+      } else if (pick == 1) {
+        for (auto &row : edges)
+          row.push_back(false);
+        d.add_anno("t" + std::to_string(annos++), "t", "", {"g1"});
+        edges[1].back() = true;
+      } else {
+        const unsigned s = rng.next() % syms, a = rng.next() % annos;
+        const bool add = pick % 2;
+        const std::string sym = "g" + std::to_string(s),
+                          anno = "t" + std::to_string(a);
+        const bool changed =
+            add ? d.add_edge(sym, anno) : d.remove_edge(sym, anno);
+        reported &= changed == (edges[s][a] != add);
+        changes += changed;
+        edges[s][a] = add;
+      }
+    }
+    check(reported && changes > 1100, "edits report what changed" + tag);
+    test_dataset full;
+    for (unsigned a = 0; a < annos; ++a) {
+      full.add_anno("t" + std::to_string(a), "t", "");
+    }
+    for (unsigned s = 0; s < syms; ++s) {
+      std::vector<std::string> mapped;
+      for (unsigned a = 0; a < annos; ++a) {
+        if (edges[s][a])
+          mapped.push_back("t" + std::to_string(a));
+      }
+      full.add_sym("g" + std::to_string(s), "g", mapped);
+    }
+    full.gen_mappings(masks);
+    check(same_data(d, full), "edited index matches a rebuild" + tag);
+    bool sizes = true, dense = true, compressed = true;
+    for (unsigned a = 0; a < annos; ++a) {
+      sizes &= d.anno_size(a) == full.anno_size(a);
+      if (d.has_masks())
+        dense &= d.anno_mask(a) == full.anno_mask(a);
+      if (d.has_compressed_masks()) {
+        compressed &= d.anno_set(a).count() == full.anno_set(a).count();
+        for (unsigned s = 0; s < syms; ++s)
+          compressed &= d.anno_set(a).test(s) == edges[s][a];
+      }
+    }
+    check(sizes, "edited sizes match a rebuild" + tag);
+    check(dense && d.has_masks() == full.has_masks(),
+          "edited masks match a rebuild" + tag);
+    check(compressed && d.has_compressed_masks() == full.has_compressed_masks(),
+          "edited compressed masks match a rebuild" + tag);
+    test_set set({"g0", "g3", "g5", "g8", "g13", "g21", "g34"}, d);
+    check(d.count_set(set).counts == full.count_set(set).counts,
+          "edited counts match a rebuild" + tag);
+  }
+}
+
+// compressed masks against plain sorted lists, over array, bitmap and run
+// chunks on both sides of the 65536 chunk boundary, and the counts of a
+// dataset that large by every path
+static void test_roaring() {
+  const unsigned n = 70000;
+  test_rng rng(99);
+  std::vector<std::vector<unsigned>> lists(4);
+  for (unsigned i = 0; i < n; ++i) {
+    if (rng.next() % 97 == 0)
+      lists[0].push_back(i);
+    if (rng.next() % 2 == 0)
+      lists[1].push_back(i);
+    if (i >= 40000 && i < 69000 && i % 5000 != 0)
+      lists[2].push_back(i);
+  }
+  lists[3] = {0, 1, 2, 65535, 65536, 65537, 69999};
+  std::vector<roaring_mask> sets;
+  bool same = true, kinds[3] = {false, false, false};
+  for (const auto &list : lists) {
+    sets.emplace_back(list);
+    std::vector<unsigned> back;
+    sets.back().for_each([&](const unsigned &x) { back.push_back(x); });
+    same &= back == list && sets.back().count() == list.size();
+    for (const auto &c : sets.back().containers())
+      kinds[c.type] = true;
+    for (unsigned i = 0; i < n; i += 7)
+      same &= sets.back().test(i) ==
+              std::binary_search(list.begin(), list.end(), i);
+  }
+  check(same, "compressed masks hold their lists");
+  check(kinds[roaring_mask::array] && kinds[roaring_mask::bitmap] &&
+            kinds[roaring_mask::run],
+        "compressed masks use every chunk kind");
+  bool counted = true;
+  for (size_t i = 0; i < lists.size(); ++i) {
+    for (size_t j = 0; j < lists.size(); ++j) {
+      std::vector<unsigned> both;
+      std::set_intersection(lists[i].begin(), lists[i].end(),
+                            lists[j].begin(), lists[j].end(),
+                            std::back_inserter(both));
+      counted &= intersect_count(sets[i], sets[j]) == both.size();
+    }
+  }
+  check(counted, "compressed intersections match sorted lists");
+  // the same lists as terms of a dataset
+  test_dataset d;
+  for (unsigned t = 0; t < lists.size(); ++t) {
+    d.add_anno("t" + std::to_string(t), "t", "");
+  }
+  for (unsigned s = 0; s < n; ++s) {
+    d.add_sym("g" + std::to_string(s), "g");
+  }
+  std::vector<std::pair<unsigned, unsigned>> edges;
+  for (unsigned t = 0; t < lists.size(); ++t) {
+    for (const unsigned &s : lists[t])
+      edges.emplace_back(s, t);
+  }
+  d.add_edges(edges);
+  d.gen_mappings(all_masks);
+  std::vector<std::string> picked;
+  for (unsigned s = 0; s < n; s += 1 + rng.next() % 20) {
+    picked.push_back("g" + std::to_string(s));
+  }
+  const test_set set(picked, d);
+  std::vector<unsigned> want(lists.size(), 0);
+  for (unsigned t = 0; t < lists.size(); ++t) {
+    for (const unsigned &s : set.get_idxs())
+      want[t] += std::binary_search(lists[t].begin(), lists[t].end(), s);
+  }
+  const auto walked = d.count_annos(set.get_idxs()),
+             dense = d.count_annos(set.get_mask_ref()),
+             compressed = d.count_annos(set.get_compressed_ref());
+  check(walked.counts == want && dense.counts == walked.counts &&
+            compressed.counts == walked.counts &&
+            compressed.total == walked.total,
+        "compressed counts match dense and index counts");
+  // edits split the runs of t2 and grow t3, then the cheapest path counts
+  const size_t before = d.compressed_words();
+  for (unsigned s = 41001; s < 42000; s += 9) {
+    d.remove_edge("g" + std::to_string(s), "t2");
+    lists[2].erase(std::find(lists[2].begin(), lists[2].end(), s));
+  }
+  for (unsigned s = 100; s < 4000; s += 3) {
+    d.add_edge("g" + std::to_string(s), "t3");
+    lists[3].push_back(s);
+  }
+  std::sort(lists[3].begin(), lists[3].end());
+  size_t words = 0;
+  for (unsigned t = 0; t < lists.size(); ++t) {
+    want[t] = 0;
+    for (const unsigned &s : set.get_idxs())
+      want[t] += std::binary_search(lists[t].begin(), lists[t].end(), s);
+    words += d.anno_set(t).bytes() / 8;
+  }
+  check(d.compressed_words() == words && words != before,
+        "edits keep the compressed size");
+  const auto edited = d.count_set(set),
+             edited_walk = d.count_annos(set.get_idxs());
+  check(edited.counts == want && edited_walk.counts == want &&
+            d.count_annos(set.get_compressed_ref()).counts == want,
+        "counts after edits");
+}
+
+// five variants over the genes of six_genes: v1 {g1}, v2 {g1, g3},
+// v3 {g4}, v4 {gX} which is not a gene there, v5 {g6}
+static void test_compose() {
+  const test_dataset genes = six_genes();
+  test_dataset variants;
+  for (const char *g : {"g3", "g1", "g4", "gX", "g6"}) {
+    variants.add_anno(g, "gene", "");
+  }
+  variants.add_sym("v1", "v", {"g1"});
+  variants.add_sym("v2", "v", {"g3", "g1"});
+  variants.add_sym("v3", "v", {"g4"});
+  variants.add_sym("v4", "v", {"gX"});
+  variants.add_sym("v5", "v", {"g6"});
+  variants.gen_mappings();
+  const std::vector<std::vector<unsigned>> want = {
+      {0, 1}, {0, 1, 2}, {2}, {}, {0, 2}};
+  for (const unsigned masks :
+       {no_masks, dense_masks, compressed_masks, all_masks}) {
+    const std::string tag = mask_name(masks);
+    const composed_dataset<test_dataset, test_dataset> joined(
+        variants, genes, masks, 2);
+    const auto &v = joined.variant_level();
+    bool rows = v.total_syms() == 5 && v.total_annos() == 3 &&
+                v.anno_id(2) == "C" && v.sym_id(4) == "v5";
+    for (unsigned i = 0; i < 5; ++i) {
+      const idx_span row = v.sym_row(i);
+      rows &= std::vector<unsigned>(row.begin(), row.end()) == want[i];
+    }
+    check(rows && joined.linked_genes() == 4, "composed rows" + tag);
+    check(joined.genes_of({0, 1, 3, 4}) == std::vector<unsigned>({0, 2, 5}),
+          "genes of variants" + tag);
+    const auto set = joined.variant_set({"v1", "v2", "v5", "v9"});
+    const auto hit = joined.gene_set(set);
+    check(hit.get_idxs() == std::vector<unsigned>({0, 2, 5}) &&
+              joined.gene_set({"v4"}).get_idxs().empty(),
+          "gene sets of variants" + tag);
+    check(v.count_set(set).counts == std::vector<unsigned>({3, 2, 2}) &&
+              joined.gene_level().count_set(hit).counts ==
+                  std::vector<unsigned>({2, 2, 2}),
+          "composed counts per variant and per gene" + tag);
+  }
+}
+
+// redundancy groups of six terms over the test set g1..g9; g10 is outside
+// it. by Jaccard T1 {g1..g4, g10} and T2 {g1..g5} overlap by 0.8, T3
+// {g6, g7} and T4 {g6, g7, g8} by 2/3, T5 {g9} by nothing; T6 is not
+// enriched
+static void test_redundancy() {
+  test_dataset d;
+  const std::vector<std::vector<unsigned>> terms = {
+      {1, 2, 3, 4, 10}, {1, 2, 3, 4, 5}, {6, 7}, {6, 7, 8}, {9}, {1, 2, 3}};
+  for (unsigned t = 0; t < terms.size(); ++t) {
+    d.add_anno("T" + std::to_string(t + 1), "t", "");
+  }
+  for (unsigned g = 1; g <= 10; ++g) {
+    d.add_sym("g" + std::to_string(g), "g");
+  }
+  for (unsigned t = 0; t < terms.size(); ++t) {
+    for (const unsigned &g : terms[t])
+      d.add_edge("g" + std::to_string(g), "T" + std::to_string(t + 1));
+  }
+  d.gen_mappings();
+  const test_set set({"g1", "g2", "g3", "g4", "g5", "g6", "g7", "g8", "g9"},
+                     d);
+  // best first: T2, T3, T1, T5, T4, then T6
+  ResultDataset res;
+  res.add("test",
+          {{1, 0.001, true},
+           {2, 0.002, true},
+           {0, 0.003, true},
+           {4, 0.004, true},
+           {3, 0.005, true},
+           {5, 0.5, false}},
+          d);
+  check(near(jaccard(4, 4, 5, 9), 0.8) && near(kappa(4, 4, 5, 9), 32.0 / 41) &&
+            near(kappa(2, 2, 3, 9), 24.0 / 33) && kappa(0, 4, 2, 9) < 0,
+        "similarities");
+  for (const unsigned threads : {1u, 3u}) {
+    const std::string tag = " (threads " + std::to_string(threads) + ")";
+    const auto loose = cluster_terms(res, 0, set, d, 0.5, 2000, threads);
+    check(loose.rows == std::vector<unsigned>({0, 1, 2, 3, 4}) &&
+              loose.cluster == std::vector<unsigned>({0, 1, 0, 2, 1}) &&
+              loose.representatives == std::vector<unsigned>({0, 1, 3}),
+          "clusters at 0.5" + tag);
+    const auto strict = cluster_terms(res, 0, set, d, 0.7, 2000, threads);
+    check(strict.cluster == std::vector<unsigned>({0, 1, 0, 2, 3}) &&
+              strict.representatives ==
+                  std::vector<unsigned>({0, 1, 3, 4}),
+          "clusters at 0.7" + tag);
+    const auto by_kappa =
+        cluster_terms<kappa>(res, 0, set, d, 0.75, 2000, threads);
+    check(by_kappa.cluster == std::vector<unsigned>({0, 1, 0, 2, 3}),
+          "kappa clusters at 0.75" + tag);
+    const auto best = cluster_terms(res, 0, set, d, 0.5, 3, threads);
+    check(best.rows == std::vector<unsigned>({0, 1, 2}) &&
+              best.cluster == std::vector<unsigned>({0, 1, 0}),
+          "clusters of the top rows" + tag);
+  }
+  ResultDataset kept;
+  reduce_redundancy(res, 0, set, d, kept);
+  check(kept.sections().size() == 1 &&
+            kept.sections()[0].name == "test (representatives)" &&
+            kept.size() == 3 && kept.anno(0) == 1 && kept.anno(1) == 2 &&
+            kept.anno(2) == 4 && near(kept.stat(2), 0.004),
+        "representatives section");
+}
+
+// random terms drawn around a few shared cores, clustered with tiles of a
+// few terms against every pair compared directly and joined by relabelling
+static void test_redundancy_tiles() {
+  test_rng rng(31);
+  const unsigned syms = 150, annos = 70;
+  test_dataset d;
+  std::vector<std::vector<bool>> edges(annos, std::vector<bool>(syms));
+  for (unsigned a = 0; a < annos; ++a) {
+    d.add_anno("t" + std::to_string(a), "t", "");
+  }
+  for (unsigned s = 0; s < syms; ++s) {
+    d.add_sym("g" + std::to_string(s), "g");
+  }
+  for (unsigned a = 0; a < annos; ++a) {
+    const unsigned core = (rng.next() % 8) * 15;
+    for (unsigned s = core; s < core + 15; ++s) {
+      edges[a][s] = rng.next() % 4 != 0;
+    }
+    for (unsigned k = 0; k < 3; ++k) {
+      edges[a][rng.next() % syms] = true;
+    }
+    for (unsigned s = 0; s < syms; ++s) {
+      if (edges[a][s])
+        d.add_edge("g" + std::to_string(s), "t" + std::to_string(a));
+    }
+  }
+  d.gen_mappings();
+  std::vector<std::string> names;
+  std::vector<bool> in_set(syms);
+  for (unsigned s = 0; s < syms; ++s) {
+    if (rng.next() % 3 != 0) {
+      in_set[s] = true;
+      names.push_back("g" + std::to_string(s));
+    }
+  }
+  const test_set set(names, d);
+  const unsigned m = set.get_idxs().size();
+  std::vector<test_result> rows;
+  for (unsigned a = 0; a < annos; ++a) {
+    rows.push_back({static_cast<unsigned>(rng.next() % annos),
+                    0.001 * (a + 1), rng.next() % 5 != 0});
+  }
+  ResultDataset res;
+  res.add("test", rows, d);
+  // the reference: enriched rows up to top, pairs by the edges above
+  const auto reference = [&](const auto &sim, const double &threshold,
+                             const unsigned &top) {
+    term_clusters out;
+    for (unsigned i = 0; i < rows.size() && out.rows.size() < top; ++i) {
+      if (rows[i].enriched)
+        out.rows.push_back(i);
+    }
+    const unsigned n = out.rows.size();
+    std::vector<unsigned> label(n);
+    for (unsigned i = 0; i < n; ++i)
+      label[i] = i;
+    for (unsigned i = 0; i < n; ++i) {
+      for (unsigned j = i + 1; j < n; ++j) {
+        const auto &x = edges[rows[out.rows[i]].anno],
+                   &y = edges[rows[out.rows[j]].anno];
+        unsigned both = 0, a = 0, b = 0;
+        for (unsigned s = 0; s < syms; ++s) {
+          a += in_set[s] && x[s];
+          b += in_set[s] && y[s];
+          both += in_set[s] && x[s] && y[s];
+        }
+        if (sim(both, a, b, m) < threshold || label[i] == label[j])
+          continue;
+        const unsigned from = std::max(label[i], label[j]),
+                       to = std::min(label[i], label[j]);
+        for (unsigned &l : label) {
+          if (l == from)
+            l = to;
+        }
+      }
+    }
+    std::vector<unsigned> id_of(n, id_table::npos);
+    for (unsigned t = 0; t < n; ++t) {
+      if (id_of[label[t]] == id_table::npos) {
+        id_of[label[t]] = out.representatives.size();
+        out.representatives.push_back(out.rows[t]);
+      }
+      out.cluster.push_back(id_of[label[t]]);
+    }
+    return out;
+  };
+  const auto same = [](const term_clusters &x, const term_clusters &y) {
+    return x.rows == y.rows && x.cluster == y.cluster &&
+           x.representatives == y.representatives;
+  };
+  bool jaccard_ok = true, kappa_ok = true, joined = false;
+  for (const unsigned threads : {1u, 3u}) {
+    for (const unsigned tile : {0u, 3u, 8u}) {
+      for (const unsigned top : {2000u, 25u}) {
+        for (const double threshold : {0.2, 0.4, 0.6}) {
+          const auto j = reference(jaccard, threshold, top);
+          jaccard_ok &= same(cluster_terms(res, 0, set, d, threshold, top,
+                                           threads, tile),
+                             j);
+          joined |= j.representatives.size() + 3 < j.rows.size();
+          kappa_ok &= same(cluster_terms<kappa>(res, 0, set, d, threshold,
+                                                top, threads, tile),
+                           reference(kappa, threshold, top));
+        }
+      }
+    }
+  }
+  check(joined, "random terms form clusters");
+  check(jaccard_ok, "tiled jaccard clusters match every pair");
+  check(kappa_ok, "tiled kappa clusters match every pair");
+}
+
+// the in universe sizes follow every kind of edit
+static void test_background() {
+  test_dataset d = two_terms(all_masks);
+  std::vector<std::string> universe;
+  for (unsigned i = 0; i < 12; ++i) {
+    universe.push_back("s" + std::to_string(i));
+  }
+  Background<test_dataset> bg(universe, d);
+  check(bg.total_syms() == 12 && bg.anno_size(0) == 5 &&
+            bg.anno_size(1) == 7,
+        "background sizes");
+  check(bg.count_set(test_set({"s1", "s7", "s15"}, d)).total == 2,
+        "test set restricted to the universe");
+  d.add_edge("s7", "A");
+  d.add_edge("s9", "A");
+  d.remove_edge("s1", "A");
+  check(bg.anno_size(0) == 5, "background sizes wait for a query");
+  bg.count_set(test_set({"s1"}, d));
+  check(bg.anno_size(0) == 6, "background sizes after edge edits");
+  d.add_anno("C", "c", "");
+  d.add_edge("s3", "C");
+  d.add_sym("s20", "s", {"C"});
+  bg.restrict(test_set({"s20"}, d));
+  check(bg.total_annos() == 3 && bg.anno_size(2) == 1 && !bg.contains(20),
+        "background sizes after new data");
+  const auto counts = bg.count_set(test_set({"s7", "s9", "s2", "s19"}, d));
+  check(counts.total == 3 && counts.counts[0] == 3,
+        "background counts after edits");
+}
+
+int main(int argc, char **argv) {
+  const std::vector<std::pair<const char *, std::function<void()>>> tests = {
+      {"kernels", test_kernels},
+      {"counts", test_counts},
+      {"pvalues", test_pvalues},
+      {"threads", test_threads},
+      {"lazy masks", test_lazy_masks},
+      {"profile", test_profile},
+      {"top_k", test_top_k},
+      {"permutation", test_permutation},
+      {"ontology", test_ontology},
+      {"tsv loader", test_tsv_loader},
+      {"loaders", test_loaders},
+      {"gsea", test_gsea},
+      {"id table", test_id_table},
+      {"string pool", test_string_pool},
+      {"snapshot", test_snapshot},
+      {"edits", test_edits},
+      {"roaring", test_roaring},
+      {"compose", test_compose},
+      {"redundancy", test_redundancy},
+      {"redundancy tiles", test_redundancy_tiles},
+      {"background", test_background},
+      {"server", test_server},
+      {"writers", test_writers},
+  };
+  for (const auto &t : tests) {
+    bool run = argc < 2;
+    for (int i = 1; i < argc; ++i) {
+      run |= std::strcmp(argv[i], t.first) == 0;
+    }
+    if (!run)
+      continue;
+    const unsigned before = failures;
+    t.second();
+    std::printf("%s %s\n", failures == before ? "ok  " : "FAIL", t.first);
+  }
+  std::printf("%u checks, %u failed\n", checks, failures);
+  return failures ? 1 : 0;
+}